@@ -41,7 +41,7 @@
 #define SELF_ACCEPT_MAX_T_MS    (2*1000)
 
 #define LED_BLINK_T_ON           (LED_BLINK_PERIOD/2)                                 // ms
-#define LED_BLINK_T_OFF          (led_blink_period_t - led_blink_ON_t)  // ms
+#define LED_BLINK_T_OFF          ((uint16_t)(led_blink_period_t - led_blink_ON_t))  // ms
 #define LED_BLINK_PERIOD         (780)                                 // ms
 #define LED_BLINK_NUM_INF        255
 
@@ -51,6 +51,11 @@
 #define U2F_TEMP_KEY_SLOT			2
 #define U2F_WKEY_KEY_SLOT			1
 #define U2F_DEVICE_KEY_SLOT			5
+// private key slots (KeyConfig 0x1300) keeping derived keys resident,
+// the least recently used one is overwritten. Slot 0 is left to the
+// on-chip tests, U2F_TEMP_KEY_SLOT receives the keys of REGISTER.
+#define U2F_KEY_SLOTS				{2, 4, 6, 10, 12, 14}
+#define U2F_KEY_SLOTS_NUM			6
 
 // this a BCD, e.g. version 12.34 -> 0x1234
 #define NK_FIRMWARE_VERSION			0x0100
@@ -64,6 +69,8 @@
 //#define DISABLE_WATCHDOG
 //#define FAKE_TOUCH
 //#define DEBUG_GATHER_ATECC_ERRORS
+// time the phases of U2F requests, read with vendor command 0xcd
+//#define U2F_PROFILE
 
 #define FEAT_FACTORY_RESET
 #define FEAT_SANITY_CHECK
@@ -80,8 +87,22 @@
 //#define U2F_PRINT
 //#define U2F_BLINK_ERRORS
 
+// Host build of the U2F core (tools/hostsim), always a production-like
+// stage 2 firmware with the hardware specific switches turned off
+#ifdef U2F_HOST_BUILD
+	#undef ATECC_SETUP_DEVICE
+	#undef FAKE_TOUCH
+	#undef DISABLE_WATCHDOG
+	#undef U2F_PRINT
+	#undef U2F_BLINK_ERRORS
+	#undef __BUTTON_TEST__
+	#define _SECURE_EEPROM
+	#define U2F_PROFILE
+#endif
+
 #ifdef _PRODUCTION_RELEASE
 	#undef DEBUG_GATHER_ATECC_ERRORS
+	#undef U2F_PROFILE
 	#undef FAKE_TOUCH
 	#undef SHOW_TOUCH_REGISTERED
 	#undef DISABLE_WATCHDOG
@@ -100,6 +121,11 @@
 	#endif
 #endif
 
+// the setup firmware handles no U2F requests to time
+#ifdef ATECC_SETUP_DEVICE
+	#undef U2F_PROFILE
+#endif
+
 
 typedef enum
 {
@@ -165,11 +191,40 @@ struct config_msg
 	uint8_t buf[HID_PACKET_SIZE-1];
 };
 
-extern uint8_t hidmsgbuf[64];
+// number of received HID frames buffered, must be a power of 2
+#define HID_RX_QUEUE_LEN	4
+// number of HID frames queued for sending, must be a power of 2
+#define HID_TX_QUEUE_LEN	4
+// number of U2F HID channels, must be a power of 2. An INIT evicts
+// the least recently used idle channel when all are taken.
+#define U2FHID_CHANNELS		8
+
+struct hid_rx_stats
+{
+	// most frames waiting for the main loop at once
+	uint8_t high_water;
+	// times the ring filled up and the host had to be NAKed
+	uint16_t overflows;
+};
+
+extern uint8_t hidmsgbuf[HID_RX_QUEUE_LEN][HID_PACKET_SIZE];
+extern struct hid_rx_stats hid_rx_stats;
 extern data struct APP_DATA appdata;
 
 void set_app_u2f_hid_msg(struct u2f_hid_msg * msg );
 
+// hid_rx_init empty the ring of received frames
+void hid_rx_init();
+
+// hid_rx_poll arm EP1OUT if it is idle and a slot is free
+void hid_rx_poll();
+
+// hid_rx_peek oldest received frame, NULL if there is none
+struct u2f_hid_msg * hid_rx_peek();
+
+// hid_rx_release drop the oldest frame once it has been dispatched
+void hid_rx_release();
+
 void set_app_error(APP_ERROR_CODE ec);
 
 uint8_t get_app_error();
@@ -178,6 +233,18 @@ uint8_t get_app_state();
 
 void set_app_state(APP_STATE s);
 
+// app_init reset the application state and the U2F HID layer
+void app_init();
+
+// app_loop single pass of the main loop: button and LED handling,
+// USB reception and dispatch of the received HID message
+void app_loop();
+
+// app_service the part of app_loop that does not use the ATECC, run
+// while waiting for it: watchdog, button, LED, EP1OUT and the U2F HID
+// time-outs of the channels not being served. Call at most once a ms.
+void app_service();
+
 
 
 #ifdef ATECC_SETUP_DEVICE
@@ -205,6 +205,90 @@ void atecc_wake();
 void atecc_sleep();
 extern uint8_t atecc_used;
 
+// ms a session keeps the ATECC awake before it is woken again, well within
+// the shortest watchdog time-out (0.7 s) even with the longest command
+#define ATECC_SESSION_MS		500
+
+// atecc_session_begin keep the ATECC awake between the commands that
+// follow, instead of a wake and an idle around every one of them
+void atecc_session_begin();
+
+// atecc_session_end put the ATECC to idle, TempKey is kept
+void atecc_session_end();
+
+// entries of the execution time table, by opcode and for some by mode
+#define ATECC_TIMING_OPS		15
+#define ATECC_TIMING_ANY_P1		0xff
+// response wait of commands without an entry
+#define ATECC_TIMING_MAX_MS		115
+// a command fails if busy that long past its maximum execution time
+#define ATECC_TIMING_SLACK_MS	10
+// ms between polls of a busy ATECC
+#define ATECC_POLL_STEP_MS		1
+// responses found at the first poll before it is tried a ms earlier
+#define ATECC_TIMING_PROBE		8
+
+// per opcode and mode: ms after the command the first poll is made,
+// learnt from when the responses came; and how many polls were NACKed
+struct atecc_timing
+{
+	uint8_t opcode;
+	uint8_t p1;
+	uint8_t expect_ms;
+	uint8_t worst_ms;
+	uint16_t commands;
+	uint16_t polls;
+	uint16_t nacks;
+};
+extern struct atecc_timing atecc_timing[ATECC_TIMING_OPS];
+
+// atecc_timing_init start over from the typical execution times
+void atecc_timing_init();
+
+// per entry of the execution time table, and a last one for the other
+// commands: what it took to get the responses, to tell tokens with a
+// marginal bus. The error counters stop at 0xff, that many errors tell
+// enough.
+#define ATECC_HEALTH_OPS		(ATECC_TIMING_OPS + 1)
+// one byte error counters of an entry, from send_nacks on
+#define ATECC_HEALTH_ERRORS		7
+
+struct atecc_health
+{
+	uint16_t commands;
+	uint16_t polls;
+	uint8_t send_nacks;
+	// responses failing our CRC check, or commands failing the ATECC's
+	uint8_t crc_errors;
+	// responses cut short or of a bad length
+	uint8_t truncated;
+	uint8_t watchdog_resends;
+	uint8_t wake_resends;
+	// transfers ended by an SMBus recovery
+	uint8_t bus_errors;
+	// commands given up on
+	uint8_t failures;
+};
+extern struct atecc_health atecc_health[ATECC_HEALTH_OPS];
+
+// atecc_health_reset clear the health counters, the learnt timing is kept
+void atecc_health_reset();
+
+// random bytes of the ATECC kept ahead of use, one RNG command fills it
+#define ATECC_RNG_POOL_SIZE		32
+// ms without HID traffic before the pool is refilled, a refill keeps
+// the ATECC from the next request for about 25 ms
+#define ATECC_RNG_IDLE_MS		50
+
+// atecc_rng copy random bytes to @out, from the pool when it holds enough
+//  @len at most ATECC_RNG_POOL_SIZE
+//  @return 0 on success, -1 if the RNG command failed
+int8_t atecc_rng(uint8_t * out, uint8_t len);
+
+// atecc_rng_refill top up the pool, call from the main loop while idle.
+// Does nothing after a failed refill until atecc_rng succeeds again.
+void atecc_rng_refill();
+
 int8_t atecc_send(uint8_t cmd, uint8_t p1, uint16_t p2,
 					uint8_t * buf, uint8_t len);
 
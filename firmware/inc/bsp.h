@@ -40,6 +40,9 @@ extern SI_SEGMENT_VARIABLE(myUsbDevice, USBD_Device_TypeDef, MEM_MODEL_SEG);
 SI_SBIT(U2F_BUTTON,       SFR_P0, 1);
 SI_SBIT(U2F_LED,          SFR_P0, 6);
 SI_SBIT(U2F_BUTTON_RESET, SFR_P0, 7);
+// SMBus pins, driven by hand only to free a stuck bus
+SI_SBIT(U2F_SDA,          SFR_P1, 1);
+SI_SBIT(U2F_SCL,          SFR_P1, 2);
 
 /*
  * U2F_BUTTON_RESET is a MTPM pin. Requires HIGH state to keep
@@ -60,11 +63,56 @@ SI_SBIT(U2F_BUTTON_RESET, SFR_P0, 7);
 #define watchdog()
 #endif
 #define reboot()	             (RSTSRC = 1 << 4)
+#ifndef U2F_HOST_BUILD
 #define get_ms()                  _MS_
+// get_us microseconds, wraps after 71 minutes; for profiling only
+uint32_t get_us();
+#else
+// virtual clock of the host build, see tools/hostsim
+uint32_t host_get_ms();
+#define get_ms()                  host_get_ms()
+uint32_t host_get_us();
+#define get_us()                  host_get_us()
+#endif
+
+// mcu_cycles account for @n cycles of a long computation, the host build
+// advances its virtual clock as plain code runs in no time there
+#ifndef U2F_HOST_BUILD
+#define mcu_cycles(n)
+#else
+void host_mcu_cycles(uint32_t n);
+#define mcu_cycles(n)             host_mcu_cycles(n)
+#endif
+
+struct usb_tx_stats
+{
+	uint16_t packets;
+	// most packets waiting for EP1IN at once
+	uint8_t high_water;
+	// times usb_write found the queue full, and the ms it spent waiting
+	uint16_t full_waits;
+	uint16_t blocked_ms;
+	// ms the packets of the last response spent in the queue before
+	// being loaded into EP1IN, summed, and the worst response so far
+	uint16_t last_wait_ms;
+	uint16_t max_wait_ms;
+};
+
+extern struct usb_tx_stats usb_tx_stats;
 
 void u2f_delay  (uint32_t ms);
+
+// usb_write queue a packet for EP1IN, returns once it is queued
 void usb_write  (uint8_t* buf, uint8_t len);
 
+// usb_write_code queue a packet whose payload stays in code memory,
+// only the header is copied and the payload goes to the FIFO from flash
+//  @hdr U2F HID packet header, @hdr_len + @len must be a whole packet
+void usb_write_code(uint8_t* hdr, uint8_t hdr_len, uint8_t code * payload, uint8_t len);
+
+// usb_write_complete EP1IN transfer complete, load the next packet
+void usb_write_complete();
+
 #ifdef U2F_PRINT
 
 	void dump_hex(uint8_t* hex, uint8_t len);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * crc16.h
+ * 		CRC-16 of the ATECC508A I2C packets: polynomial 0x8005, data bits
+ * 		taken least significant first, initial value 0. The value is kept
+ * 		in the form it is sent in, (uint8_t)crc first, so it needs no bit
+ * 		reversal at the end like feed_crc() does.
+ *
+ */
+
+#ifndef CRC16_H_
+#define CRC16_H_
+
+#include <stdint.h>
+
+// implementations of crc16_feed, per byte: a shift and XOR for each bit,
+// two lookups in 48 bytes of tables, or one in 768 bytes; all in code memory
+#define CRC16_BITWISE		0
+#define CRC16_NIBBLE		1
+#define CRC16_BYTE			2
+
+#ifndef CRC16_IMPL
+#define CRC16_IMPL			CRC16_BYTE
+#endif
+
+// crc16_feed accumulate byte @b to @crc
+uint16_t crc16_feed(uint16_t crc, uint8_t b);
+
+// CRC16_FEED crc16_feed without the call, for SMBUS0_ISR
+#if CRC16_IMPL == CRC16_BYTE
+extern code uint16_t crc16_byte_table[256];
+extern code uint8_t crc16_rev8_table[256];
+#define CRC16_FEED(crc, b)	((crc) = ((crc) << 8) ^ \
+		crc16_byte_table[(uint8_t)((crc) >> 8) ^ crc16_rev8_table[(b)]])
+#else
+#define CRC16_FEED(crc, b)	((crc) = crc16_feed((crc), (b)))
+#endif
+
+#endif /* CRC16_H_ */
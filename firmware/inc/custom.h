@@ -38,6 +38,27 @@
 #define U2F_CUSTOM_UPDATE_CONFIG		(U2FHID_VENDOR_FIRST+4)
 #define U2F_CUSTOM_STATUS		(U2FHID_VENDOR_FIRST+5)
 #define U2F_SANITY_CHECK		(U2FHID_VENDOR_FIRST+6)
+#define U2F_CUSTOM_USB_STATS		(U2FHID_VENDOR_FIRST+7)
+#define U2F_CUSTOM_TAG_CACHE_STATS		(U2FHID_VENDOR_FIRST+8)
+// big endian byte count in, that many random bytes out
+#define U2F_CUSTOM_RNG_STREAM		(U2FHID_VENDOR_FIRST+9)
+// per ATECC opcode and mode: opcode, P1 (0xff any), first poll and worst
+// response ms, then big endian counts of commands, polls and NACKed polls
+#define U2F_CUSTOM_ATECC_TIMING		(U2FHID_VENDOR_FIRST+10)
+// big endian SMBus time-outs, bus errors, SCL time-outs, recoveries,
+// recoveries with SDA held low and ATECC commands retried after one
+#define U2F_CUSTOM_SMB_STATS		(U2FHID_VENDOR_FIRST+11)
+// per ATECC opcode and mode, a last entry with opcode 0 for the others:
+// opcode, P1 (0xff any), big endian counts of commands and polls, then
+// one byte counts, up to 0xff, of NACKed sends, CRC errors, truncated
+// reads, watchdog and wake resends, bus errors and failures. A non-zero
+// first request byte clears them and the SMBus stats after they are read.
+#define U2F_CUSTOM_ATECC_HEALTH		(U2FHID_VENDOR_FIRST+12)
+// the last U2F requests, oldest first, after PROFILE_UNIT_US, the number
+// of phases and of profiles: INS, P1, big endian status, total us and
+// the time of each phase in PROFILE_UNIT_US. A non-zero first request
+// byte clears them after they are read.
+#define U2F_CUSTOM_PROFILE		(U2FHID_VENDOR_FIRST+13)
 
 
 
@@ -48,6 +48,60 @@ struct smb_interrupt_interface
 	uint8_t preflags;
 };
 
+// A transfer queued with smb_queue: write_buf and then write_ext_buf are
+// written, and if read_len is set, the response is read after a new start.
+// The ISR fills in the results and sets status to SMB_XFER_DONE.
+struct smb_xfer
+{
+	uint8_t addr;
+	uint8_t * write_buf;
+	uint8_t write_len;
+	// optional, written after write_buf and covered by the same CRC
+	uint8_t * write_ext_buf;
+	uint8_t write_ext_len;
+	// on completion the length from the packet, if it fitted
+	uint8_t * read_buf;
+	uint8_t read_len;
+	// CRC-16 of what was read (without its own CRC), or of the write
+	uint16_t crc;
+	// SMB_RECV_NACK, SMB_READ_TRUNC and SMB_BUS_ERROR of the transfer
+	uint8_t flags;
+	volatile uint8_t status;
+};
+
+// struct smb_xfer status
+#define SMB_XFER_IDLE		0
+#define SMB_XFER_QUEUED		1
+#define SMB_XFER_WRITTEN	2	// written, the read is next
+#define SMB_XFER_DONE		3
+
+// transfers waiting for the bus, the ISR starts the next one when a
+// transfer ends; a power of 2
+#define SMB_QUEUE_LEN		2
+
+// ms a transfer may take from being queued, the longest (a PRIVWRITE)
+// is about 6 ms on the wire; the bus is recovered after that
+#define SMB_XFER_TIMEOUT_MS		15
+// SCL pulses to make a slave let go of SDA, one byte and its ACK
+#define SMB_CLOCK_OUT_PULSES	9
+
+struct smb_stats
+{
+	// transfers not done within SMB_XFER_TIMEOUT_MS
+	uint16_t timeouts;
+	// lost arbitration or unexpected states seen by SMBUS0_ISR
+	uint16_t bus_errors;
+	// SCL held low for the SMBus timeout, Timer 3
+	uint16_t scl_timeouts;
+	// runs of smb_recover, and those that found SDA held low
+	uint16_t recoveries;
+	uint16_t stuck_sda;
+	// ATECC commands sent again after a recovery
+	uint16_t retries;
+};
+
+extern struct smb_stats smb_stats;
+
 extern data uint8_t SMB_addr;
 extern uint8_t * SMB_write_buf;
 extern data uint8_t SMB_write_len;
@@ -58,13 +112,21 @@ extern uint8_t * SMB_read_buf;
 extern uint8_t * SMB_write_ext_buf;
 extern data uint8_t SMB_write_ext_len;
 extern data uint8_t SMB_write_ext_offset;
-extern uint8_t SMB_preflags;
 extern uint16_t SMB_crc;
 extern data uint8_t SMB_crc_offset;
 
 //extern struct smb_interrupt_interface SMB;
 extern data volatile uint8_t SMB_FLAGS;
 
+// head is moved by smb_queue, tail by the ISR as transfers end
+extern struct smb_xfer * SMB_queue[SMB_QUEUE_LEN];
+extern data volatile uint8_t SMB_queue_head;
+extern data volatile uint8_t SMB_queue_tail;
+
+// set by the ISRs when they had to restart the SMBus, the bus is
+// recovered from the main loop
+extern data volatile uint8_t SMB_fault;
+
 #define SMB_MAX_ERRORS 15
 #define SMB_ERRORS_EXCEEDED(inter) ((inter)->errors > SMB_MAX_ERRORS)
 
@@ -74,6 +136,7 @@ extern data volatile uint8_t SMB_FLAGS;
 #define SMB_WRITE_EXT		0x4
 #define SMB_READ_TRUNC		0x10
 #define SMB_RECV_NACK		0x40
+#define SMB_BUS_ERROR		0x80
 
 #define SMB_READING() 				((SMB_FLAGS & SMB_READ))
 #define SMB_WRITING() 				(!(SMB_FLAGS & SMB_READ))
@@ -82,8 +145,26 @@ extern data volatile uint8_t SMB_FLAGS;
 #define SMB_BUSY_CLEAR() 			(SMB_FLAGS &= ~SMB_BUSY)
 #define SMB_WAS_NACKED() 			(SMB_FLAGS & SMB_RECV_NACK)
 
+#define SMB_QUEUED()				((uint8_t)(SMB_queue_head - SMB_queue_tail))
+#define smb_done(x)					((x)->status == SMB_XFER_DONE)
+
 void smb_init();
 
+// smb_queue start @x once the transfers ahead of it are done, returns at
+// once; @x must stay untouched until smb_done(x)
+//  @return 0, or -1 if the queue is full
+int8_t smb_queue(struct smb_xfer * x);
+
+// smb_poll whether @x queued at @start is done. Recovers the bus when it
+// is not done in time, @x then ends with SMB_BUS_ERROR, or when an ISR
+// had to restart the SMBus.
+uint8_t smb_poll(struct smb_xfer * x, uint32_t start);
+
+// smb_recover free the bus and start over: SCL is clocked until a slave
+// holding SDA lets go, a stop is sent, the SMBus is re-enabled and the
+// queued transfers end with SMB_BUS_ERROR
+void smb_recover();
+
 // read from I2C device, returns number of bytes read.
 // sets truncated flag if it had to stop because count wasn't
 // large enough
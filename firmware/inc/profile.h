@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * profile.h
+ * 		Where the time of a U2F request goes: per phase, from the first
+ * 		frame of the request to the flush of its answer, for the last
+ * 		PROFILE_RING_LEN requests. Timestamps come from get_us().
+ * 		Built with U2F_PROFILE only, the calls are empty otherwise.
+ *
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+#include "app.h"
+
+#ifdef U2F_PROFILE
+
+// the frames up to u2f_request, including waits behind other requests
+#define PROFILE_HID				0
+#define PROFILE_APPID			1
+#define PROFILE_LOAD_KEY		2
+#define PROFILE_PRESENCE		3
+#define PROFILE_KEYGEN			4
+#define PROFILE_COUNT			5
+#define PROFILE_SHA				6
+#define PROFILE_SIGN			7
+#define PROFILE_WRITEBACK		8
+#define PROFILE_FLUSH			9
+#define PROFILE_PHASES			10
+
+#define PROFILE_RING_LEN		4
+// phases are summed in these units and stop at 0xffff, about 2 s
+#define PROFILE_UNIT_US			32
+
+struct profile
+{
+	uint8_t ins;
+	uint8_t p1;
+	uint16_t sw;
+	uint32_t total_us;
+	uint16_t phase[PROFILE_PHASES];
+};
+
+// the last requests, profile_stored of them, the next one goes to
+// profile_head
+extern struct profile profile_ring[PROFILE_RING_LEN];
+extern uint8_t profile_head;
+extern uint8_t profile_stored;
+
+void profile_init();
+
+// profile_frame the first frame of a U2FHID_MSG has come in
+void profile_frame();
+
+// profile_begin u2f_request has been entered, a @replay of the request
+// waiting for the user carries on with its profile. Other requests are
+// not profiled during the wait.
+void profile_begin(uint8_t ins, uint8_t p1, uint8_t replay);
+
+// profile_mark add the time since the last mark to @phase
+void profile_mark(uint8_t phase);
+
+// profile_pause the request waits for the user, the wait goes to
+// PROFILE_PRESENCE once it is replayed
+void profile_pause();
+
+// profile_drop the waiting request is dropped without an answer
+void profile_drop();
+
+// profile_end the answer with status @sw has been flushed
+void profile_end(uint16_t sw);
+
+#else
+
+#define profile_init()
+#define profile_frame()
+#define profile_begin(ins, p1, replay)
+#define profile_mark(phase)
+#define profile_pause()
+#define profile_drop()
+#define profile_end(sw)
+
+#endif /* U2F_PROFILE */
+
+#endif /* PROFILE_H_ */
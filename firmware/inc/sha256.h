@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ *
+ * sha256.h
+ * 		SHA-256 computed on the MCU: the digests signed by the
+ * 		ATECC508A, loaded with u2f_load_digest(), and the tags of the
+ * 		key handle cache. Those hash a secret salt drawn once per boot
+ * 		and never leave the token; the device key stays on the ATECC.
+ *
+ */
+
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE		32
+#define SHA256_BLOCK_SIZE		64
+
+// sha256_start begin a new digest, there is a single context
+void sha256_start();
+
+// sha256_update hash @len more bytes of the message
+void sha256_update(uint8_t * buf, uint16_t len);
+
+// sha256_finish pad the message and write the digest to @out
+void sha256_finish(uint8_t * out);
+
+#endif /* SHA256_H_ */
@@ -57,6 +57,15 @@
 #define U2F_VENDOR_FIRST 					0xc0
 #define U2F_VENDOR_LAST 					0xff
 
+// Vendor AUTHENTICATE with several key handles for one application,
+// P1 as for U2F_AUTHENTICATE. The request is challenge, application,
+// number of handles and the handles. The response is the index of the
+// first handle belonging to the application, followed for a sign
+// request by the usual flags, counter and signature.
+#define U2F_AUTHENTICATE_MULTI				(U2F_VENDOR_FIRST+1)
+// bound by the 270 byte U2F HID reassembly buffer
+#define U2F_AUTHENTICATE_MULTI_MAX			3
+
 // U2F_CMD_REGISTER command defines
 #define U2F_REGISTER_ID 					0x05
 #define U2F_REGISTER_HASH_ID 				0x00
@@ -65,6 +74,12 @@
 #define U2F_AUTHENTICATE_CHECK				0x7
 #define U2F_AUTHENTICATE_SIGN				0x3
 
+// Results of check-only AUTHENTICATE kept in RAM, browsers repeat the
+// probe for the same handles several times per login. An entry is
+// trusted for U2F_TAG_CACHE_MS after the tag was verified on the ATECC.
+#define U2F_TAG_CACHE_LEN					4
+#define U2F_TAG_CACHE_MS					2000
+
 
 // Command status responses
 #define U2F_SW_NO_ERROR                     0x9000
@@ -77,6 +92,8 @@
 #define U2F_SW_INSUFFICIENT_MEMORY          0x9210
 #define U2F_SW_LENGTH						(2)
 #define U2F_SW_OPERATION_FAILED				(U2F_SW_WRONG_DATA+0x20)
+// internal, the request waits for the user and is never answered with it
+#define U2F_SW_WAIT_USER					0x0000
 
 // Custom errors
 #define U2F_SW_CUSTOM_RNG_GENERATION        0x920f
@@ -113,10 +130,32 @@ struct u2f_authenticate_request
     uint8_t key_handle[U2F_KEY_HANDLE_SIZE];
 } ;
 
+struct u2f_authenticate_multi_request
+{
+    uint8_t challenge[U2F_CHALLENGE_SIZE];
+    uint8_t application[U2F_APPLICATION_SIZE];
+    uint8_t count;
+    uint8_t key_handles[U2F_AUTHENTICATE_MULTI_MAX][U2F_KEY_HANDLE_SIZE];
+} ;
+
 // u2f_request send a U2F message to U2F protocol
 //  @req U2F message
 void u2f_request(struct u2f_request_apdu* req);
 
+struct u2f_tag_cache_stats
+{
+	// check-only requests answered from the cache, and the ones
+	// that needed the ATECC
+	uint16_t hits;
+	uint16_t misses;
+};
+
+extern struct u2f_tag_cache_stats u2f_tag_cache_stats;
+
+// u2f_tag_cache_clear forget the cached check results and zero the
+// counters, on reset and whenever the device key changes
+void u2f_tag_cache_clear();
+
 
 
 //////////////////////////////////////////////////////////////////
@@ -134,6 +173,10 @@ extern uint16_t u2f_attestation_cert_size();
 //  @len length of buf in bytes
 extern void u2f_response_writeback(uint8_t * buf, uint16_t len);
 
+// u2f_response_writeback_code same for data in code memory, which is
+// sent from there without being copied
+extern void u2f_response_writeback_code(uint8_t code * buf, uint16_t len);
+
 // u2f_response_flush callback when u2f finishes and will
 // indicate when all buffer data, if any, should be written
 extern void u2f_response_flush();
@@ -141,12 +184,36 @@ extern void u2f_response_flush();
 // u2f_response_start callback when u2f starts a new transaction
 extern void u2f_response_start();
 
-// u2f_get_user_feedback return 0 if user provides feedback, -1 if not
-// This should block as long as it needs to get feedback
-// before failing.
+// u2f_get_user_feedback return 0 if user provides feedback, 1 if not,
+// U2F_FEEDBACK_PENDING while the user still has time to provide it.
+// Must not block, it is called again until it stops returning pending.
+#define U2F_FEEDBACK_PENDING				2
 extern int8_t u2f_get_user_feedback();
+// same for the extended press used by the wipe commands, but blocking
 extern int8_t u2f_get_user_feedback_extended_wipe();
 
+// u2f_user_feedback_poll advance a pending user feedback request
+//  @return non-zero as long as the user is still waited for
+extern uint8_t u2f_user_feedback_poll();
+
+// u2f_user_feedback_cancel give up waiting for the user, the pending
+// request gets a negative answer
+extern void u2f_user_feedback_cancel();
+
+// u2f_user_feedback_drop forget the wait and its outcome, when the
+// request waiting for the user goes away without being answered
+extern void u2f_user_feedback_drop();
+
+// u2f_response_wait callback when the request needs the user
+//  @return 0 if the response can be deferred, u2f_request will be called
+//  with the same request again later, non-zero to refuse the request now
+extern int8_t u2f_response_wait();
+
+// u2f_request_replayed
+//  @return non-zero if the request being handled is the same request
+//  again after u2f_response_wait deferred it
+extern uint8_t u2f_request_replayed();
+
 
 // u2f_sha256_start callback for u2f to start a sha256 hash
 extern void u2f_sha256_start_default();
@@ -162,6 +229,13 @@ extern void u2f_sha256_update(uint8_t * buf, uint8_t len);
 extern struct atecc_response* u2f_sha256_finish();
 
 
+// u2f_load_digest callback for u2f to make a digest computed elsewhere the
+// message of the next u2f_ecdsa_sign
+//  @digest 32 bytes
+//  @return -1 for failure, 0 for success
+extern int8_t u2f_load_digest(uint8_t * digest);
+
+
 // u2f_ecdsa_sign callback for u2f to compute signature on the previously computed sha256 digest
 //  @dest atleast 64 bytes to write back signature R and S values
 //  @handle for the private key to use
@@ -176,6 +250,10 @@ extern int8_t u2f_ecdsa_sign(uint8_t * dest, uint8_t * handle, uint8_t * appid);
 //  @return -1 for failure, 0 for success
 int8_t u2f_new_keypair(uint8_t * handle, uint8_t * appid, uint8_t * pubkey);
 
+// u2f_random fill @out with @len random bytes
+//  @return -1 for failure, 0 for success
+int8_t u2f_random(uint8_t * out, uint8_t len);
+
 // u2f_appid_eq must check if app id is equal to app id associated with key pair handle
 /// @handle the handle for the key pair
 /// @appid the 32 byte app id to check against
@@ -183,12 +261,17 @@ int8_t u2f_new_keypair(uint8_t * handle, uint8_t * appid, uint8_t * pubkey);
 int8_t u2f_appid_eq(uint8_t * handle, uint8_t * appid);
 
 // u2f_load_key Load a key into memory or check to see that the handle exists
+// Keys stay loaded, the handle must have passed u2f_appid_eq for @appid.
 //  @handle the key handle to check
 //	@return -1 if it doesn't exist, 0 for success
 extern int8_t u2f_load_key(uint8_t * handle, uint8_t * appid);
 
+// u2f_key_slots_clear forget which keys are loaded, on reset and whenever
+// the device key changes
+extern void u2f_key_slots_clear();
+
 // u2f_get_attestation_cert method to return pointer to attestation cert
-extern uint8_t * u2f_get_attestation_cert();
+extern uint8_t code * u2f_get_attestation_cert();
 
 // u2f_count Should increment a 4 byte persistent/atomic counter and return it.
 // 	@return the counter
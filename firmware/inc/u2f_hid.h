@@ -44,6 +44,8 @@
 #define U2FHID_LOCK         (TYPE_INIT | 0x04)	// Send lock channel command
 #define U2FHID_INIT         (TYPE_INIT | 0x06)	// Channel initialization
 #define U2FHID_WINK         (TYPE_INIT | 0x08)	// Send device identification wink
+#define U2FHID_CANCEL       (TYPE_INIT | 0x11)	// Cancel the wait for the user (CTAPHID)
+#define U2FHID_KEEPALIVE    (TYPE_INIT | 0x3b)	// Request still being processed (CTAPHID)
 #define U2FHID_ERROR        (TYPE_INIT | 0x3f)	// Error response
 
 #define U2FHID_VENDOR_FIRST (TYPE_INIT | 0x40)	// First vendor defined command
@@ -60,6 +62,9 @@
 #define ERR_SYNC_FAIL           0x0b    // SYNC command failed
 #define ERR_OTHER               0x7f    // Other unspecified error
 
+#define STATUS_PROCESSING       0x01    // Keepalive status: working on the request
+#define STATUS_UPNEEDED         0x02    // Keepalive status: waiting for the user
+
 #define CAPABILITY_WINK  		0x01
 #define CAPABILITY_LOCK  		0x02
 
@@ -70,8 +75,12 @@
 // 7609 = 128*U2FHID_CONT_PAYLOAD_SIZE+1*U2FHID_INIT_PAYLOAD_SIZE (128 continuation frames + 1 init frame)
 #define U2FHID_MAX_PAYLOAD_SIZE  (7609)
 
-#define U2FHID_LEN(req) (*(uint16_t*)&req->pkt.init.bcnth)
-#define U2FHID_SET_LEN(req,len) (*(uint16_t*)&req->pkt.init.bcnth = (uint16_t)len)
+// payload length is big endian on the wire
+#define U2FHID_LEN(req) (((uint16_t)(req)->pkt.init.bcnth << 8) | (req)->pkt.init.bcntl)
+#define U2FHID_SET_LEN(req,len) ((req)->pkt.init.bcnth = (uint8_t)((uint16_t)(len) >> 8), (req)->pkt.init.bcntl = (uint8_t)(len))
+
+// keepalive period of a request waiting for the user
+#define U2FHID_KEEPALIVE_MS 100
 
 #define U2FHID_TIMEOUT_MS 5000
 #define U2FHID_TIMEOUT(hid) (get_ms() - (hid)->last_buffered > U2FHID_TIMEOUT_MS)
@@ -113,8 +122,14 @@ struct CID
 {
 	uint32_t cid;
 	uint32_t last_used;
+	// 0 idle, 1 receiving a request, 2 request waiting for the user
 	uint8_t busy;
 	uint8_t last_cmd;
+	// reassembly of the request in progress on this channel
+	int8_t last_seq;
+	uint8_t buf;
+	uint16_t req_len;
+	uint16_t bytes_buffered;
 };
 
 typedef enum
@@ -139,9 +154,21 @@ void u2f_hid_set_len(uint16_t len);
 //  @prereq is that hid_layer.current_cid, hid_layer.res_len each set to correct values
 void u2f_hid_writeback(uint8_t * payload, uint16_t len);
 
+// u2f_hid_writeback_code same for a payload in code memory, whole
+// packets of it are streamed to the endpoint without being copied
+void u2f_hid_writeback_code(uint8_t code * payload, uint16_t len);
+
 // u2f_hid_flush flush any remaining data that may be buffered.
 void u2f_hid_flush();
 
+// u2f_hid_respond begin the response to a vendor command handled outside
+// of u2f_hid_request, the @len bytes of payload follow with u2f_hid_writeback
+void u2f_hid_respond(struct u2f_hid_msg * req, uint16_t len);
+
+// u2f_hid_abort drop the response being written, the host gets an
+// U2FHID_ERROR frame with @err instead of the rest
+void u2f_hid_abort(uint8_t err);
+
 // u2f_hid_request entry function for U2F HID protocol.
 // It will pass up to U2F protocol if necessary.
 //  @param req the U2F HID message
@@ -156,6 +183,21 @@ extern void set_app_error(uint8_t ec);
 
 // Call from main loop to ensure stale channels get timeout error.
 void u2f_hid_check_timeouts();
+
+// u2f_hid_current_cid the channel of the request being served
+uint32_t u2f_hid_current_cid();
+
+// u2f_hid_replaying non-zero while the parked request is replayed
+uint8_t u2f_hid_replaying();
+
+// u2f_hid_wait_user park the request of the current channel until the
+// user has been waited for, see u2f_response_wait()
+//  @return 0 if parked, -1 if the request has to be answered now
+int8_t u2f_hid_wait_user();
+
+// Call from main loop to replay the parked request once the wait for
+// the user is over, and to send keepalives meanwhile.
+void u2f_hid_check_waiting();
 void u2f_print_hid_check_timeouts();
 
 #define U2FHID_IS_INIT(cmd)			((cmd) & 0x80)
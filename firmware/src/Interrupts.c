@@ -29,6 +29,7 @@
 #include <stdint.h>
 #include "app.h"
 #include "i2c.h"
+#include "crc16.h"
 
 #include "bsp.h"
 
@@ -40,6 +41,25 @@ SI_INTERRUPT (TIMER2_ISR, TIMER2_IRQn)
 	++_MS_;
 }
 
+// Timer 2 counts SYSCLK from its reload value up to the overflow that
+// ends each millisecond
+uint32_t get_us()
+{
+	uint32_t ms;
+	uint8_t hi, lo;
+	uint16_t counts;
+
+	do
+	{
+		ms = _MS_;
+		hi = TMR2H;
+		lo = TMR2L;
+	} while (ms != _MS_ || hi != TMR2H);
+
+	counts = (((uint16_t)hi << 8) | lo) - (((uint16_t)TMR2RLH << 8) | TMR2RLL);
+	return ms * 1000 + counts / 48;
+}
+
 #define SMB_STATUS_START			0xE0
 #define SMB_STATUS_MTX				0xC0
 #define SMB_STATUS_MRX				0x80
@@ -60,11 +80,17 @@ uint8_t * SMB_read_buf 				= NULL;
 uint8_t * SMB_write_ext_buf 		= NULL;
 data uint8_t  SMB_write_ext_len 	= 0;
 data uint8_t  SMB_write_ext_offset 	= 0;
-uint8_t SMB_preflags 				= 0;
 uint16_t  SMB_crc 					= 0;
 data uint8_t  SMB_crc_offset 		= 0;
 data volatile uint8_t SMB_FLAGS 	= 0;
 
+struct smb_xfer * SMB_queue[SMB_QUEUE_LEN];
+data volatile uint8_t SMB_queue_head = 0;
+data volatile uint8_t SMB_queue_tail = 0;
+data volatile uint8_t SMB_fault = 0;
+
+#define smb_current()		(SMB_queue[SMB_queue_tail & (SMB_QUEUE_LEN - 1)])
+
 static void update_from_packet_length()
 {
 	if (SMB_read_buf[0] <= SMB_read_len)
@@ -78,11 +104,65 @@ static void update_from_packet_length()
 	}
 }
 
-static void _feed_crc(uint8_t b)
+// load the next stage of the transfer at the head of the queue,
+// the write if it has one and then the read
+static void smb_load()
 {
-	SMB_crc = feed_crc(SMB_crc,b);
+	struct smb_xfer * x = smb_current();
+
+	SMB_crc = 0;
+	SMB_crc_offset = 0;
+	SMB_addr = x->addr;
+	if (x->status == SMB_XFER_QUEUED && x->write_len)
+	{
+		SMB_FLAGS = SMB_WRITE | SMB_BUSY | (x->write_ext_len ? SMB_WRITE_EXT : 0);
+		SMB_write_buf = x->write_buf;
+		SMB_write_len = x->write_len;
+		SMB_write_offset = 0;
+		SMB_write_ext_buf = x->write_ext_buf;
+		SMB_write_ext_len = x->write_ext_len;
+		SMB_write_ext_offset = 0;
+	}
+	else
+	{
+		SMB_FLAGS = SMB_READ | SMB_BUSY;
+		SMB_read_buf = x->read_buf;
+		SMB_read_len = x->read_len;
+		SMB_read_offset = 0;
+	}
 }
 
+// the stage on the bus has ended with a stop, go on with the read of the
+// transfer or hand it back and start the next one
+static void smb_stage_done()
+{
+	struct smb_xfer * x = smb_current();
+
+	SMB_BUSY_CLEAR();
+	if (SMB_WRITING() && !SMB_WAS_NACKED() && x->read_len)
+	{
+		x->status = SMB_XFER_WRITTEN;
+		SMB0CN0_STA = 1;
+		return;
+	}
+
+	if (SMB_READING())
+	{
+		x->read_len = SMB_read_len;
+	}
+	x->crc = SMB_crc;
+	x->flags = SMB_FLAGS & (SMB_RECV_NACK | SMB_READ_TRUNC | SMB_BUS_ERROR);
+	x->status = SMB_XFER_DONE;
+	SMB_queue_tail++;
+	if (SMB_QUEUED())
+	{
+		// a stop followed by a start
+		SMB0CN0_STA = 1;
+	}
+}
+
+// re-enable the SMBus after a fault, the transfer on the bus ends with
+// SMB_BUS_ERROR and the next one is started
 static void restart_bus()
 {
 	SMB0CF &= ~0x80;
@@ -90,7 +170,16 @@ static void restart_bus()
 	SMB0CN0_STA = 0;
 	SMB0CN0_STO = 0;
 	SMB0CN0_ACK = 0;
-	SMB_BUSY_CLEAR();
+	SMB_fault = 1;
+	if (SMB_IS_BUSY())
+	{
+		SMB_FLAGS |= SMB_RECV_NACK | SMB_BUS_ERROR;
+		smb_stage_done();
+	}
+	else if (SMB_QUEUED())
+	{
+		SMB0CN0_STA = 1;
+	}
 }
 
 SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
@@ -105,6 +194,10 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 	switch (bus)
 	{
 		case SMB_STATUS_START:
+			if (!SMB_IS_BUSY())
+			{
+				smb_load();
+			}
 			SMB0DAT = SMB_addr | (SMB_FLAGS & SMB_READ);
 			SMB0CN0_STA = 0;
 			break;
@@ -116,7 +209,7 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 				// end transaction
 				SMB0CN0_STO = 1;
 				SMB_FLAGS |= SMB_RECV_NACK;
-				SMB_BUSY_CLEAR();
+				smb_stage_done();
 			}
 			else if (!SMB_WRITING())
 			{
@@ -127,7 +220,7 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 				// start writing first buffer
 				// dont crc first byte for atecc508a
 				c = SMB_write_buf[SMB_write_offset++];
-				if (SMB_write_offset > 1) _feed_crc(c);
+				if (SMB_write_offset > 1) CRC16_FEED(SMB_crc, c);
 				SMB0DAT = c;
 
 			}
@@ -135,7 +228,7 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 			{
 				// start writing second optional buffer
 				c = SMB_write_ext_buf[SMB_write_ext_offset++];
-				_feed_crc(c);
+				CRC16_FEED(SMB_crc, c);
 				SMB0DAT = c;
 			}
 			else
@@ -144,7 +237,6 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 				switch(SMB_crc_offset++)
 				{
 					case 0:
-						SMB_crc = reverse_bits(SMB_crc);
 						SMB0DAT = (uint8_t)SMB_crc;
 						break;
 					case 1:
@@ -152,7 +244,7 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 						break;
 					case 2:
 						SMB0CN0_STO = 1;
-						SMB_BUSY_CLEAR();
+						smb_stage_done();
 				}
 			}
 
@@ -175,7 +267,7 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 
 				if ((SMB_read_offset < (SMB_read_len - 2)))
 				{
-					SMB_crc = feed_crc(SMB_crc, c);
+					CRC16_FEED(SMB_crc, c);
 				}
 
 				SMB_read_offset++;
@@ -185,10 +277,9 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 			{
 				// end transaction
 
-				SMB_crc = reverse_bits(SMB_crc);
-				SMB_BUSY_CLEAR();
 				SMB0CN0_ACK = 0;
 				SMB0CN0_STO = 1;
+				smb_stage_done();
 			}
 
 			break;
@@ -206,7 +297,8 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 
 	fail:
 		u2f_printb("smbus fail ",1,bus);
-		//restart_bus();
+		smb_stats.bus_errors++;
+		restart_bus();
 		SMB0CN0_SI = 0;
 }
 
@@ -215,7 +307,9 @@ SI_INTERRUPT (SMBUS0_ISR, SMBUS0_IRQn)
 // The SMBus is disabled and re-enabled here
 SI_INTERRUPT (TIMER3_ISR, TIMER3_IRQn)
 {
-	//restart_bus();
+	TMR3CN0 &= ~TMR3CN0_TF3H__BMASK;
+	smb_stats.scl_timeouts++;
+	restart_bus();
 }
 
 
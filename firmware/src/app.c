@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016, Conor Patrick
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ * app.c
+ * 		Application state and a single pass of the main loop.
+ * 		Kept apart from main.c, so the same dispatch can be driven
+ * 		by the host build in tools/hostsim.
+ *
+ */
+#include <SI_EFM8UB3_Register_Enums.h>
+#include <efm8_usb.h>
+
+#include "app.h"
+#include "i2c.h"
+#include "gpio.h"
+#include "atecc508a.h"
+#include "eeprom.h"
+#include "bsp.h"
+#include "custom.h"
+#include "u2f.h"
+#include "profile.h"
+
+data struct APP_DATA appdata;
+
+uint8_t error;
+uint8_t state;
+// time of the last HID frame handled
+static uint32_t last_msg_ms;
+
+
+struct u2f_hid_msg * hid_msg;
+
+
+void app_init()
+{
+	u2f_hid_init();
+#ifndef ATECC_SETUP_DEVICE
+	u2f_tag_cache_clear();
+#endif //ATECC_SETUP_DEVICE
+	u2f_key_slots_clear();
+	hid_rx_init();
+	smb_init();
+	atecc_timing_init();
+	atecc_health_reset();
+	profile_init();
+	atecc_idle();
+#ifdef _SECURE_EEPROM
+	eeprom_init();
+#endif
+
+	state = APP_NOTHING;
+	error = ERROR_NOTHING;
+}
+
+void set_app_error(APP_ERROR_CODE ec)
+{
+	error = ec;
+}
+
+uint8_t get_app_error()
+{
+	return error;
+}
+
+uint8_t get_app_state()
+{
+	return state;
+}
+
+void set_app_state(APP_STATE s)
+{
+	state = s;
+}
+
+
+void set_app_u2f_hid_msg(struct u2f_hid_msg * msg )
+{
+	state = APP_HID_MSG;
+	hid_msg = msg;
+}
+
+
+void app_service()
+{
+	watchdog();
+	button_manager();
+	led_blink_manager();
+	hid_rx_poll();
+	u2f_hid_check_timeouts();
+}
+
+void app_loop()
+{
+	watchdog();
+
+	clear_button_press();
+	button_manager();
+	led_blink_manager();
+#ifdef __BUTTON_TEST__
+	if (button_get_press()) { led_on();  }
+	else                    { led_off(); }
+#endif
+
+	hid_rx_poll();
+	if (state != APP_HID_MSG && hid_rx_peek() != NULL)
+	{
+		set_app_u2f_hid_msg(hid_rx_peek());
+	}
+
+	u2f_hid_check_timeouts();
+#ifndef ATECC_SETUP_DEVICE
+	atecc_session_begin();                             // A request replayed after the user wait
+	u2f_hid_check_waiting();
+	atecc_session_end();
+#endif //ATECC_SETUP_DEVICE
+
+	switch(state) {
+		case APP_NOTHING: {}break;                     // Idle state:
+
+		case APP_HID_MSG: {                            // HID msg received, pass to protocols:
+			atecc_session_begin();                     // The ATECC stays awake for all commands of it
+#ifndef ATECC_SETUP_DEVICE
+			struct CID* cid = NULL;
+			cid = get_cid(hid_msg->cid);
+			if (cid == NULL || !cid->busy) {                          // There is no ongoing U2FHID transfer
+				if (!custom_command(hid_msg)) {
+					u2f_hid_request(hid_msg);
+				}
+			} else {
+				u2f_hid_request(hid_msg);
+			}
+#else //!ATECC_SETUP_DEVICE
+			if (!custom_command(hid_msg)) {
+				 u2f_hid_request(hid_msg);
+			}
+#endif //ATECC_SETUP_DEVICE
+			atecc_session_end();
+			last_msg_ms = get_ms();
+			if (state == APP_HID_MSG) {                // The USB msg doesnt ask a special app state
+				state = APP_NOTHING;	               // We can go back to idle
+			}
+			hid_rx_release();                          // The frame slot can take the next one
+		}break;
+	}
+
+	// the next random bytes are drawn while the host leaves the token alone
+#ifndef ATECC_SETUP_DEVICE
+	if (state == APP_NOTHING && hid_rx_peek() == NULL &&
+			get_ms() - last_msg_ms > ATECC_RNG_IDLE_MS)
+	{
+		atecc_rng_refill();
+	}
+#endif
+
+	watchdog();
+	if(atecc_used){
+		atecc_sleep();
+		atecc_used = 0;
+	}
+}
@@ -70,6 +70,36 @@ int8_t write_masks(){
 
 uint8_t atecc_used = 0;
 
+// in a session, and whether the ATECC has been woken in it and when
+static uint8_t session = 0;
+static uint8_t session_awake = 0;
+static uint32_t session_wake_ms;
+
+// the first rng_pool_len bytes are unused random bytes, they are handed
+// out from the end and wiped
+static uint8_t rng_pool[ATECC_RNG_POOL_SIZE];
+static uint8_t rng_pool_len = 0;
+static uint8_t rng_pool_failed = 0;
+
+// the transfer of atecc_send and atecc_recv
+static struct smb_xfer atecc_xfer;
+
+// atecc_wait wait @ms or until @x is done, whichever is later. The main
+// loop work that does not need the ATECC goes on meanwhile.
+static void atecc_wait(uint8_t ms, struct smb_xfer * x)
+{
+	uint32_t start = get_ms();
+	uint32_t tick = start;
+	while (get_ms() - start < ms || (x != NULL && !smb_poll(x, start)))
+	{
+		if (get_ms() != tick)
+		{
+			tick = get_ms();
+			app_service();
+		}
+	}
+}
+
 int8_t atecc_send(uint8_t cmd, uint8_t p1, uint16_t p2,
 					uint8_t * buf, uint8_t len)
 {
@@ -78,12 +108,24 @@ int8_t atecc_send(uint8_t cmd, uint8_t p1, uint16_t p2,
 	params[1] = 7+len;
 	params[2] = cmd;
 	params[3] = p1;
-	params[4] = ((uint8_t*)&p2)[1];
-	params[5] = ((uint8_t* )&p2)[0];
-
-	smb_set_ext_write(buf, len);
-	smb_write( ATECC508A_ADDR, params, sizeof(params));
-	if (SMB_WAS_NACKED())
+	params[4] = (uint8_t)p2;
+	params[5] = (uint8_t)(p2 >> 8);
+
+	atecc_xfer.addr = ATECC508A_ADDR;
+	atecc_xfer.write_buf = params;
+	atecc_xfer.write_len = sizeof(params);
+	atecc_xfer.write_ext_buf = buf;
+	atecc_xfer.write_ext_len = len;
+	atecc_xfer.read_len = 0;
+	while (smb_queue(&atecc_xfer) != 0)
+		;
+	atecc_wait(0, &atecc_xfer);
+	if (atecc_xfer.flags & SMB_BUS_ERROR)
+	{
+		set_app_error(ERROR_I2C_RESTART);
+		return -1;
+	}
+	if (atecc_xfer.flags & SMB_RECV_NACK)
 	{
 		return -1;
 	}
@@ -92,17 +134,17 @@ int8_t atecc_send(uint8_t cmd, uint8_t p1, uint16_t p2,
 
 void atecc_idle()
 {
-	smb_write( ATECC508A_ADDR, "\x02", 1);
+	smb_write( ATECC508A_ADDR, (uint8_t *)"\x02", 1);
 }
 
 void atecc_sleep()
 {
-	smb_write( ATECC508A_ADDR, "\x01", 1);
+	smb_write( ATECC508A_ADDR, (uint8_t *)"\x01", 1);
 }
 
 void atecc_wake()
 {
-	smb_write( ATECC508A_ADDR, "\0\0", 2);
+	smb_write( ATECC508A_ADDR, (uint8_t *)"\0\0", 2);
 }
 
 #define PKT_CRC(buf, pkt_len) (htole16(*((uint16_t*)(buf+pkt_len-2))))
@@ -110,13 +152,27 @@ void atecc_wake()
 int8_t atecc_recv(uint8_t * buf, uint8_t buflen, struct atecc_response* res)
 {
 	uint8_t pkt_len;
-	pkt_len = smb_read( ATECC508A_ADDR,buf,buflen);
-	if (SMB_WAS_NACKED())
+
+	atecc_xfer.addr = ATECC508A_ADDR;
+	atecc_xfer.write_len = 0;
+	atecc_xfer.write_ext_len = 0;
+	atecc_xfer.read_buf = buf;
+	atecc_xfer.read_len = buflen;
+	while (smb_queue(&atecc_xfer) != 0)
+		;
+	atecc_wait(0, &atecc_xfer);
+	pkt_len = atecc_xfer.read_len;
+	if (atecc_xfer.flags & SMB_BUS_ERROR)
+	{
+		set_app_error(ERROR_I2C_RESTART);
+		return -1;
+	}
+	if (atecc_xfer.flags & SMB_RECV_NACK)
 	{
 		return -1;
 	}
 
-	if (SMB_FLAGS & SMB_READ_TRUNC)
+	if (atecc_xfer.flags & SMB_READ_TRUNC)
 	{
 		set_app_error(ERROR_READ_TRUNCATED);
 		return -1;
@@ -124,7 +180,7 @@ int8_t atecc_recv(uint8_t * buf, uint8_t buflen, struct atecc_response* res)
 
 	if (pkt_len <= buflen && pkt_len >= 4)
 	{
-		if (PKT_CRC(buf,pkt_len) != SMB_crc)
+		if (PKT_CRC(buf,pkt_len) != atecc_xfer.crc)
 		{
 			set_app_error(ERROR_I2C_CRC);
 			return -1;
@@ -150,39 +206,101 @@ int8_t atecc_recv(uint8_t * buf, uint8_t buflen, struct atecc_response* res)
 	return pkt_len;
 }
 
-static void delay_cmd(uint8_t cmd)
-{
-	uint8_t d = 0;
-	switch(cmd)
-	{
-	case ATECC_CMD_COUNTER:
-		d = 20; break;
-	case ATECC_CMD_GENDIG:
-		d = 11; break;
-	case ATECC_CMD_INFO:
-		d = 1; break;
-	case ATECC_CMD_LOCK:
-		d = 32; break;
-	case ATECC_CMD_NONCE:
-		d = 7; break;
-	case ATECC_CMD_PRIVWRITE:
-		d = 48; break;
-	case ATECC_CMD_READ:
-		d = 1; break;
-	case ATECC_CMD_RNG:
-		d = 23; break;
-	case ATECC_CMD_SHA:
-		d = 9; break;
-	case ATECC_CMD_WRITE:
-		d = 26; break;
-	case ATECC_CMD_SIGN:
-		d = 50; break;
-	case ATECC_CMD_GENKEY:
-		d = 115; break;
-	default:
-		d = 58; break;
-	}
-	u2f_delay(d/4+1);
+// typical and maximum execution times of the datasheet, in ms; the
+// first entry matching opcode and P1 applies, ATECC_TIMING_ANY_P1 matches
+// any mode
+static code struct
+{
+	uint8_t opcode;
+	uint8_t p1;
+	uint8_t typ_ms;
+	uint8_t max_ms;
+} atecc_exec_times[ATECC_TIMING_OPS] = {
+	{ATECC_CMD_COUNTER,		ATECC_TIMING_ANY_P1,	7,	20},
+	{ATECC_CMD_GENDIG,		ATECC_TIMING_ANY_P1,	5,	11},
+	{ATECC_CMD_GENKEY,		ATECC_GENKEY_PRIVATE,	85,	115},
+	{ATECC_CMD_GENKEY,		ATECC_TIMING_ANY_P1,	11,	115},
+	{ATECC_CMD_INFO,		ATECC_TIMING_ANY_P1,	0,	1},
+	{ATECC_CMD_LOCK,		ATECC_TIMING_ANY_P1,	8,	32},
+	{ATECC_CMD_NONCE,		ATECC_TIMING_ANY_P1,	0,	7},
+	{ATECC_CMD_PRIVWRITE,	ATECC_TIMING_ANY_P1,	1,	48},
+	{ATECC_CMD_READ,		ATECC_TIMING_ANY_P1,	0,	1},
+	{ATECC_CMD_RNG,			ATECC_TIMING_ANY_P1,	1,	23},
+	{ATECC_CMD_SHA,			ATECC_SHA_END,			7,	9},
+	{ATECC_CMD_SHA,			ATECC_SHA_HMACEND,		7,	9},
+	{ATECC_CMD_SHA,			ATECC_TIMING_ANY_P1,	7,	9},
+	{ATECC_CMD_SIGN,		ATECC_TIMING_ANY_P1,	42,	50},
+	{ATECC_CMD_WRITE,		ATECC_TIMING_ANY_P1,	7,	26},
+};
+
+struct atecc_timing atecc_timing[ATECC_TIMING_OPS];
+
+// responses in a row found at the first poll, per opcode
+static uint8_t first_poll_hits[ATECC_TIMING_OPS];
+
+void atecc_timing_init()
+{
+	uint8_t i;
+	for (i = 0; i < ATECC_TIMING_OPS; i++)
+	{
+		memset(&atecc_timing[i], 0, sizeof(struct atecc_timing));
+		atecc_timing[i].opcode = atecc_exec_times[i].opcode;
+		atecc_timing[i].p1 = atecc_exec_times[i].p1;
+		atecc_timing[i].expect_ms = atecc_exec_times[i].typ_ms;
+		first_poll_hits[i] = 0;
+	}
+}
+
+struct atecc_health atecc_health[ATECC_HEALTH_OPS];
+
+// count one more in a health counter, up to 0xff
+#define HEALTH_COUNT(c)		do { if ((c) != 0xff) (c)++; } while (0)
+
+void atecc_health_reset()
+{
+	memset(atecc_health, 0, sizeof(atecc_health));
+}
+
+static uint8_t timing_index(uint8_t cmd, uint8_t p1)
+{
+	uint8_t i;
+	for (i = 0; i < ATECC_TIMING_OPS; i++)
+	{
+		if (atecc_exec_times[i].opcode == cmd &&
+				(atecc_exec_times[i].p1 == p1 || atecc_exec_times[i].p1 == ATECC_TIMING_ANY_P1))
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+// learn from the response to entry @op found @elapsed ms after the command,
+// at the first poll or after @nacks busy reads
+static void timing_update(uint8_t op, uint8_t elapsed, uint8_t nacks)
+{
+	struct atecc_timing * t = &atecc_timing[op];
+
+	t->commands++;
+	t->polls += nacks + 1;
+	t->nacks += nacks;
+	if (elapsed > t->worst_ms)
+	{
+		t->worst_ms = elapsed;
+	}
+
+	if (nacks)
+	{
+		// too early, the response was there within one poll step
+		t->expect_ms = elapsed;
+		first_poll_hits[op] = 0;
+	}
+	else if (++first_poll_hits[op] == ATECC_TIMING_PROBE && t->expect_ms)
+	{
+		// maybe too late, try a ms earlier
+		t->expect_ms--;
+		first_poll_hits[op] = 0;
+	}
 }
 
 int8_t atecc_send_recv(uint8_t cmd, uint8_t p1, uint16_t p2,
@@ -190,13 +308,34 @@ int8_t atecc_send_recv(uint8_t cmd, uint8_t p1, uint16_t p2,
 							uint8_t rxlen, struct atecc_response* res)
 {
 	uint8_t errors = 0;
+	uint8_t op = timing_index(cmd, p1);
+	struct atecc_health * health = &atecc_health[op];
+	uint8_t nacks;
+	uint32_t sent_ms;
+	uint32_t poll_ms;
 #ifdef DEBUG_GATHER_ATECC_ERRORS
 	uint16_t errarr[20]; //store error codes for debugging
 	memset(errarr, 0, sizeof(errarr));
 #endif
 	atecc_used = 1;
-	atecc_wake();
-	u2f_delay(5);
+	health->commands++;
+	if (!session)
+	{
+		atecc_wake();
+		atecc_wait(5, NULL);
+	}
+	else if (!session_awake || get_ms() - session_wake_ms > ATECC_SESSION_MS)
+	{
+		// through idle, so the watchdog starts over and TempKey is kept
+		if (session_awake)
+		{
+			atecc_idle();
+		}
+		atecc_wake();
+		atecc_wait(5, NULL);
+		session_awake = 1;
+		session_wake_ms = get_ms();
+	}
 
 	resend:
 	set_app_error(ERROR_NOTHING);
@@ -206,48 +345,127 @@ int8_t atecc_send_recv(uint8_t cmd, uint8_t p1, uint16_t p2,
 		errarr[errors] = 0x1000+get_app_error();
 #endif
 		errors++;
+		if (get_app_error() == ERROR_I2C_RESTART)
+		{
+			// the bus has been recovered, a cut off command is dropped
+			// by the ATECC and may be sent again
+			smb_stats.retries++;
+			HEALTH_COUNT(health->bus_errors);
+			set_app_error(ERROR_NOTHING);
+		}
+		else
+		{
+			HEALTH_COUNT(health->send_nacks);
+		}
 		if (errors > 8)
 		{
+			HEALTH_COUNT(health->failures);
 			return -1;
 		}
 	}
-	while(atecc_recv(rx,rxlen, res) == -1)
+
+	// first poll when the command is expected to be done, then every
+	// step until its maximum execution time has passed
+	sent_ms = get_ms();
+	nacks = 0;
+	if (op < ATECC_TIMING_OPS)
+	{
+		atecc_wait(atecc_timing[op].expect_ms, NULL);
+	}
+	while(poll_ms = get_ms(), health->polls++, atecc_recv(rx,rxlen, res) == -1)
 	{
+		if (get_app_error() == ERROR_NOTHING)
+		{
+			// NACKed, still busy
+			nacks++;
+			if (poll_ms - sent_ms > (uint32_t)(op < ATECC_TIMING_OPS ?
+					atecc_exec_times[op].max_ms : ATECC_TIMING_MAX_MS) + ATECC_TIMING_SLACK_MS)
+			{
+				HEALTH_COUNT(health->failures);
+				return -2;
+			}
+			atecc_wait(ATECC_POLL_STEP_MS, NULL);
+			continue;
+		}
 #ifdef DEBUG_GATHER_ATECC_ERRORS
 		errarr[errors] = 0x2000+get_app_error();
 #endif
 		errors++;
 		if (errors > 16)
 		{
+			HEALTH_COUNT(health->failures);
 			return -2;
 		}
 		switch(get_app_error())
 		{
-			case ERROR_NOTHING:
-				delay_cmd(cmd);
-				break;
 			case ERROR_ATECC_WATCHDOG:
+				HEALTH_COUNT(health->watchdog_resends);
 				atecc_idle();
-				u2f_delay(5);
+				atecc_wait(5, NULL);
 				atecc_wake();
-				u2f_delay(5);
+				atecc_wait(5, NULL);
+				session_wake_ms = get_ms();
 				goto resend;
 				break;
+			case ERROR_I2C_RESTART:
+				// the command has run and may have changed TempKey,
+				// so read its response again instead of resending it
+				smb_stats.retries++;
+				HEALTH_COUNT(health->bus_errors);
+				set_app_error(ERROR_NOTHING);
+				atecc_wait(ATECC_POLL_STEP_MS, NULL);
+				continue;
 			case ERROR_ATECC_WAKE:
-				u2f_delay(1);
+				HEALTH_COUNT(health->wake_resends);
+				atecc_wait(1, NULL);
+				goto resend;
+				break;
+			case ERROR_I2C_CRC:
+			case ERROR_ATECC_CRC:
+				HEALTH_COUNT(health->crc_errors);
+				atecc_wait(10, NULL);
+				goto resend;
+				break;
+			case ERROR_READ_TRUNCATED:
+			case ERROR_I2C_BAD_LEN:
+				HEALTH_COUNT(health->truncated);
+				atecc_wait(10, NULL);
 				goto resend;
 				break;
 			default:
-				u2f_delay(10);
+				atecc_wait(10, NULL);
 				goto resend;
 				break;
 		}
 
 	}
-	atecc_idle();
+	if (op < ATECC_TIMING_OPS)
+	{
+		timing_update(op, poll_ms - sent_ms, nacks);
+	}
+	if (!session)
+	{
+		atecc_idle();
+	}
 	return 0;
 }
 
+void atecc_session_begin()
+{
+	session = 1;
+	session_awake = 0;
+}
+
+void atecc_session_end()
+{
+	if (session_awake)
+	{
+		atecc_idle();
+	}
+	session = 0;
+	session_awake = 0;
+}
+
 /**
  * Initializes sha256 computation on ATECC chip. Uses global sha_ctx variable.
  */
@@ -272,7 +490,6 @@ void u2f_sha256_start_default()
  */
 void u2f_sha256_update(uint8_t * buf, uint8_t len)
 {
-	uint8_t i = 0;
 	watchdog();
 	while(len--)
 	{
@@ -538,6 +755,46 @@ void atecc_test_signature(int keyslot, uint8_t * buf)
 
 #endif
 
+static int8_t rng_pool_fill()
+{
+	struct atecc_response res;
+
+	if (atecc_send_recv(ATECC_CMD_RNG,ATECC_RNG_P1,ATECC_RNG_P2,
+			NULL, 0,
+			appdata.tmp, sizeof(appdata.tmp), &res) != 0)
+	{
+		memset(rng_pool, 0, sizeof(rng_pool));
+		rng_pool_len = 0;
+		rng_pool_failed = 1;
+		return -1;
+	}
+	memmove(rng_pool + rng_pool_len, res.buf, ATECC_RNG_POOL_SIZE - rng_pool_len);
+	memset(res.buf, 0, ATECC_RNG_POOL_SIZE);
+	rng_pool_len = ATECC_RNG_POOL_SIZE;
+	rng_pool_failed = 0;
+	return 0;
+}
+
+int8_t atecc_rng(uint8_t * out, uint8_t len)
+{
+	if (rng_pool_len < len && rng_pool_fill() != 0)
+	{
+		return -1;
+	}
+	rng_pool_len -= len;
+	memmove(out, rng_pool + rng_pool_len, len);
+	memset(rng_pool + rng_pool_len, 0, len);
+	return 0;
+}
+
+void atecc_rng_refill()
+{
+	if (rng_pool_len < ATECC_RNG_POOL_SIZE && !rng_pool_failed)
+	{
+		rng_pool_fill();
+	}
+}
+
 #ifdef FEAT_FACTORY_RESET
 
 /**
@@ -685,7 +942,7 @@ uint8_t generate_device_key(uint8_t *output_debug, uint8_t *buf, uint8_t buflen)
 		memmove(output_debug+32, buf, 16);
 
 	u2f_sha256_start(U2F_DEVICE_KEY_SLOT, ATECC_SHA_HMACSTART);
-	u2f_sha256_update("successful write test", 18);
+	u2f_sha256_update((uint8_t *)"successful write test", 18);
 	u2f_sha256_finish();
 	if (output_debug != NULL)
 		memmove(output_debug+16, res_digest.buf, 16);
@@ -895,7 +1152,7 @@ void atecc_setup_device(struct config_msg * usb_msg_in)
 
 			for (i=0; i<16; i++){
 				u2f_sha256_start(i, ATECC_SHA_HMACSTART);
-				u2f_sha256_update("successful write test", 18);
+				u2f_sha256_update((uint8_t *)"successful write test", 18);
 				u2f_sha256_finish();
 				if (get_app_error() == ERROR_NOTHING)
 						memmove(usb_msg_out.buf+i*3+1, res_digest.buf, 3);
@@ -28,6 +28,7 @@
 #include <efm8_usb.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include "app.h"
 #include "bsp.h"
 #include "gpio.h"
@@ -47,18 +48,160 @@ void u2f_delay(uint32_t ms) {
 	}
 }
 
-void usb_write(uint8_t* buf, uint8_t len)
+// Packets for EP1IN wait in this ring until the endpoint is free, the
+// transfer complete callback loads the next one. The caller may reuse
+// its buffer as soon as usb_write returns. A packet streamed from code
+// memory keeps only its header in the ring.
+static uint8_t usb_tx_queue[HID_TX_QUEUE_LEN][HID_PACKET_SIZE];
+static uint8_t usb_tx_len[HID_TX_QUEUE_LEN];
+static uint8_t code * usb_tx_code[HID_TX_QUEUE_LEN];
+static uint8_t usb_tx_code_len[HID_TX_QUEUE_LEN];
+static uint16_t usb_tx_queued_t[HID_TX_QUEUE_LEN];
+static data volatile uint8_t usb_tx_head = 0;
+static data volatile uint8_t usb_tx_tail = 0;
+static data volatile uint8_t usb_tx_busy = 0;
+static uint16_t usb_tx_burst_wait = 0;
+struct usb_tx_stats usb_tx_stats;
+
+#define usb_tx_count()		((uint8_t)(usb_tx_head - usb_tx_tail))
+
+// must run with the USB interrupt masked or from the interrupt
+static void usb_tx_start()
+{
+	uint8_t i;
+	uint16_t waited;
+	int8_t status;
+
+	if (usb_tx_busy || usb_tx_count() == 0)
+	{
+		return;
+	}
+
+	i = usb_tx_tail & (HID_TX_QUEUE_LEN - 1);
+	if (usb_tx_code[i] == NULL)
+	{
+		status = USBD_Write(EP1IN, usb_tx_queue[i], usb_tx_len[i], true);
+	}
+	else if (USBD_GetUsbState() == USBD_STATE_CONFIGURED && !USBD_EpIsBusy(EP1IN))
+	{
+		// the header goes first, USBD_Write appends the payload and
+		// sends the packet
+		USB_WriteFIFO(1, usb_tx_len[i], usb_tx_queue[i], false);
+		status = USBD_Write(EP1IN, usb_tx_code[i], usb_tx_code_len[i], true);
+	}
+	else
+	{
+		return;
+	}
+
+	if (status == USB_STATUS_OK)
+	{
+		usb_tx_busy = 1;
+		waited = (uint16_t)get_ms() - usb_tx_queued_t[i];
+		usb_tx_burst_wait += waited;
+	}
+}
+
+void usb_write_complete()
+{
+	usb_tx_busy = 0;
+	if (usb_tx_count() != 0)
+	{
+		usb_tx_tail++;
+	}
+	usb_tx_stats.packets++;
+
+	if (usb_tx_count() == 0)
+	{
+		// the whole response is out
+		usb_tx_stats.last_wait_ms = usb_tx_burst_wait;
+		if (usb_tx_burst_wait > usb_tx_stats.max_wait_ms)
+		{
+			usb_tx_stats.max_wait_ms = usb_tx_burst_wait;
+		}
+		usb_tx_burst_wait = 0;
+	}
+	else
+	{
+		usb_tx_start();
+	}
+}
+
+// returns the free slot to fill, or -1 if the queue did not drain
+static int8_t usb_tx_reserve()
 {
 	uint8_t errors = 0;
-	while (USB_STATUS_OK != (USBD_Write(EP1IN, buf, len, false)))
+	uint8_t old_int;
+	uint32_t t;
+
+	if (usb_tx_count() == HID_TX_QUEUE_LEN)
 	{
-		u2f_delay(2);
-		if (errors++ > 30)
+		usb_tx_stats.full_waits++;
+		t = get_ms();
+		while (usb_tx_count() == HID_TX_QUEUE_LEN)
 		{
-			set_app_error(ERROR_USB_WRITE);
-			break;
+			old_int = IE_EA;
+			IE_EA = 0;
+			usb_tx_start();
+			IE_EA = old_int;
+
+			u2f_delay(2);
+			if (errors++ > 30)
+			{
+				set_app_error(ERROR_USB_WRITE);
+				return -1;
+			}
 		}
+		usb_tx_stats.blocked_ms += get_ms() - t;
+	}
+
+	return usb_tx_head & (HID_TX_QUEUE_LEN - 1);
+}
+
+static void usb_tx_push(uint8_t i)
+{
+	uint8_t old_int;
+
+	usb_tx_queued_t[i] = (uint16_t)get_ms();
+
+	old_int = IE_EA;
+	IE_EA = 0;
+	usb_tx_head++;
+	if (usb_tx_count() > usb_tx_stats.high_water)
+	{
+		usb_tx_stats.high_water = usb_tx_count();
+	}
+	usb_tx_start();
+	IE_EA = old_int;
+}
+
+void usb_write(uint8_t* buf, uint8_t len)
+{
+	int8_t i = usb_tx_reserve();
+
+	if (i < 0)
+	{
+		return;
+	}
+	memmove(usb_tx_queue[i], buf, len);
+	usb_tx_len[i] = len;
+	usb_tx_code[i] = NULL;
+	usb_tx_push(i);
+}
+
+void usb_write_code(uint8_t* hdr, uint8_t hdr_len, uint8_t code * payload, uint8_t len)
+{
+	int8_t i = usb_tx_reserve();
+
+	if (i < 0)
+	{
+		return;
 	}
+	memmove(usb_tx_queue[i], hdr, hdr_len);
+	usb_tx_len[i] = hdr_len;
+	usb_tx_code[i] = payload;
+	usb_tx_code_len[i] = len;
+	usb_tx_push(i);
 }
 
 
@@ -27,6 +27,7 @@
 #include <SI_EFM8UB3_Register_Enums.h>
 #include <efm8_usb.h>
 #include <stdio.h>
+#include <string.h>
 #include "app.h"
 #include "bsp.h"
 #include "descriptors.h"
@@ -86,14 +87,14 @@ USB_Status_TypeDef USBD_SetupCmdCb(
 			{
 				if ((setup->wValue >> 8) == USB_HID_REPORT_DESCRIPTOR) {
 
-						USBD_Write(EP0, ReportDescriptor0,
+						USBD_Write(EP0, (uint8_t *)ReportDescriptor0,
 								EFM8_MIN(sizeof(ReportDescriptor0), setup->wLength),
 								false);
 						retVal = USB_STATUS_OK;
 
 				} else if ((setup->wValue >> 8) == USB_HID_DESCRIPTOR) {
 
-						USBD_Write(EP0, (&configDesc[18]),
+						USBD_Write(EP0, (uint8_t *)(&configDesc[18]),
 								EFM8_MIN(USB_HID_DESCSIZE, setup->wLength), false);
 						retVal = USB_STATUS_OK;
 
@@ -139,7 +140,67 @@ USB_Status_TypeDef USBD_SetupCmdCb(
 
 
 
-uint8_t hidmsgbuf[64];
+// Ring of received HID frames. The USB interrupt fills the slot at
+// head and re-arms EP1OUT on the next free slot right away, the main
+// loop dispatches and releases the slot at tail. When the ring is full
+// EP1OUT is left unarmed and the host is NAKed until a slot is released.
+uint8_t hidmsgbuf[HID_RX_QUEUE_LEN][HID_PACKET_SIZE];
+static data volatile uint8_t hid_rx_head = 0;
+static data volatile uint8_t hid_rx_tail = 0;
+struct hid_rx_stats hid_rx_stats;
+
+#define hid_rx_count()		((uint8_t)(hid_rx_head - hid_rx_tail))
+
+// must run with the USB interrupt masked or from the interrupt
+static void hid_rx_arm()
+{
+	if (hid_rx_count() < HID_RX_QUEUE_LEN && !USBD_EpIsBusy(EP1OUT))
+	{
+		if (USBD_Read(EP1OUT, hidmsgbuf[hid_rx_head & (HID_RX_QUEUE_LEN - 1)], HID_PACKET_SIZE, true) != USB_STATUS_OK)
+		{
+			set_app_error(ERROR_USB_WRITE);
+		}
+	}
+}
+
+void hid_rx_init()
+{
+	hid_rx_head = 0;
+	hid_rx_tail = 0;
+	memset(&hid_rx_stats, 0, sizeof(hid_rx_stats));
+}
+
+void hid_rx_poll()
+{
+	uint8_t old_int;
+
+	if (!USBD_EpIsBusy(EP1OUT))
+	{
+		old_int = IE_EA;
+		IE_EA = 0;
+		hid_rx_arm();
+		IE_EA = old_int;
+	}
+}
+
+struct u2f_hid_msg * hid_rx_peek()
+{
+	if (hid_rx_count() == 0)
+	{
+		return NULL;
+	}
+	return (struct u2f_hid_msg *) hidmsgbuf[hid_rx_tail & (HID_RX_QUEUE_LEN - 1)];
+}
+
+void hid_rx_release()
+{
+	if (hid_rx_count() != 0)
+	{
+		hid_rx_tail++;
+	}
+	hid_rx_poll();
+}
+
 uint16_t USBD_XferCompleteCb(uint8_t epAddr, USB_Status_TypeDef status,
 		uint16_t xferred, uint16_t remaining ) {
 
@@ -150,7 +211,20 @@ uint16_t USBD_XferCompleteCb(uint8_t epAddr, USB_Status_TypeDef status,
 
 	if (epAddr == EP1OUT)
 	{
-		set_app_u2f_hid_msg((struct u2f_hid_msg *) hidmsgbuf );
+		hid_rx_head++;
+		if (hid_rx_count() > hid_rx_stats.high_water)
+		{
+			hid_rx_stats.high_water = hid_rx_count();
+		}
+		if (hid_rx_count() == HID_RX_QUEUE_LEN)
+		{
+			hid_rx_stats.overflows++;
+		}
+		hid_rx_arm();
+	}
+	else if (epAddr == EP1IN)
+	{
+		usb_write_complete();
 	}
 	return 0;
 }
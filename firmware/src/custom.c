@@ -35,19 +35,32 @@
 #include "bsp.h"
 #include "gpio.h"
 #include "atecc508a.h"
+#include "i2c.h"
 #include "eeprom.h"
 #include "u2f.h"
 #include "configuration.h"
 #include "sanity-check.h"
 #include "version.h"
+#include "profile.h"
 
 #define _MIN(a,b)	((a)<=(b))? (a):(b)
 
+// vendor commands answer in big endian, like U2F
+static void put_u16(uint8_t * out, uint16_t v)
+{
+	out[0] = v >> 8;
+	out[1] = v & 0xff;
+}
+
 uint8_t custom_command(struct u2f_hid_msg * msg)
 {
-	struct atecc_response res;
-	uint8_t ec;
 	uint8_t *out = msg->pkt.init.payload;
+	uint16_t len;
+	uint8_t n;
+	uint8_t clear;
+#ifdef U2F_PROFILE
+	uint8_t f;
+#endif
 
 	switch(msg->pkt.init.cmd)
 	{
@@ -80,6 +93,115 @@ uint8_t custom_command(struct u2f_hid_msg * msg)
 			usb_write((uint8_t*)msg, 64);
 			break;
 
+#ifndef ATECC_SETUP_DEVICE
+		case U2F_CUSTOM_ATECC_HEALTH:
+			clear = U2FHID_LEN(msg) > 0 && out[0];
+			u2f_hid_respond(msg, ATECC_HEALTH_OPS * (6 + ATECC_HEALTH_ERRORS));
+			for (n = 0; n < ATECC_HEALTH_OPS; n++)
+			{
+				appdata.tmp[0] = n < ATECC_TIMING_OPS ? atecc_timing[n].opcode : 0;
+				appdata.tmp[1] = n < ATECC_TIMING_OPS ? atecc_timing[n].p1 : ATECC_TIMING_ANY_P1;
+				put_u16(appdata.tmp+2, atecc_health[n].commands);
+				put_u16(appdata.tmp+4, atecc_health[n].polls);
+				memmove(appdata.tmp+6, &atecc_health[n].send_nacks, ATECC_HEALTH_ERRORS);
+				u2f_hid_writeback(appdata.tmp, 6 + ATECC_HEALTH_ERRORS);
+			}
+			u2f_hid_flush();
+			if (clear)
+			{
+				atecc_health_reset();
+				memset(&smb_stats, 0, sizeof(smb_stats));
+			}
+			break;
+#endif //ATECC_SETUP_DEVICE
+
+#ifdef U2F_PROFILE
+		case U2F_CUSTOM_PROFILE:
+			clear = U2FHID_LEN(msg) > 0 && out[0];
+			u2f_hid_respond(msg, 3 + profile_stored * (8 + PROFILE_PHASES * 2));
+			appdata.tmp[0] = PROFILE_UNIT_US;
+			appdata.tmp[1] = PROFILE_PHASES;
+			appdata.tmp[2] = profile_stored;
+			u2f_hid_writeback(appdata.tmp, 3);
+			for (n = 0; n < profile_stored; n++)
+			{
+				struct profile * p = &profile_ring[(profile_head + PROFILE_RING_LEN - profile_stored + n) % PROFILE_RING_LEN];
+				appdata.tmp[0] = p->ins;
+				appdata.tmp[1] = p->p1;
+				put_u16(appdata.tmp+2, p->sw);
+				put_u16(appdata.tmp+4, p->total_us >> 16);
+				put_u16(appdata.tmp+6, p->total_us);
+				for (f = 0; f < PROFILE_PHASES; f++)
+				{
+					put_u16(appdata.tmp+8+f*2, p->phase[f]);
+				}
+				u2f_hid_writeback(appdata.tmp, 8 + PROFILE_PHASES * 2);
+			}
+			u2f_hid_flush();
+			if (clear)
+			{
+				profile_init();
+			}
+			break;
+#endif //U2F_PROFILE
+
+		case U2F_CUSTOM_USB_STATS:
+			memset(out, 0xEE, sizeof(msg->pkt.init.payload));
+			out[0] = usb_tx_stats.high_water;
+			put_u16(out+1, usb_tx_stats.packets);
+			put_u16(out+3, usb_tx_stats.full_waits);
+			put_u16(out+5, usb_tx_stats.blocked_ms);
+			put_u16(out+7, usb_tx_stats.last_wait_ms);
+			put_u16(out+9, usb_tx_stats.max_wait_ms);
+			out[11] = hid_rx_stats.high_water;
+			put_u16(out+12, hid_rx_stats.overflows);
+
+			U2FHID_SET_LEN(msg, 14);
+			usb_write((uint8_t*)msg, 64);
+			break;
+
+#ifndef ATECC_SETUP_DEVICE
+		case U2F_CUSTOM_TAG_CACHE_STATS:
+			memset(out, 0xEE, sizeof(msg->pkt.init.payload));
+			put_u16(out, u2f_tag_cache_stats.hits);
+			put_u16(out+2, u2f_tag_cache_stats.misses);
+
+			U2FHID_SET_LEN(msg, 4);
+			usb_write((uint8_t*)msg, 64);
+			break;
+#endif //ATECC_SETUP_DEVICE
+
+		case U2F_CUSTOM_SMB_STATS:
+			memset(out, 0xEE, sizeof(msg->pkt.init.payload));
+			put_u16(out, smb_stats.timeouts);
+			put_u16(out+2, smb_stats.bus_errors);
+			put_u16(out+4, smb_stats.scl_timeouts);
+			put_u16(out+6, smb_stats.recoveries);
+			put_u16(out+8, smb_stats.stuck_sda);
+			put_u16(out+10, smb_stats.retries);
+
+			U2FHID_SET_LEN(msg, 12);
+			usb_write((uint8_t*)msg, 64);
+			break;
+
+#ifndef ATECC_SETUP_DEVICE
+		case U2F_CUSTOM_ATECC_TIMING:
+			u2f_hid_respond(msg, ATECC_TIMING_OPS * 10);
+			for (n = 0; n < ATECC_TIMING_OPS; n++)
+			{
+				appdata.tmp[0] = atecc_timing[n].opcode;
+				appdata.tmp[1] = atecc_timing[n].p1;
+				appdata.tmp[2] = atecc_timing[n].expect_ms;
+				appdata.tmp[3] = atecc_timing[n].worst_ms;
+				put_u16(appdata.tmp+4, atecc_timing[n].commands);
+				put_u16(appdata.tmp+6, atecc_timing[n].polls);
+				put_u16(appdata.tmp+8, atecc_timing[n].nacks);
+				u2f_hid_writeback(appdata.tmp, 10);
+			}
+			u2f_hid_flush();
+			break;
+#endif //ATECC_SETUP_DEVICE
+
 		case U2F_CUSTOM_UPDATE_CONFIG:
 			if(u2f_get_user_feedback_extended_wipe()){
 				memset(out, 0xEE, sizeof(msg->pkt.init.payload));
@@ -120,6 +242,10 @@ uint8_t custom_command(struct u2f_hid_msg * msg)
 			eeprom_erase(EEPROM_DATA_RMASK);
 			eeprom_erase(EEPROM_DATA_U2F_CONST);
 			eeprom_erase(EEPROM_DATA_CONFIG);
+#ifndef ATECC_SETUP_DEVICE
+			u2f_tag_cache_clear();
+#endif //ATECC_SETUP_DEVICE
+			u2f_key_slots_clear();
 
 #ifndef _PRODUCTION_RELEASE
 			eeprom_read(EEPROM_DATA_WMASK, out+3+8+8+8+8+8, 4);
@@ -143,12 +269,8 @@ uint8_t custom_command(struct u2f_hid_msg * msg)
 
 #ifdef U2F_SUPPORT_RNG_CUSTOM
 		case U2F_CUSTOM_GET_RNG:
-			if (atecc_send_recv(ATECC_CMD_RNG,ATECC_RNG_P1,ATECC_RNG_P2,
-				NULL, 0,
-				appdata.tmp,
-				sizeof(appdata.tmp), &res) == 0 )
+			if (atecc_rng(msg->pkt.init.payload, 32) == 0)
 			{
-				memmove(msg->pkt.init.payload, res.buf, 32);
 				U2FHID_SET_LEN(msg, 32);
 				usb_write((uint8_t*)msg, 64);
 			}
@@ -159,6 +281,39 @@ uint8_t custom_command(struct u2f_hid_msg * msg)
 			}
 
 			break;
+
+#ifndef ATECC_SETUP_DEVICE
+		case U2F_CUSTOM_RNG_STREAM:
+			len = ((uint16_t)out[0] << 8) | out[1];
+			if (U2FHID_LEN(msg) != 2 || len == 0 || len > U2FHID_MAX_PAYLOAD_SIZE)
+			{
+				U2FHID_SET_LEN(msg, 0);
+				usb_write((uint8_t*)msg, 64);
+				break;
+			}
+
+			// the packets queued for EP1IN go out while the ATECC
+			// generates the next block
+			u2f_hid_respond(msg, len);
+			while (len)
+			{
+				watchdog();
+				n = _MIN(len, ATECC_RNG_POOL_SIZE);
+				if (atecc_rng(appdata.tmp, n) != 0)
+				{
+					u2f_hid_abort(ERR_OTHER);
+					break;
+				}
+				u2f_hid_writeback(appdata.tmp, n);
+				len -= n;
+			}
+			memset(appdata.tmp, 0, ATECC_RNG_POOL_SIZE);
+			if (!len)
+			{
+				u2f_hid_flush();
+			}
+			break;
+#endif //ATECC_SETUP_DEVICE
 #endif //#ifdef U2F_SUPPORT_RNG_CUSTOM
 #ifdef U2F_SUPPORT_WINK
 		case U2F_CUSTOM_WINK:
@@ -33,51 +33,160 @@
 #include "bsp.h"
 #include "app.h"
 
-uint8_t smb_read (uint8_t addr, uint8_t* dest, uint8_t count)
-{
-	while(SMB_IS_BUSY()){}
+// the transfer of smb_read and smb_write, and the buffer set for the
+// next smb_write
+static struct smb_xfer smb_sync;
+static uint8_t * smb_ext_buf = NULL;
+static uint8_t smb_ext_len = 0;
 
-	SMB_crc = 0;
-	SMB_crc_offset = 0;
-	SMB_FLAGS = SMB_READ | SMB_BUSY | SMB_preflags;
-	SMB_preflags = 0;
+struct smb_stats smb_stats;
 
-	SMB_read_offset = 0;
-	SMB_addr = addr;
-	SMB_read_len = count;
-	SMB_read_buf = dest;
-	SMB0CN0_STA = 1;
+#ifndef U2F_HOST_BUILD
+// tools/hostsim runs the transfers in its own smb_queue
+int8_t smb_queue(struct smb_xfer * x)
+{
+	uint8_t old_int;
+
+	if (SMB_QUEUED() == SMB_QUEUE_LEN)
+	{
+		return -1;
+	}
+	x->status = SMB_XFER_QUEUED;
+	x->flags = 0;
+
+	old_int = IE_EA;
+	IE_EA = 0;
+	SMB_queue[SMB_queue_head & (SMB_QUEUE_LEN - 1)] = x;
+	SMB_queue_head++;
+	// otherwise the ISR starts it after the one on the bus
+	if (SMB_QUEUED() == 1 && !SMB_IS_BUSY())
+	{
+		SMB0CN0_STA = 1;
+	}
+	IE_EA = old_int;
+	return 0;
+}
+#endif
 
-	while(SMB_IS_BUSY()){}
-	return SMB_read_len;
+// about 3 us at 48 MHz, the ATECC508A takes SCL up to 1 MHz
+static void smb_half_bit()
+{
+	volatile uint8_t i = 16;
+	while (--i)
+		;
 }
 
+void smb_recover()
+{
+	uint8_t old_int;
+	uint8_t i;
+
+	old_int = IE_EA;
+	IE_EA = 0;
+	smb_stats.recoveries++;
+
+	// the pins to the port latches
+	SMB0CF &= ~SMB0CF_ENSMB__BMASK;
+	XBR0 &= ~XBR0_SMB0E__BMASK;
+	U2F_SDA = 1;
+	U2F_SCL = 1;
+	smb_half_bit();
+	if (!U2F_SDA)
+	{
+		smb_stats.stuck_sda++;
+	}
+	for (i = 0; i < SMB_CLOCK_OUT_PULSES && !U2F_SDA; i++)
+	{
+		U2F_SCL = 0;
+		smb_half_bit();
+		U2F_SCL = 1;
+		smb_half_bit();
+	}
+	// stop
+	U2F_SCL = 0;
+	smb_half_bit();
+	U2F_SDA = 0;
+	smb_half_bit();
+	U2F_SCL = 1;
+	smb_half_bit();
+	U2F_SDA = 1;
+	smb_half_bit();
+
+	XBR0 |= XBR0_SMB0E__BMASK;
+	SMB0CF |= SMB0CF_ENSMB__BMASK;
+	SMB0CN0_STA = 0;
+	SMB0CN0_STO = 0;
+	SMB0CN0_ACK = 0;
+
+	while (SMB_QUEUED())
+	{
+		SMB_queue[SMB_queue_tail & (SMB_QUEUE_LEN - 1)]->flags = SMB_RECV_NACK | SMB_BUS_ERROR;
+		SMB_queue[SMB_queue_tail & (SMB_QUEUE_LEN - 1)]->status = SMB_XFER_DONE;
+		SMB_queue_tail++;
+	}
+	SMB_FLAGS = 0;
+	SMB_fault = 0;
+	IE_EA = old_int;
+}
 
-void smb_write (uint8_t addr, uint8_t* buf, uint8_t len)
+uint8_t smb_poll(struct smb_xfer * x, uint32_t start)
 {
-	while(SMB_IS_BUSY()){}
+	if (!smb_done(x) && get_ms() - start > SMB_XFER_TIMEOUT_MS)
+	{
+		smb_stats.timeouts++;
+		smb_recover();
+	}
+	else if (SMB_fault)
+	{
+		smb_recover();
+	}
+	return smb_done(x);
+}
 
-	SMB_crc = 0;
-	SMB_crc_offset = 0;
-	SMB_FLAGS = SMB_WRITE | SMB_BUSY | SMB_preflags;
-	SMB_preflags = 0;
+static void smb_sync_run()
+{
+	uint32_t start = get_ms();
+	while(SMB_QUEUED())
+	{
+		if (get_ms() - start > SMB_XFER_TIMEOUT_MS)
+		{
+			smb_stats.timeouts++;
+			smb_recover();
+		}
+	}
+	smb_queue(&smb_sync);
+	start = get_ms();
+	while(!smb_poll(&smb_sync, start)){}
+}
+
+uint8_t smb_read (uint8_t addr, uint8_t* dest, uint8_t count)
+{
+	smb_sync.addr = addr;
+	smb_sync.write_len = 0;
+	smb_sync.write_ext_len = 0;
+	smb_sync.read_buf = dest;
+	smb_sync.read_len = count;
+	smb_sync_run();
+	return smb_sync.read_len;
+}
 
-	SMB_write_len = len;
-	SMB_write_buf = buf;
-	SMB_write_offset = 0;
-	SMB_addr = addr;
 
-	SMB0CN0_STA = 1;
-	while(SMB_IS_BUSY()){}
+void smb_write (uint8_t addr, uint8_t* buf, uint8_t len)
+{
+	smb_sync.addr = addr;
+	smb_sync.write_buf = buf;
+	smb_sync.write_len = len;
+	smb_sync.write_ext_buf = smb_ext_buf;
+	smb_sync.write_ext_len = smb_ext_len;
+	smb_sync.read_len = 0;
+	smb_ext_len = 0;
+	smb_sync_run();
 }
 
 void smb_set_ext_write( uint8_t* extbuf, uint8_t extlen)
 {
-	while(SMB_IS_BUSY()){}
-	SMB_write_ext_len = extlen;
-	SMB_write_ext_buf = extbuf;
-	SMB_write_ext_offset = 0;
-	SMB_preflags |= SMB_WRITE_EXT;
+	smb_ext_len = extlen;
+	smb_ext_buf = extbuf;
 }
 
 // CRC-16 appropriate for a byte model interrupt routine.
@@ -107,4 +216,9 @@ uint16_t reverse_bits(uint16_t crc)
 void smb_init()
 {
 	SMB_FLAGS = 0;
+	SMB_queue_head = 0;
+	SMB_queue_tail = 0;
+	smb_ext_len = 0;
+	SMB_fault = 0;
+	memset(&smb_stats, 0, sizeof(smb_stats));
 }
@@ -46,52 +46,6 @@
 #include "tests.h"
 #include "sanity-check.h"
 
-data struct APP_DATA appdata;
-
-uint8_t error;
-uint8_t state;
-
-
-struct u2f_hid_msg * hid_msg;
-
-
-static void init(struct APP_DATA* ap)
-{
-
-	u2f_hid_init();
-	smb_init();
-	atecc_idle();
-#ifdef _SECURE_EEPROM
-	eeprom_init();
-#endif
-
-	state = APP_NOTHING;
-	error = ERROR_NOTHING;
-}
-
-void set_app_error(APP_ERROR_CODE ec)
-{
-	error = ec;
-}
-
-uint8_t get_app_error()
-{
-	return error;
-}
-
-uint8_t get_app_state()
-{
-	return state;
-}
-
-
-void set_app_u2f_hid_msg(struct u2f_hid_msg * msg )
-{
-	state = APP_HID_MSG;
-	hid_msg = msg;
-}
-
-
 int16_t main(void) {
 	data uint8_t xdata * clear = 0;
 	uint16_t i;
@@ -105,7 +59,7 @@ int16_t main(void) {
 	WDTCN = 5;
 
 	watchdog();
-	init(&appdata);
+	app_init();
 
 	atecc_sleep();
 
@@ -142,61 +96,11 @@ int16_t main(void) {
 	}
 
 	while (1) {
-		watchdog();
-
-		clear_button_press();
-        button_manager();
-        led_blink_manager();
-        #ifdef __BUTTON_TEST__
-//        if (!LedBlinkNum) {
-            if (button_get_press()) { led_on();  }
-            else                    { led_off(); }
-//        }
-        #endif
-
-		if (!USBD_EpIsBusy(EP1OUT) && !USBD_EpIsBusy(EP1IN) && state != APP_HID_MSG)
-		{
-			if (USBD_Read(EP1OUT, hidmsgbuf, sizeof(hidmsgbuf), true) != USB_STATUS_OK){
-				set_app_error(ERROR_USB_WRITE);
-			}
-		}
-
-		u2f_hid_check_timeouts();
-
-		switch(state) {
-			case APP_NOTHING: {}break;                     // Idle state:
-
-			case APP_HID_MSG: {                            // HID msg received, pass to protocols:
-#ifndef ATECC_SETUP_DEVICE
-				struct CID* cid = NULL;
-				cid = get_cid(hid_msg->cid);
-				if (cid == NULL || !cid->busy) {                          // There is no ongoing U2FHID transfer
-					if (!custom_command(hid_msg)) {
-						u2f_hid_request(hid_msg);
-					}
-				} else {
-					u2f_hid_request(hid_msg);
-				}
-#else //!ATECC_SETUP_DEVICE
-				if (!custom_command(hid_msg)) {
-					 u2f_hid_request(hid_msg);
-				}
-#endif //ATECC_SETUP_DEVICE
-				if (state == APP_HID_MSG) {                // The USB msg doesnt ask a special app state
-					state = APP_NOTHING;	               // We can go back to idle
-				}
-			}break;
-		}
-
-		watchdog();
-		if(atecc_used){
-			atecc_sleep();
-			atecc_used = 0;
-		}
+		app_loop();
 
-		if (error)
+		if (get_app_error())
 		{
-			u2f_printx("error: ", 1, (uint16_t)error);
+			u2f_printx("error: ", 1, (uint16_t)get_app_error());
 
 			clear = 0;
 			for (i=0; i<2048; i++)                    // wipe ram
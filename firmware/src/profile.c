@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "app.h"
+#include "bsp.h"
+#include "profile.h"
+
+#ifdef U2F_PROFILE
+
+#define PROFILE_IDLE		0
+#define PROFILE_OPEN		1
+#define PROFILE_PAUSED		2
+
+struct profile profile_ring[PROFILE_RING_LEN];
+uint8_t profile_head;
+uint8_t profile_stored;
+
+static struct profile current;
+static uint8_t state;
+static uint8_t frame_seen;
+static uint32_t frame_us;
+static uint32_t first_us;
+static uint32_t last_us;
+
+void profile_init()
+{
+	memset(profile_ring, 0, sizeof(profile_ring));
+	profile_head = 0;
+	profile_stored = 0;
+	state = PROFILE_IDLE;
+	frame_seen = 0;
+}
+
+void profile_frame()
+{
+	frame_us = get_us();
+	frame_seen = 1;
+}
+
+void profile_mark(uint8_t phase)
+{
+	uint32_t now;
+	uint32_t sum;
+
+	if (state != PROFILE_OPEN)
+	{
+		return;
+	}
+	now = get_us();
+	sum = current.phase[phase] + (now - last_us) / PROFILE_UNIT_US;
+	current.phase[phase] = sum > 0xffff ? 0xffff : sum;
+	last_us = now;
+}
+
+void profile_begin(uint8_t ins, uint8_t p1, uint8_t replay)
+{
+	if (state == PROFILE_PAUSED)
+	{
+		frame_seen = 0;
+		if (replay)
+		{
+			state = PROFILE_OPEN;
+			profile_mark(PROFILE_PRESENCE);
+		}
+		return;
+	}
+
+	memset(&current, 0, sizeof(current));
+	current.ins = ins;
+	current.p1 = p1;
+	last_us = frame_seen ? frame_us : get_us();
+	first_us = last_us;
+	frame_seen = 0;
+	state = PROFILE_OPEN;
+	profile_mark(PROFILE_HID);
+}
+
+void profile_pause()
+{
+	profile_mark(PROFILE_PRESENCE);
+	if (state == PROFILE_OPEN)
+	{
+		state = PROFILE_PAUSED;
+	}
+}
+
+void profile_drop()
+{
+	if (state == PROFILE_PAUSED)
+	{
+		state = PROFILE_IDLE;
+	}
+}
+
+void profile_end(uint16_t sw)
+{
+	if (state != PROFILE_OPEN)
+	{
+		return;
+	}
+	current.sw = sw;
+	current.total_us = get_us() - first_us;
+	memmove(&profile_ring[profile_head], &current, sizeof(current));
+	profile_head = (profile_head + 1) % PROFILE_RING_LEN;
+	if (profile_stored < PROFILE_RING_LEN)
+	{
+		profile_stored++;
+	}
+	state = PROFILE_IDLE;
+}
+
+#endif /* U2F_PROFILE */
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2018, Nitrokey UG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "app.h"
+#include "bsp.h"
+#include "sha256.h"
+
+#ifndef U2F_HOST_BUILD
+#include <intrins.h>
+#define ROTR(x,n)		_lror_(x,n)
+#else
+#define ROTR(x,n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#endif
+
+#define CH(x,y,z)		(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x,y,z)		(((x) & (y)) | ((z) & ((x) | (y))))
+#define EP0(x)			(ROTR(x,2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define EP1(x)			(ROTR(x,6) ^ ROTR(x,11) ^ ROTR(x,25))
+#define SIG0(x)			(ROTR(x,7) ^ ROTR(x,18) ^ ((x) >> 3))
+#define SIG1(x)			(ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+// CIP-51 cycles of one compression, estimated from the rotations and
+// the 32 bit XRAM arithmetic of a round, used by the host build only
+#define SHA256_BLOCK_CYCLES		150000UL
+
+static code uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static struct
+{
+	uint32_t state[8];
+	// the block is turned into the message schedule in place, only the
+	// last 16 words of it are kept
+	union
+	{
+		uint8_t b[SHA256_BLOCK_SIZE];
+		uint32_t w[16];
+	} buf;
+	uint8_t offset;
+	// messages of the U2F HID layer are far below 64 KiB
+	uint16_t len;
+} ctx;
+
+static void sha256_block()
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	uint32_t * w = ctx.buf.w;
+	uint8_t i;
+
+	for (i = 0; i < 16; i++)
+	{
+		w[i] = be32toh(w[i]);
+	}
+
+	a = ctx.state[0]; b = ctx.state[1]; c = ctx.state[2]; d = ctx.state[3];
+	e = ctx.state[4]; f = ctx.state[5]; g = ctx.state[6]; h = ctx.state[7];
+
+	for (i = 0; i < 64; i++)
+	{
+		if (i >= 16)
+		{
+			w[i & 15] += SIG1(w[(i - 2) & 15]) + w[(i - 7) & 15] + SIG0(w[(i - 15) & 15]);
+		}
+		t1 = h + EP1(e) + CH(e,f,g) + K[i] + w[i & 15];
+		t2 = EP0(a) + MAJ(a,b,c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx.state[0] += a; ctx.state[1] += b; ctx.state[2] += c; ctx.state[3] += d;
+	ctx.state[4] += e; ctx.state[5] += f; ctx.state[6] += g; ctx.state[7] += h;
+
+	mcu_cycles(SHA256_BLOCK_CYCLES);
+}
+
+void sha256_start()
+{
+	ctx.state[0] = 0x6a09e667;
+	ctx.state[1] = 0xbb67ae85;
+	ctx.state[2] = 0x3c6ef372;
+	ctx.state[3] = 0xa54ff53a;
+	ctx.state[4] = 0x510e527f;
+	ctx.state[5] = 0x9b05688c;
+	ctx.state[6] = 0x1f83d9ab;
+	ctx.state[7] = 0x5be0cd19;
+	ctx.offset = 0;
+	ctx.len = 0;
+}
+
+void sha256_update(uint8_t * buf, uint16_t len)
+{
+	uint8_t n;
+
+	ctx.len += len;
+	while (len)
+	{
+		n = SHA256_BLOCK_SIZE - ctx.offset;
+		if (n > len)
+		{
+			n = len;
+		}
+		memmove(ctx.buf.b + ctx.offset, buf, n);
+		ctx.offset += n;
+		buf += n;
+		len -= n;
+
+		if (ctx.offset == SHA256_BLOCK_SIZE)
+		{
+			watchdog();
+			sha256_block();
+			ctx.offset = 0;
+		}
+	}
+}
+
+void sha256_finish(uint8_t * out)
+{
+	uint8_t i;
+
+	ctx.buf.b[ctx.offset++] = 0x80;
+	if (ctx.offset > SHA256_BLOCK_SIZE - 8)
+	{
+		memset(ctx.buf.b + ctx.offset, 0, SHA256_BLOCK_SIZE - ctx.offset);
+		sha256_block();
+		ctx.offset = 0;
+	}
+	memset(ctx.buf.b + ctx.offset, 0, SHA256_BLOCK_SIZE - 8 - ctx.offset);
+
+	// length in bits, big endian
+	memset(ctx.buf.b + SHA256_BLOCK_SIZE - 8, 0, 5);
+	ctx.buf.b[SHA256_BLOCK_SIZE - 3] = ctx.len >> 13;
+	ctx.buf.b[SHA256_BLOCK_SIZE - 2] = ctx.len >> 5;
+	ctx.buf.b[SHA256_BLOCK_SIZE - 1] = ctx.len << 3;
+	sha256_block();
+
+	for (i = 0; i < 8; i++)
+	{
+		ctx.state[i] = htobe32(ctx.state[i]);
+	}
+	memmove(out, ctx.state, SHA256_DIGEST_SIZE);
+}
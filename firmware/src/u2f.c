@@ -31,6 +31,8 @@
  *
  */
 
+#include <endian.h>
+#include <string.h>
 #include "app.h"
 
 
@@ -38,24 +40,38 @@
 
 #include "bsp.h"
 #include "u2f.h"
+#include "sha256.h"
+#include "profile.h"
 
 
 // void u2f_response_writeback(uint8_t * buf, uint8_t len);
 static int16_t u2f_register(struct u2f_register_request * req);
 static int16_t u2f_version();
 static int16_t u2f_authenticate(struct u2f_authenticate_request * req, uint8_t control);
+static int16_t u2f_authenticate_multi(struct u2f_authenticate_multi_request * req, uint8_t control, uint32_t len);
+
+// The handle a signing AUTHENTICATE_MULTI verified: multi_found for the
+// request being handled, multi_index once it is deferred for the user,
+// for the replay on channel multi_cid only.
+static uint8_t multi_found;
+static uint8_t multi_index;
+static uint32_t multi_cid = 0;
 
 void u2f_request(struct u2f_request_apdu * req)
 {
     uint16_t * rcode = (uint16_t *)req;
     uint32_t len = ((req->LC3) | ((uint32_t)req->LC2 << 8) | ((uint32_t)req->LC1 << 16));
+    // the request stays intact until it is answered, it may be replayed
+    // once the user has been waited for
+    uint16_t sw;
 
+    profile_begin(req->ins, req->p1, u2f_request_replayed());
     u2f_response_start();
 
     if (req->cla != 0)
     {
     	u2f_hid_set_len(U2F_SW_LENGTH);
-    	*rcode = U2F_SW_CLASS_NOT_SUPPORTED;
+    	sw = U2F_SW_CLASS_NOT_SUPPORTED;
     	goto end;
     }
 
@@ -65,40 +81,64 @@ void u2f_request(struct u2f_request_apdu * req)
         	if (len != 64)
         	{
             	u2f_hid_set_len(U2F_SW_LENGTH);
-            	*rcode = U2F_SW_WRONG_LENGTH;
+            	sw = U2F_SW_WRONG_LENGTH;
         	}
         	else
         	{
-        		*rcode = u2f_register((struct u2f_register_request*)req->payload);
+        		sw = u2f_register((struct u2f_register_request*)req->payload);
         	}
             break;
         case U2F_AUTHENTICATE:
-        	 *rcode = u2f_authenticate((struct u2f_authenticate_request*)req->payload, req->p1);
+        	 sw = u2f_authenticate((struct u2f_authenticate_request*)req->payload, req->p1);
         	break;
         case U2F_VERSION:
         	if (len)
         	{
             	u2f_hid_set_len(U2F_SW_LENGTH);
-            	*rcode = U2F_SW_WRONG_LENGTH;
+            	sw = U2F_SW_WRONG_LENGTH;
         	}
         	else
         	{
-        		*rcode = u2f_version();
+        		sw = u2f_version();
         	}
         	break;
+        case U2F_AUTHENTICATE_MULTI:
+        	sw = u2f_authenticate_multi((struct u2f_authenticate_multi_request*)req->payload, req->p1, len);
+        	break;
         case U2F_VENDOR_FIRST:
         case U2F_VENDOR_LAST:
-        	*rcode = U2F_SW_NO_ERROR;
+        	sw = U2F_SW_NO_ERROR;
         	break;
         default:
         	u2f_hid_set_len(U2F_SW_LENGTH);
-        	*rcode = U2F_SW_INS_NOT_SUPPORTED;
+        	sw = U2F_SW_INS_NOT_SUPPORTED;
         	break;
     }
 
+    if (sw == U2F_SW_WAIT_USER)
+    {
+    	if (u2f_response_wait() == 0)
+    	{
+    		if (req->ins == U2F_AUTHENTICATE_MULTI)
+    		{
+    			multi_index = multi_found;
+    			multi_cid = u2f_hid_current_cid();
+    		}
+    		profile_pause();
+    		return;
+    	}
+    	u2f_user_feedback_drop();
+    	u2f_hid_set_len(U2F_SW_LENGTH);
+    	sw = U2F_SW_CONDITIONS_NOT_SATISFIED;
+    }
+
     end:
+    *rcode = htobe16(sw);
     u2f_response_writeback((uint8_t*)rcode,U2F_SW_LENGTH);
+    profile_mark(PROFILE_WRITEBACK);
     u2f_response_flush();
+    profile_mark(PROFILE_FLUSH);
+    profile_end(sw);
 }
 
 static uint8_t get_signature_length(uint8_t * sig)
@@ -110,28 +150,34 @@ static void dump_signature_der(uint8_t * sig)
 {
     uint8_t pad_s = (sig[32] & 0x80) == 0x80;
     uint8_t pad_r = (sig[0] & 0x80) == 0x80;
-    uint8_t i[] = {0x30, 0x44};
-    i[1] += (pad_s + pad_r);
-
+    uint8_t hdr[5];
+    uint8_t n = 0;
 
     // DER encoded signature
-    // write der sequence
     // has to be minimum distance and padded with 0x00 if MSB is a 1.
-    u2f_response_writeback(i,2);
-    i[1] = 0;
-
-    // length of R value plus 0x00 pad if necessary
-    u2f_response_writeback("\x02",1);
-    i[0] = 0x20 + pad_r;
-    u2f_response_writeback(i,1 + pad_r);
+    // sequence header and the header of R go out in one block
+    hdr[n++] = 0x30;
+    hdr[n++] = 0x44 + pad_s + pad_r;
+    hdr[n++] = 0x02;
+    hdr[n++] = 0x20 + pad_r;
+    if (pad_r)
+    {
+        hdr[n++] = 0;
+    }
+    u2f_response_writeback(hdr, n);
 
     // R value
     u2f_response_writeback(sig, 32);
 
-    // length of S value plus 0x00 pad if necessary
-    u2f_response_writeback("\x02",1);
-    i[0] = 0x20 + pad_s;
-    u2f_response_writeback(i,1 + pad_s);
+    // header of S, length plus 0x00 pad if necessary
+    n = 0;
+    hdr[n++] = 0x02;
+    hdr[n++] = 0x20 + pad_s;
+    if (pad_s)
+    {
+        hdr[n++] = 0;
+    }
+    u2f_response_writeback(hdr, n);
 
     // S value
     u2f_response_writeback(sig+32, 32);
@@ -139,86 +185,280 @@ static void dump_signature_der(uint8_t * sig)
 
 #include "sanity-check.h"
 
-static int16_t u2f_authenticate(struct u2f_authenticate_request * req, uint8_t control)
+// U2F_SW_NO_ERROR once the user has confirmed presence
+static int16_t u2f_user_presence()
+{
+	int8_t ret = 1;
+
+	if (sanity_check_passed)
+	{
+		ret = u2f_get_user_feedback();
+	}
+	profile_mark(PROFILE_PRESENCE);
+	if (ret == U2F_FEEDBACK_PENDING)
+	{
+		return U2F_SW_WAIT_USER;
+	}
+	if (ret != 0)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		return U2F_SW_CONDITIONS_NOT_SATISFIED;
+	}
+	return U2F_SW_NO_ERROR;
+}
+
+// Signs the assertion with the key loaded for @key_handle, the signature
+// replaces @challenge and @application which must be contiguous.
+// @index, if not NULL, is sent ahead of the flags.
+static int16_t u2f_assert(uint8_t * challenge, uint8_t * application, uint8_t * key_handle, uint8_t * index)
 {
 	uint8_t users_presence_flag = 1;
 	uint32_t counter;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	// counter is big endian in the signed data and in the response
+	counter = htobe32(u2f_count());
+	profile_mark(PROFILE_COUNT);
+
+    // nothing secret is hashed, the MCU is faster at it than the ATECC
+    sha256_start();
+    sha256_update(application,U2F_APPLICATION_SIZE);
+    sha256_update(&users_presence_flag,1);
+    sha256_update((uint8_t *)&counter,4);
+    sha256_update(challenge,U2F_CHALLENGE_SIZE);
+    sha256_finish(digest);
+    profile_mark(PROFILE_SHA);
+
+    if (u2f_load_digest(digest) == -1 ||
+    		u2f_ecdsa_sign(challenge, key_handle, application) == -1)
+	{
+    	return U2F_SW_OPERATION_FAILED; //FIXME custom error code - change to any from spec?
+	}
+    profile_mark(PROFILE_SIGN);
 
-	if (control == U2F_AUTHENTICATE_CHECK)
+    u2f_hid_set_len(U2F_SW_LENGTH + (index != NULL) + 1 + 4
+    		+ get_signature_length(challenge));
+
+    if (index != NULL)
+    {
+    	u2f_response_writeback(index,1);
+    }
+    u2f_response_writeback(&users_presence_flag,1);
+    u2f_response_writeback((uint8_t *)&counter,4);
+    dump_signature_der(challenge);
+    profile_mark(PROFILE_WRITEBACK);
+
+	return U2F_SW_NO_ERROR;
+}
+
+// Cache of check-only results. An entry holds the start of a SHA-256
+// of a random salt drawn once per boot, the application and the whole
+// key handle, so a probe is only answered from it for the exact bytes
+// verified before and a host cannot craft collisions without the salt.
+// Signing always verifies the tag.
+#define TAG_DIGEST_SIZE			8
+#define TAG_SALT_SIZE			16
+
+struct tag_cache_entry
+{
+	uint8_t digest[TAG_DIGEST_SIZE];
+	uint32_t verified;
+	// 0 empty, else 1 + the result of u2f_appid_eq
+	uint8_t state;
+};
+
+static struct tag_cache_entry tag_cache[U2F_TAG_CACHE_LEN];
+static uint8_t tag_salt[TAG_SALT_SIZE];
+static uint8_t tag_salt_set = 0;
+struct u2f_tag_cache_stats u2f_tag_cache_stats;
+
+void u2f_tag_cache_clear()
+{
+	memset(tag_cache, 0, sizeof(tag_cache));
+	memset(&u2f_tag_cache_stats, 0, sizeof(u2f_tag_cache_stats));
+}
+
+// u2f_appid_eq of a check-only request, from the cache while it is fresh
+static int8_t u2f_appid_check(uint8_t * handle, uint8_t * appid)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint32_t now = get_ms();
+	struct tag_cache_entry * e;
+	struct tag_cache_entry * oldest = tag_cache;
+	uint8_t i;
+
+	if (!tag_salt_set)
 	{
-		u2f_hid_set_len(U2F_SW_LENGTH);
-		if (u2f_appid_eq(req->key_handle, req->application) == 0)
+		// nothing is cached until the salt could be drawn
+		if (u2f_random(tag_salt, TAG_SALT_SIZE) != 0)
+		{
+			u2f_tag_cache_stats.misses++;
+			return u2f_appid_eq(handle, appid) != 0;
+		}
+		tag_salt_set = 1;
+	}
+
+	sha256_start();
+	sha256_update(tag_salt, TAG_SALT_SIZE);
+	sha256_update(appid, U2F_APPLICATION_SIZE);
+	sha256_update(handle, U2F_KEY_HANDLE_SIZE);
+	sha256_finish(digest);
+
+	for (i = 0; i < U2F_TAG_CACHE_LEN; i++)
+	{
+		e = &tag_cache[i];
+		if (e->state && now - e->verified > U2F_TAG_CACHE_MS)
+		{
+			e->state = 0;
+		}
+		if (e->state && memcmp(e->digest, digest, TAG_DIGEST_SIZE) == 0)
 		{
-			return U2F_SW_CONDITIONS_NOT_SATISFIED;
+			u2f_tag_cache_stats.hits++;
+			return e->state - 1;
 		}
-		else
+		if (!e->state || (oldest->state && (int32_t)(e->verified - oldest->verified) < 0))
 		{
-			return U2F_SW_WRONG_DATA;
+			oldest = e;
 		}
 	}
 
+	u2f_tag_cache_stats.misses++;
+	memmove(oldest->digest, digest, TAG_DIGEST_SIZE);
+	oldest->state = 1 + (u2f_appid_eq(handle, appid) != 0);
+	oldest->verified = get_ms();
+	return oldest->state - 1;
+}
+
+static int16_t u2f_authenticate(struct u2f_authenticate_request * req, uint8_t control)
+{
+	uint16_t sw;
+
+	if (control == U2F_AUTHENTICATE_CHECK)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		sw = u2f_appid_check(req->key_handle, req->application) == 0 ?
+				U2F_SW_CONDITIONS_NOT_SATISFIED : U2F_SW_WRONG_DATA;
+		profile_mark(PROFILE_APPID);
+		return sw;
+	}
+
 	if(req->key_handle_length != U2F_KEY_HANDLE_SIZE){
 		u2f_hid_set_len(U2F_SW_LENGTH);
 		return U2F_SW_WRONG_LENGTH;
 	}
 
-	if 	(
-			control != U2F_AUTHENTICATE_SIGN ||
-			u2f_appid_eq(req->key_handle, req->application) != 0 ||		// Order of checks is important
-			u2f_load_key(req->key_handle, req->application) != 0
-		)
+	// Order of checks is important. The replay of a request deferred for
+	// the user has its handle verified already, and its key is normally
+	// still resident, so it goes on with the user and the signature.
+	if (control != U2F_AUTHENTICATE_SIGN ||
+			(!u2f_request_replayed() && u2f_appid_eq(req->key_handle, req->application) != 0))
 	{
 		u2f_hid_set_len(U2F_SW_LENGTH);
 		return U2F_SW_WRONG_PAYLOAD;
 	}
+	profile_mark(PROFILE_APPID);
 
-
-
-	if (!sanity_check_passed || u2f_get_user_feedback())
+	if (u2f_load_key(req->key_handle, req->application) != 0)
 	{
 		u2f_hid_set_len(U2F_SW_LENGTH);
-		return U2F_SW_CONDITIONS_NOT_SATISFIED;
+		return U2F_SW_WRONG_PAYLOAD;
 	}
+	profile_mark(PROFILE_LOAD_KEY);
 
-	counter = u2f_count();
+	sw = u2f_user_presence();
+	if (sw != U2F_SW_NO_ERROR)
+	{
+		return sw;
+	}
 
-    u2f_sha256_start_default();
-    u2f_sha256_update(req->application,sizeof(req->application));
-    u2f_sha256_update(&users_presence_flag,1);
-    u2f_sha256_update((uint8_t *)&counter,4);
-    u2f_sha256_update(req->challenge,sizeof(req->challenge));
+	return u2f_assert(req->challenge, req->application, req->key_handle, NULL);
+}
 
-    u2f_sha256_finish();
+// All handles are checked in one request, so a relying party with
+// several registered tokens costs one exchange instead of one each.
+static int16_t u2f_authenticate_multi(struct u2f_authenticate_multi_request * req, uint8_t control, uint32_t len)
+{
+	uint8_t i;
+	uint16_t sw;
 
-    if (u2f_ecdsa_sign((uint8_t*)req, req->key_handle, req->application) == -1)
+	if (req->count == 0 || req->count > U2F_AUTHENTICATE_MULTI_MAX ||
+			len != U2F_CHALLENGE_SIZE + U2F_APPLICATION_SIZE + 1 + (uint32_t)req->count * U2F_KEY_HANDLE_SIZE)
 	{
-    	return U2F_SW_OPERATION_FAILED; //FIXME custom error code - change to any from spec?
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		return U2F_SW_WRONG_LENGTH;
+	}
+	if (control != U2F_AUTHENTICATE_CHECK && control != U2F_AUTHENTICATE_SIGN)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		return U2F_SW_WRONG_PAYLOAD;
+	}
+
+	if (u2f_request_replayed() && multi_cid == u2f_hid_current_cid() && multi_index < req->count)
+	{
+		// a signing request, its handles were checked before it was deferred
+		i = multi_index;
+		multi_cid = 0;
+	}
+	else
+	{
+		for (i = 0; i < req->count; i++)
+		{
+			if ((control == U2F_AUTHENTICATE_CHECK ?
+					u2f_appid_check(req->key_handles[i], req->application) :
+					u2f_appid_eq(req->key_handles[i], req->application)) == 0)
+			{
+				break;
+			}
+		}
+	}
+	profile_mark(PROFILE_APPID);
+	if (i == req->count)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		return U2F_SW_WRONG_PAYLOAD;
 	}
 
-    u2f_hid_set_len(U2F_SW_LENGTH + 1 + 4
-    		+ get_signature_length((uint8_t*)req));
+	if (control == U2F_AUTHENTICATE_CHECK)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH + 1);
+		u2f_response_writeback(&i,1);
+		return U2F_SW_NO_ERROR;
+	}
 
-    u2f_response_writeback(&users_presence_flag,1);
-    u2f_response_writeback((uint8_t *)&counter,4);
-    dump_signature_der((uint8_t*)req);
+	if (u2f_load_key(req->key_handles[i], req->application) != 0)
+	{
+		u2f_hid_set_len(U2F_SW_LENGTH);
+		return U2F_SW_WRONG_PAYLOAD;
+	}
+	profile_mark(PROFILE_LOAD_KEY);
 
-	return U2F_SW_NO_ERROR;
+	multi_found = i;
+	sw = u2f_user_presence();
+	if (sw != U2F_SW_NO_ERROR)
+	{
+		return sw;
+	}
+
+	return u2f_assert(req->challenge, req->application, req->key_handles[i], &i);
 }
 
 static int16_t u2f_register(struct u2f_register_request * req)
 {
-    uint8_t i[] = {0x0,U2F_EC_FMT_UNCOMPRESSED};
+    uint8_t i[] = {0x0};
 
     uint8_t key_handle[U2F_KEY_HANDLE_SIZE];
-    uint8_t pubkey[U2F_EC_PUBKEY_RAW_SIZE];
+    // reserved byte, point format, public key and key handle length
+    // are contiguous in the response, they go out as one block
+    uint8_t head[2 + U2F_EC_PUBKEY_RAW_SIZE + 1];
+    uint8_t * pubkey = head + 2;
+    uint8_t digest[SHA256_DIGEST_SIZE];
     int8_t status_code = 0;
+    uint16_t sw;
 
-    const uint16_t attest_size = u2f_attestation_cert_size();
-
-    if (!sanity_check_passed ||u2f_get_user_feedback())
+    sw = u2f_user_presence();
+    if (sw != U2F_SW_NO_ERROR)
     {
-    	u2f_hid_set_len(U2F_SW_LENGTH);
-        return U2F_SW_CONDITIONS_NOT_SATISFIED;
+        return sw;
     }
 
     status_code = u2f_new_keypair(key_handle, req->application, pubkey);
@@ -227,36 +467,39 @@ static int16_t u2f_register(struct u2f_register_request * req)
 		u2f_hid_set_len(U2F_SW_LENGTH);
     	return U2F_SW_INSUFFICIENT_MEMORY+status_code; //FIXME non-standard SW
     }
-
-    u2f_sha256_start_default();
-    u2f_sha256_update(i,1); // 0
-    u2f_sha256_update(req->application,sizeof(req->application));
-    u2f_sha256_update(req->challenge,sizeof(req->challenge));
-    u2f_sha256_update(key_handle,sizeof(key_handle));
-    u2f_sha256_update(i+1,1); // U2F_EC_FMT_UNCOMPRESSED
-    u2f_sha256_update(pubkey,sizeof(pubkey));
-    u2f_sha256_finish();
+    profile_mark(PROFILE_KEYGEN);
+
+    sha256_start();
+    sha256_update(i,1); // 0
+    sha256_update(req->application,sizeof(req->application));
+    sha256_update(req->challenge,sizeof(req->challenge));
+    sha256_update(key_handle,sizeof(key_handle));
+    head[1] = U2F_EC_FMT_UNCOMPRESSED;
+    sha256_update(head+1,1+U2F_EC_PUBKEY_RAW_SIZE);
+    sha256_finish(digest);
+    profile_mark(PROFILE_SHA);
     
-    if (u2f_ecdsa_sign((uint8_t*)req, U2F_ATTESTATION_HANDLE, req->application) == -1)
+    if (u2f_load_digest(digest) == -1 ||
+    		u2f_ecdsa_sign((uint8_t*)req, U2F_ATTESTATION_HANDLE, req->application) == -1)
 	{
     	return U2F_SW_WRONG_DATA;
 	}
+    profile_mark(PROFILE_SIGN);
 
     u2f_hid_set_len(2 + 1
     		+ U2F_SW_LENGTH
-    		+ sizeof(pubkey)
+    		+ U2F_EC_PUBKEY_RAW_SIZE
     		+ get_signature_length((uint8_t*)req)
     		+ U2F_KEY_HANDLE_SIZE
     		+ u2f_attestation_cert_size());
-    i[0] = U2F_REGISTER_RESERVED_BYTE;
-    u2f_response_writeback(i,2);
-    u2f_response_writeback(pubkey,sizeof(pubkey));
-    i[0] = U2F_KEY_HANDLE_SIZE;
-    u2f_response_writeback(i,1);
+    head[0] = U2F_REGISTER_RESERVED_BYTE;
+    head[sizeof(head)-1] = U2F_KEY_HANDLE_SIZE;
+    u2f_response_writeback(head,sizeof(head));
     u2f_response_writeback(key_handle,U2F_KEY_HANDLE_SIZE);
-    u2f_response_writeback(u2f_get_attestation_cert(),u2f_attestation_cert_size());
+    u2f_response_writeback_code(u2f_get_attestation_cert(),u2f_attestation_cert_size());
 
     dump_signature_der((uint8_t*)req);
+    profile_mark(PROFILE_WRITEBACK);
 
     return U2F_SW_NO_ERROR;
 }
@@ -265,7 +508,7 @@ static int16_t u2f_version()
 {
 	code const char version[] = "U2F_V2";
 	u2f_hid_set_len(U2F_SW_LENGTH + sizeof(version)-1);
-	u2f_response_writeback(version, sizeof(version)-1);
+	u2f_response_writeback((uint8_t *)version, sizeof(version)-1);
 	return U2F_SW_NO_ERROR;
 }
 
@@ -44,7 +44,34 @@
 
 static void gen_u2f_zero_tag(uint8_t * out_dst, uint8_t * appid, uint8_t * handle);
 
-static struct u2f_hid_msg res;
+// Derived keys resident in the U2F_KEY_SLOTS of the ATECC. A key is known
+// by the start of the tag of its handle, which u2f_appid_eq has verified
+// for the application before the key is used.
+#define KEY_TAG_SIZE		8
+// U2F_KEY_SLOTS starts with U2F_TEMP_KEY_SLOT
+#define KEY_TEMP_INDEX		0
+
+struct resident_key
+{
+	uint8_t valid;
+	uint8_t tag[KEY_TAG_SIZE];
+};
+
+static code uint8_t key_slots[U2F_KEY_SLOTS_NUM] = U2F_KEY_SLOTS;
+static struct resident_key resident_keys[U2F_KEY_SLOTS_NUM];
+// indexes into key_slots, most recently used first
+static uint8_t key_lru[U2F_KEY_SLOTS_NUM];
+// slot of the key u2f_ecdsa_sign signs with
+static uint8_t key_slot = U2F_TEMP_KEY_SLOT;
+
+// Start of the tags of the last keys pushed out of U2F_TEMP_KEY_SLOT. A
+// key is loaded there with the MAC its handle carries; a spare slot needs
+// an ATECC SHA for the MAC first, which only pays off for a key that
+// comes back.
+#define KEY_SEEN_TAG_SIZE	4
+#define KEY_SEEN_NUM		(U2F_KEY_SLOTS_NUM - 1)
+static uint8_t key_seen[KEY_SEEN_NUM][KEY_SEEN_TAG_SIZE];
+static uint8_t key_seen_next;
 
 
 void u2f_response_writeback(uint8_t * buf, uint16_t len)
@@ -58,6 +85,21 @@ void u2f_response_flush()
 	u2f_hid_flush();
 }
 
+void u2f_response_writeback_code(uint8_t code * buf, uint16_t len)
+{
+	u2f_hid_writeback_code(buf, len);
+}
+
+int8_t u2f_response_wait()
+{
+	return u2f_hid_wait_user();
+}
+
+uint8_t u2f_request_replayed()
+{
+	return u2f_hid_replaying();
+}
+
 void u2f_response_start()
 {
 	watchdog();
@@ -65,94 +107,261 @@ void u2f_response_start()
 
 static bool first_request_accepted = false;
 
-/**
- * Confirm user presence by getting touch button, or device insertion.
- * Returns: '0' - user presence confirmed, '1' otherwise
- * FIXME Move to gpio.c
- */
-static int8_t _u2f_get_user_feedback(BUTTON_STATE_T target_button_state, bool blink)
+// Presence is waited for in the background: a request asking for the
+// user starts the wait and is replayed until the wait is over, while
+// the main loop keeps running the button and LED drivers.
+typedef enum
+{
+	PRESENCE_IDLE = 0,
+	PRESENCE_WAITING,
+	PRESENCE_CONFIRMED,
+	PRESENCE_REFUSED,
+} PRESENCE_STATE;
+
+static PRESENCE_STATE presence_state = PRESENCE_IDLE;
+static BUTTON_STATE_T presence_target;
+static uint32_t presence_t;
+// the channel whose request started the wait, only its replay gets the outcome
+static uint32_t presence_cid;
+
+static void presence_confirmed()
 {
+#ifdef SHOW_TOUCH_REGISTERED
 	uint32_t t;
-	uint8_t user_presence = 0;
+#endif
 
-	// Accept first request in the first SELF_ACCEPT_MAX_T_MS after power cycle.
-	// Solution only for a short touch request, not for configuration changes.
-	if (!first_request_accepted && (get_ms() < SELF_ACCEPT_MAX_T_MS)
-			&& (target_button_state == BST_PRESSED_REGISTERED) ){
-		first_request_accepted = true;
+	// Button has been pushed in time
+	presence_state = PRESENCE_CONFIRMED;
+	button_press_set_consumed();
+	led_off();
+#ifdef SHOW_TOUCH_REGISTERED
+	//show short confirming animation
+	t = get_ms();
+	while(get_ms() - t < 110){
+		led_on();
+		u2f_delay(12);
 		led_off();
-		return 0;
+		u2f_delay(25);
 	}
+	led_off();
+#endif
+}
 
-	// Reject all requests, if device is not ready yet for touch button feedback,
-	// or if the touch is already consumed
-	if (button_press_is_consumed() || button_get_press_state() < BST_META_READY_TO_USE)
-		return 1;
-
-	if (blink == true && led_is_blinking() == false)
-		led_blink(10, LED_BLINK_PERIOD);
-	else if (blink == false)
-		led_off();
-	watchdog();
-
-	t = get_ms();
-	while(button_get_press_state() != target_button_state)	// Wait to push button
+uint8_t u2f_user_feedback_poll()
+{
+	if (presence_state != PRESENCE_WAITING)
 	{
-		led_blink_manager();                               // Run led driver to ensure blinking
-        button_manager();                                 // Run button driver
-		if (get_ms() - t > U2F_MS_USER_INPUT_WAIT    // 100ms elapsed without button press
-				&& !button_press_in_progress())			// Button press has not been started
-			break;                                    // Timeout
-		u2f_delay(10);
-		watchdog();
-#ifdef FAKE_TOUCH
-		if (get_ms() - t > 1010) break; //1212
-#endif
-		}
+		return 0;
+	}
 
 #ifndef FAKE_TOUCH
-	if (button_get_press_state() == target_button_state)
+	if (button_get_press_state() == presence_target)
 #else //FAKE_TOUCH
-	if (true)
+	if (get_ms() - presence_t > 1010)
 #endif
 	{
-		// Button has been pushed in time
-		user_presence = 1;
-		button_press_set_consumed();
+		presence_confirmed();
+	}
+	else if (get_ms() - presence_t > U2F_MS_USER_INPUT_WAIT    // 100ms elapsed without button press
+			&& !button_press_in_progress())			// Button press has not been started
+	{
+		// Button hasnt been pushed within the timeout
+		presence_state = PRESENCE_REFUSED;
+	}
+
+	return presence_state == PRESENCE_WAITING;
+}
+
+void u2f_user_feedback_cancel()
+{
+	if (presence_state == PRESENCE_WAITING)
+	{
+		presence_state = PRESENCE_REFUSED;
 		led_off();
-#ifdef SHOW_TOUCH_REGISTERED
-		//show short confirming animation
-		t = get_ms();
-		while(get_ms() - t < 110){
-			led_on();
-			u2f_delay(12);
+	}
+}
+
+void u2f_user_feedback_drop()
+{
+	if (presence_state != PRESENCE_IDLE)
+	{
+		presence_state = PRESENCE_IDLE;
+		led_off();
+	}
+}
+
+/**
+ * Confirm user presence by getting touch button, or device insertion.
+ * Returns: '0' - user presence confirmed, '1' otherwise, U2F_FEEDBACK_PENDING
+ * while waiting for the button
+ * FIXME Move to gpio.c
+ */
+static int8_t _u2f_get_user_feedback(BUTTON_STATE_T target_button_state, bool blink)
+{
+	PRESENCE_STATE result;
+
+	if (presence_state == PRESENCE_IDLE)
+	{
+		// Accept first request in the first SELF_ACCEPT_MAX_T_MS after power cycle.
+		// Solution only for a short touch request, not for configuration changes.
+		if (!first_request_accepted && (get_ms() < SELF_ACCEPT_MAX_T_MS)
+				&& (target_button_state == BST_PRESSED_REGISTERED) ){
+			first_request_accepted = true;
 			led_off();
-			u2f_delay(25);
+			return 0;
 		}
-		led_off();
-#endif
-	} else {                                          // Button hasnt been pushed within the timeout
-		user_presence = 0;                                     // Return error code
+
+		// Reject all requests, if device is not ready yet for touch button feedback,
+		// or if the touch is already consumed
+		if (button_press_is_consumed() || button_get_press_state() < BST_META_READY_TO_USE)
+			return 1;
+
+		if (blink == true && led_is_blinking() == false)
+			led_blink(10, LED_BLINK_PERIOD);
+		else if (blink == false)
+			led_off();
+		watchdog();
+
+		presence_state = PRESENCE_WAITING;
+		presence_target = target_button_state;
+		presence_t = get_ms();
+		presence_cid = u2f_hid_current_cid();
+	}
+	else if (u2f_hid_current_cid() != presence_cid)
+	{
+		// the touch is meant for the request of another channel
+		return 1;
 	}
 
+	if (u2f_user_feedback_poll())
+	{
+		return U2F_FEEDBACK_PENDING;
+	}
 
-	return user_presence? 0 : 1;
+	// the outcome goes to the replay of the request that started the wait
+	result = presence_state;
+	presence_state = PRESENCE_IDLE;
+	return (result == PRESENCE_CONFIRMED)? 0 : 1;
 }
 
 int8_t u2f_get_user_feedback(){
 	return _u2f_get_user_feedback(BST_PRESSED_REGISTERED, true);
 }
 
+// the wipe commands are not part of U2F, they keep waiting in place
 int8_t u2f_get_user_feedback_extended_wipe(){
-	return _u2f_get_user_feedback(BST_PRESSED_REGISTERED_EXT, false);
+	int8_t ret;
+
+	// a U2F request is waiting for the short press
+	if (presence_state != PRESENCE_IDLE)
+		return 1;
+
+	while((ret = _u2f_get_user_feedback(BST_PRESSED_REGISTERED_EXT, false)) == U2F_FEEDBACK_PENDING)
+	{
+		led_blink_manager();                               // Run led driver to ensure blinking
+		button_manager();                                 // Run button driver
+		u2f_delay(10);
+		watchdog();
+	}
+	return ret;
 }
 
 
 // FIXME unused appid
+void u2f_key_slots_clear()
+{
+	uint8_t i;
+
+	for (i = 0; i < U2F_KEY_SLOTS_NUM; i++)
+	{
+		resident_keys[i].valid = 0;
+		key_lru[i] = i;
+	}
+	key_slot = U2F_TEMP_KEY_SLOT;
+	memset(key_seen, 0, sizeof(key_seen));
+	key_seen_next = 0;
+}
+
+// remember the key in U2F_TEMP_KEY_SLOT before it is overwritten
+static void key_temp_push_out()
+{
+	if (resident_keys[KEY_TEMP_INDEX].valid)
+	{
+		memmove(key_seen[key_seen_next], resident_keys[KEY_TEMP_INDEX].tag, KEY_SEEN_TAG_SIZE);
+		key_seen_next = (key_seen_next + 1) % KEY_SEEN_NUM;
+	}
+	resident_keys[KEY_TEMP_INDEX].valid = 0;
+}
+
+// index of the slot to load the key of @handle into
+static uint8_t key_slot_pick(uint8_t * handle)
+{
+	uint8_t i;
+
+	for (i = 0; i < KEY_SEEN_NUM; i++)
+	{
+		if (memcmp(key_seen[i], handle + U2F_KEY_HANDLE_KEY_SIZE, KEY_SEEN_TAG_SIZE) == 0)
+		{
+			// back again, it gets the least recently used spare slot
+			memset(key_seen[i], 0, KEY_SEEN_TAG_SIZE);
+			for (i = U2F_KEY_SLOTS_NUM - 1; key_lru[i] == KEY_TEMP_INDEX; i--)
+				;
+			return key_lru[i];
+		}
+	}
+	key_temp_push_out();
+	return KEY_TEMP_INDEX;
+}
+
+// make key @k the most recently used one and the one to sign with
+static void key_slot_use(uint8_t k)
+{
+	uint8_t i;
+
+	for (i = 0; key_lru[i] != k; i++)
+		;
+	for (; i > 0; i--)
+	{
+		key_lru[i] = key_lru[i-1];
+	}
+	key_lru[0] = k;
+	key_slot = key_slots[k];
+}
+
+// index of the resident key of @handle, U2F_KEY_SLOTS_NUM if there is none
+static uint8_t key_slot_find(uint8_t * handle)
+{
+	uint8_t i;
+
+	for (i = 0; i < U2F_KEY_SLOTS_NUM; i++)
+	{
+		if (resident_keys[i].valid &&
+				memcmp(resident_keys[i].tag, handle + U2F_KEY_HANDLE_KEY_SIZE, KEY_TAG_SIZE) == 0)
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+int8_t u2f_load_digest(uint8_t * digest)
+{
+	struct atecc_response res;
+
+	// pass-through nonce, TempKey holds the digest as after an ATECC SHA
+	if( atecc_send_recv(ATECC_CMD_NONCE,
+			ATECC_NONCE_TEMP_UPDATE, 0, digest, 32,
+			appdata.tmp, 40, &res) != 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
 int8_t u2f_ecdsa_sign(uint8_t * out_dest, uint8_t * handle, uint8_t * appid)
 {
 	struct atecc_response res;
-	uint16_t slot = U2F_TEMP_KEY_SLOT;
+	uint16_t slot = key_slot;
 	if (handle == U2F_ATTESTATION_HANDLE)
 	{
 		slot = U2F_ATTESTATION_KEY_SLOT;
@@ -174,25 +383,20 @@ int8_t u2f_new_keypair(uint8_t * out_handle, uint8_t * appid, uint8_t * out_pubk
 {
 	struct atecc_response res;
 	uint8_t private_key[36];
-	int i;
 
 	watchdog();
 
-	if (atecc_send_recv(ATECC_CMD_RNG,ATECC_RNG_P1,ATECC_RNG_P2,
-		NULL, 0,
-		appdata.tmp,
-		sizeof(appdata.tmp), &res) != 0 )
+	// size of key handle must be 36
+	if (atecc_rng(out_handle, 4) != 0)
 	{
 		return -1; //U2F_SW_CUSTOM_RNG_GENERATION
 	}
 
 	u2f_sha256_start(U2F_DEVICE_KEY_SLOT, ATECC_SHA_HMACSTART);
 	u2f_sha256_update(appid,32);
-	u2f_sha256_update(res.buf,4);
+	u2f_sha256_update(out_handle,4);
 	u2f_sha256_finish();
 
-	memmove(out_handle, res.buf, 4);  // size of key handle must be 36
-
 	memset(private_key,0,4);
 	memmove(private_key+4, res_digest.buf, 32);
 
@@ -209,6 +413,7 @@ int8_t u2f_new_keypair(uint8_t * out_handle, uint8_t * appid, uint8_t * out_pubk
 	}
 
 	memset(private_key,0,36);
+	key_temp_push_out();
 
 	if ( atecc_send_recv(ATECC_CMD_GENKEY,
 			ATECC_GENKEY_PUBLIC, U2F_TEMP_KEY_SLOT, NULL, 0,
@@ -222,12 +427,26 @@ int8_t u2f_new_keypair(uint8_t * out_handle, uint8_t * appid, uint8_t * out_pubk
 	// the + 28/U2F_KEY_HANDLE_ID_SIZE
 	gen_u2f_zero_tag(out_handle + U2F_KEY_HANDLE_KEY_SIZE, appid, out_handle);
 
+	memmove(resident_keys[KEY_TEMP_INDEX].tag, out_handle + U2F_KEY_HANDLE_KEY_SIZE, KEY_TAG_SIZE);
+	resident_keys[KEY_TEMP_INDEX].valid = 1;
+	key_slot_use(KEY_TEMP_INDEX);
+
 	return 0;
 }
 
 int8_t u2f_load_key(uint8_t * handle, uint8_t * appid)
 {
 	uint8_t private_key[36];
+	// the handle carries the PRIVWRITE MAC for U2F_TEMP_KEY_SLOT
+	uint8_t * mac = handle+4;
+	uint8_t k = key_slot_find(handle);
+
+	if (k < U2F_KEY_SLOTS_NUM)
+	{
+		key_slot_use(k);
+		return 0;
+	}
+	k = key_slot_pick(handle);
 
 	watchdog();
 	u2f_sha256_start(U2F_DEVICE_KEY_SLOT, ATECC_SHA_HMACSTART);
@@ -240,7 +459,24 @@ int8_t u2f_load_key(uint8_t * handle, uint8_t * appid)
 
 	eeprom_xor(EEPROM_DATA_RMASK, private_key+4, 32);
 
-	return atecc_privwrite(U2F_TEMP_KEY_SLOT, private_key, EEPROM_DATA_WMASK, handle+4);
+	if (key_slots[k] != U2F_TEMP_KEY_SLOT)
+	{
+		compute_key_hash(private_key, EEPROM_DATA_WMASK, key_slots[k]);
+		mac = res_digest.buf;
+	}
+
+	resident_keys[k].valid = 0;
+	if (atecc_privwrite(key_slots[k], private_key, EEPROM_DATA_WMASK, mac) != 0)
+	{
+		memset(private_key,0,36);
+		return -1;
+	}
+	memset(private_key,0,36);
+
+	memmove(resident_keys[k].tag, handle + U2F_KEY_HANDLE_KEY_SIZE, KEY_TAG_SIZE);
+	resident_keys[k].valid = 1;
+	key_slot_use(k);
+	return 0;
 }
 
 static void gen_u2f_zero_tag(uint8_t * out_dst, uint8_t * appid, uint8_t * handle)
@@ -260,6 +496,11 @@ static void gen_u2f_zero_tag(uint8_t * out_dst, uint8_t * appid, uint8_t * handl
 	if (out_dst) memmove(out_dst, res_digest.buf, U2F_KEY_HANDLE_ID_SIZE);
 }
 
+int8_t u2f_random(uint8_t * out, uint8_t len)
+{
+	return atecc_rng(out, len);
+}
+
 int8_t u2f_appid_eq(uint8_t * handle, uint8_t * appid)
 {
 	gen_u2f_zero_tag(NULL,appid, handle);
@@ -278,9 +519,9 @@ uint32_t u2f_count()
 extern uint16_t __attest_size;
 extern code char __attest[];
 
-uint8_t * u2f_get_attestation_cert()
+uint8_t code * u2f_get_attestation_cert()
 {
-	return __attest;
+	return (uint8_t code *)__attest;
 }
 
 uint16_t u2f_attestation_cert_size()
@@ -41,29 +41,27 @@
 #include "gpio.h"
 #include "u2f_hid.h"
 #include "u2f.h"
+#include "profile.h"
 
 #ifndef U2F_HID_DISABLE
 
-#define CID_MAX (sizeof(CIDS)/sizeof(struct CID))
-#define BROADCAST_CID (CIDS[CID_MAX-1])
+#define CID_MAX		U2FHID_CHANNELS
+#define CID_MASK	(U2FHID_CHANNELS - 1)
 
+// Channels live in a direct mapped table: the slot of a CID is a hash
+// of its bytes, so a frame finds its channel without a search. CIDs
+// handed out by INIT are picked to hash to the least recently used
+// idle slot.
+#define cid_slot(c)	(((uint8_t)(c) ^ (uint8_t)((c) >> 8) ^ (uint8_t)((c) >> 16) ^ (uint8_t)((c) >> 24)) & CID_MASK)
 
-typedef enum
-{
-	HID_BUSY=0,
-	HID_READY,
-} HID_STATE;
 
+// Response being written. Responses are generated in one go by the
+// main loop, so a single writeback state is shared by all channels.
 static struct hid_layer_param
 {
-	HID_STATE state;
 	uint32_t current_cid;
 	uint8_t current_cmd;
 
-	uint32_t last_buffered;
-	uint16_t bytes_buffered;
-	uint16_t req_len;
-
 	// number of payload bytes written in response
 	uint16_t bytes_written;
 
@@ -71,28 +69,51 @@ static struct hid_layer_param
 	// total length of response in bytes
 	uint16_t res_len;
 
-	// FIXME Maximum allowed request size seem to be U2F Auth 66 (challenge+header) + 256 (key handle) = 322 bytes
-	// We use 64 bytes key handle, hence 130 bytes will suffice.
-	// Decrease size, if needed.
-	#define BUFFER_SIZE (270)
-	uint8_t buffer[BUFFER_SIZE];
-
 } hid_layer;
 
+// Requests spanning several frames are reassembled per channel, each
+// channel borrows one of these buffers until its request is complete.
+// FIXME Maximum allowed request size seem to be U2F Auth 66 (challenge+header) + 256 (key handle) = 322 bytes
+// We use 64 bytes key handle, hence 130 bytes will suffice.
+// Decrease size, if needed.
+#define BUFFER_SIZE (270)
+#define HID_BUFFERS	2
+#define HID_NO_BUFFER	0xff
+static uint8_t hid_buffers[HID_BUFFERS][BUFFER_SIZE];
+static uint8_t hid_buffers_used = 0;
+
+// struct CID busy states
+#define CID_RECEIVING	1
+#define CID_WAITING		2
+
+// The request waiting for the user keeps its buffer and is replayed
+// from it, only one request waits at a time.
+static struct CID* hid_waiting = NULL;
+
+// The channel whose request is being handled, its time-out is not
+// checked while app_service runs during ATECC commands.
+static struct CID* hid_serving = NULL;
+
+// set while u2f_hid_check_waiting replays the parked request
+static uint8_t hid_replaying = 0;
+
 #ifdef U2F_SUPPORT_HID_LOCK
 uint32_t _hid_lockt = 0;
 uint32_t _hid_lock_cid = 0;
 #endif
 
-static struct CID CIDS[4];
+static struct CID CIDS[CID_MAX];
+static struct CID BROADCAST_CID;
 
-static uint8_t CID_NUM = 0;
+static uint32_t next_cid = 0xcafebabe;
+static uint8_t timeout_slot = 0;
 
 static uint8_t _hid_pkt[HID_PACKET_SIZE];
 static uint8_t _hid_offset = 0;
 static uint16_t _hid_seq = 0;
 static uint8_t _hid_in_session = 0;
 
+// a response has been started but not flushed yet
 #define u2f_hid_busy() (_hid_in_session)
 
 #define MIN(a,b) ((a) < (b) ? (a):(b))
@@ -100,11 +121,23 @@ static uint8_t _hid_in_session = 0;
 #define hid_is_locked()		(_hid_lockt > get_ms())
 #define hid_is_lock_cid(c)	((c) == _hid_lock_cid)
 
+#define cid_buffer(c)		(hid_buffers[(c)->buf])
+
 void u2f_hid_init()
 {
+	uint8_t i;
 	memset(CIDS, 0, sizeof(CIDS));
+	memset(&BROADCAST_CID, 0, sizeof(BROADCAST_CID));
+	for(i = 0; i < CID_MAX; i++)
+	{
+		CIDS[i].buf = HID_NO_BUFFER;
+	}
+	BROADCAST_CID.buf = HID_NO_BUFFER;
 	memset(&hid_layer, 0, sizeof(hid_layer));
-	CID_NUM = 0;
+	hid_buffers_used = 0;
+	hid_waiting = NULL;
+	hid_serving = NULL;
+	timeout_slot = 0;
 	_hid_offset = 0;
 	_hid_seq = 0;
 	_hid_in_session = 0;
@@ -135,40 +168,57 @@ void u2f_hid_flush()
 	u2f_hid_reset_packet();
 }
 
+// starts the next packet of the response in _hid_pkt
+static int8_t u2f_hid_start_packet()
+{
+	struct u2f_hid_msg * r = (struct u2f_hid_msg *) _hid_pkt;
+
+	r->cid = hid_layer.current_cid;
+	if (!_hid_seq)
+	{
+		r->pkt.init.cmd = hid_layer.current_cmd;
+		U2FHID_SET_LEN(r, hid_layer.res_len);
+		_hid_offset = 7;
+	}
+	else
+	{
+		r->pkt.cont.seq = (uint8_t)_hid_seq - 1;
+		_hid_offset = 5;
+		if (_hid_seq-1 > 127)
+		{
+			set_app_error(ERROR_SEQ_EXCEEDED);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 // Buffers data to a 64 byte buffer before writing it while
-// handling U2F HID sequencing
+// handling U2F HID sequencing. Each fragment is copied in as few
+// blocks as there are packets it spans.
 void u2f_hid_writeback(uint8_t * payload, uint16_t len)
 {
-	struct u2f_hid_msg * r = (struct u2f_hid_response *) _hid_pkt;
+	uint8_t n;
 
 	_hid_in_session = 1;
 
-
 	do
 	{
-		if (_hid_offset == 0)
+		if (_hid_offset == 0 && u2f_hid_start_packet() != 0)
 		{
-			r->cid = hid_layer.current_cid;
-			if (!_hid_seq)
-			{
-				r->pkt.init.cmd = hid_layer.current_cmd;
-				U2FHID_SET_LEN(r, hid_layer.res_len);
-				_hid_offset = 7;
-			}
-			else
-			{
-				r->pkt.cont.seq = (uint8_t)_hid_seq - 1;
-				_hid_offset = 5;
-				if (_hid_seq-1 > 127)
-				{
-					set_app_error(ERROR_SEQ_EXCEEDED);
-					return;
-				}
-			}
+			return;
 		}
 
-		_hid_pkt[_hid_offset++] = *payload++;
-		hid_layer.bytes_written++;
+		// an empty payload only starts the response
+		if (!len) break;
+
+		n = MIN(len, HID_PACKET_SIZE - _hid_offset);
+		memmove(_hid_pkt + _hid_offset, payload, n);
+		payload += n;
+		len -= n;
+		_hid_offset += n;
+		hid_layer.bytes_written += n;
+
 		if (_hid_offset == HID_PACKET_SIZE)
 		{
 			_hid_offset = 0;
@@ -177,126 +227,241 @@ void u2f_hid_writeback(uint8_t * payload, uint16_t len)
 			usb_write(_hid_pkt, HID_PACKET_SIZE);
 			memset(_hid_pkt, 0, HID_PACKET_SIZE);
 		}
-		if (!len) break;
 	}
-	while(--len);
+	while(len);
 
 }
 
+// Packets filled by the payload alone go out as a header plus a
+// pointer to code memory, the ones it shares with other fragments
+// are buffered as usual.
+void u2f_hid_writeback_code(uint8_t code * payload, uint16_t len)
+{
+	uint8_t n;
 
+	_hid_in_session = 1;
 
-static uint32_t get_new_cid()
-{
-	static uint32_t base = 0xcafebabe;
-	int i;
-	for(i = 0; i < CID_MAX-1; i++)
+	while(len)
 	{
-		if (!CIDS[i].busy)
+		if (_hid_offset == 0)
 		{
-			goto newcid;
+			if (u2f_hid_start_packet() != 0)
+			{
+				return;
+			}
+			n = HID_PACKET_SIZE - _hid_offset;
+			if (len >= n)
+			{
+				usb_write_code(_hid_pkt, _hid_offset, payload, n);
+				memset(_hid_pkt, 0, _hid_offset);
+				payload += n;
+				len -= n;
+				hid_layer.bytes_written += n;
+				_hid_offset = 0;
+				_hid_seq++;
+				continue;
+			}
 		}
-	}
-	return 0;
-	newcid:
 
-	do
-	{
-		CIDS[i].cid = base + CID_NUM++;
-	}while(CIDS[i].cid == 0 || CIDS[i].cid == U2FHID_BROADCAST);
+		n = MIN(len, HID_PACKET_SIZE - _hid_offset);
+		u2f_hid_writeback((uint8_t *)payload, n);
+		payload += n;
+		len -= n;
+	}
+}
 
-	CIDS[i].busy = 0;
 
-	return CIDS[i].cid;
+static void cid_release_buffer(struct CID* cid)
+{
+	if (cid == hid_waiting)
+	{
+		hid_waiting = NULL;
+		u2f_user_feedback_drop();
+		profile_drop();
+	}
+	if (cid->buf != HID_NO_BUFFER)
+	{
+		hid_buffers_used &= ~(1 << cid->buf);
+		cid->buf = HID_NO_BUFFER;
+	}
+	cid->bytes_buffered = 0;
 }
 
-static int8_t add_new_cid(uint32_t cid)
+static int8_t cid_take_buffer(struct CID* cid)
 {
-	int i;
-	for(i = 0; i < CID_MAX-1; i++)
+	uint8_t i;
+	for(i = 0; i < HID_BUFFERS; i++)
 	{
-		if (!CIDS[i].busy)
+		if (!(hid_buffers_used & (1 << i)))
 		{
-			CIDS[i].cid = cid;
+			hid_buffers_used |= (1 << i);
+			cid->buf = i;
+			memset(hid_buffers[i], 0, BUFFER_SIZE);
 			return 0;
 		}
 	}
 	return -1;
 }
 
-struct CID* get_cid(uint32_t cid)
+// returns 0 if every channel is in the middle of a request
+static uint32_t get_new_cid()
 {
-	uint8_t i;
+	struct CID* c = NULL;
+	uint32_t now = get_ms();
+	uint32_t cid;
+	uint8_t i, lo;
+
+	// an unused slot, or else the idle one used least recently
 	for(i = 0; i < CID_MAX; i++)
 	{
-		if (CIDS[i].cid == cid)
+		if (CIDS[i].busy)
+		{
+			continue;
+		}
+		if (CIDS[i].cid == 0)
+		{
+			c = CIDS+i;
+			break;
+		}
+		if (c == NULL || (now - CIDS[i].last_used) > (now - c->last_used))
 		{
-			return CIDS+i;
+			c = CIDS+i;
 		}
 	}
-	return NULL;
+	if (c == NULL)
+	{
+		return 0;
+	}
+
+	do
+	{
+		// fresh upper bits, low bits chosen to land on slot i
+		next_cid += 0x100;
+		cid = next_cid;
+		lo = (uint8_t)(c - CIDS) ^ (uint8_t)(cid >> 8) ^ (uint8_t)(cid >> 16) ^ (uint8_t)(cid >> 24);
+		cid = (cid & ~(uint32_t)CID_MASK) | (lo & CID_MASK);
+	}while(cid == 0 || cid == U2FHID_BROADCAST || cid == c->cid);
+
+	cid_release_buffer(c);
+	c->cid = cid;
+	c->busy = 0;
+	c->last_used = now;
+
+	return cid;
+}
+
+// a CID chosen by the host, it takes over its slot unless the channel
+// there is in the middle of a request
+static struct CID* add_new_cid(uint32_t cid)
+{
+	struct CID* c = CIDS + cid_slot(cid);
+	if (c->busy)
+	{
+		return NULL;
+	}
+	cid_release_buffer(c);
+	c->cid = cid;
+	return c;
+}
+
+struct CID* get_cid(uint32_t cid)
+{
+	struct CID* c;
+	if (cid == U2FHID_BROADCAST)
+	{
+		return &BROADCAST_CID;
+	}
+	c = CIDS + cid_slot(cid);
+	return c->cid == cid ? c : NULL;
 }
+
 static void del_cid(uint32_t cid)
 {
-	uint8_t i;
-	for(i = 0; i < CID_MAX; i++)
+	struct CID* c = get_cid(cid);
+	if (c != NULL)
 	{
-		if (CIDS[i].cid == cid)
-		{
-			CIDS[i].cid = 0;
-			CIDS[i].busy = 0;
-		}
+		cid_release_buffer(c);
+		c->cid = 0;
+		c->busy = 0;
 	}
 }
 
 static uint8_t errbuf[HID_PACKET_SIZE];
-static void stamp_error(uint32_t cid, uint8_t err)
+// single byte response
+static void stamp_frame(uint32_t cid, uint8_t cmd, uint8_t b)
 {
 
 	struct u2f_hid_msg * res = (struct u2f_hid_msg *)errbuf;
 	memset(errbuf,0,sizeof(errbuf));
 	res->cid = cid;
-	res->pkt.init.cmd = U2FHID_ERROR;
-	res->pkt.init.payload[0] = err;
+	res->pkt.init.cmd = cmd;
+	res->pkt.init.payload[0] = b;
 	res->pkt.init.bcnth = 0;
 	res->pkt.init.bcntl = 1;
 
 
 	usb_write((uint8_t*)res, HID_PACKET_SIZE);
+}
+
+static void stamp_error(uint32_t cid, uint8_t err)
+{
+	stamp_frame(cid, U2FHID_ERROR, err);
 	del_cid(cid);
 }
 
+void u2f_hid_respond(struct u2f_hid_msg * req, uint16_t len)
+{
+	hid_layer.current_cid = req->cid;
+	hid_layer.current_cmd = req->pkt.init.cmd;
+	u2f_hid_set_len(len);
+}
+
+void u2f_hid_abort(uint8_t err)
+{
+	uint32_t cid = hid_layer.current_cid;
+
+	u2f_hid_reset_packet();
+	stamp_frame(cid, U2FHID_ERROR, err);
+}
+
 /**
  * Buffers incoming requests. E.g. Authentication request with 64 key handle size takes 130 bytes -> 3 HID frames.
  */
-static void start_buffering(struct u2f_hid_msg* req)
+static int8_t start_buffering(struct CID* cid, struct u2f_hid_msg* req)
 {
-	memset(hid_layer.buffer, 0, sizeof(hid_layer.buffer));
-	_hid_in_session = 1;
-	hid_layer.bytes_buffered = U2FHID_INIT_PAYLOAD_SIZE;
-	hid_layer.req_len = U2FHID_LEN(req);
-	memmove(hid_layer.buffer, req->pkt.init.payload, U2FHID_INIT_PAYLOAD_SIZE);
+	if (cid_take_buffer(cid) != 0)
+	{
+		// all buffers are reassembling requests of other channels
+		stamp_error(req->cid, ERR_CHANNEL_BUSY);
+		return -1;
+	}
+	cid->bytes_buffered = U2FHID_INIT_PAYLOAD_SIZE;
+	memmove(cid_buffer(cid), req->pkt.init.payload, U2FHID_INIT_PAYLOAD_SIZE);
+	return 0;
 }
 
-static int buffer_request(struct u2f_hid_msg* req)
+static int8_t buffer_request(struct CID* cid, struct u2f_hid_msg* req)
 {
-	if (hid_layer.bytes_buffered + U2FHID_CONT_PAYLOAD_SIZE > BUFFER_SIZE)
+	// the padding of the last frame is not kept
+	uint8_t n = MIN(U2FHID_CONT_PAYLOAD_SIZE, cid->req_len - cid->bytes_buffered);
+
+	if (cid->bytes_buffered + n > BUFFER_SIZE)
 	{
 		set_app_error(ERROR_HID_BUFFER_FULL);
 		stamp_error(req->cid, ERR_OTHER);
 		return -1;
 	}
-	memmove(hid_layer.buffer + hid_layer.bytes_buffered, req->pkt.cont.payload, U2FHID_CONT_PAYLOAD_SIZE);
-	hid_layer.bytes_buffered += U2FHID_CONT_PAYLOAD_SIZE;
+	memmove(cid_buffer(cid) + cid->bytes_buffered, req->pkt.cont.payload, n);
+	cid->bytes_buffered += n;
 	return 0;
 }
 
 // return 0 if finished
 // return 1 if expecting more cont packets
-static uint8_t hid_u2f_parse(struct u2f_hid_msg* req)
+static uint8_t hid_u2f_parse(struct CID* cid, struct u2f_hid_msg* req)
 {
-	uint16_t len = 0;
 	uint8_t seconds;
-	struct u2f_hid_init_response * init_res = appdata.tmp;
+	struct u2f_hid_init_response * init_res = (struct u2f_hid_init_response *)appdata.tmp;
 
 	switch(hid_layer.current_cmd)
 	{
@@ -311,15 +476,12 @@ static uint8_t hid_u2f_parse(struct u2f_hid_msg* req)
 
 			if (hid_layer.current_cid == U2FHID_BROADCAST)
 			{
-				//FIXME dead code
-				if (hid_layer.current_cid == 0)
+				init_res->cid = get_new_cid();
+				if (init_res->cid == 0)
 				{
-					set_app_error(ERROR_OUT_OF_CIDS);
+					stamp_error(hid_layer.current_cid, ERR_CHANNEL_BUSY);
 					goto fail;
 				}
-				//dead code end
-
-				init_res->cid = get_new_cid();
 			}
 			else
 			{
@@ -351,72 +513,56 @@ static uint8_t hid_u2f_parse(struct u2f_hid_msg* req)
 
 			break;
 		case U2FHID_MSG:
-			if (hid_layer.bytes_buffered == 0)
+			if (U2FHID_IS_INIT(req->pkt.init.cmd))
 			{
-				if (U2FHID_LEN(req) < 4)
+				profile_frame();
+				if (cid->req_len < 4)
 				{
 					stamp_error(hid_layer.current_cid, ERR_INVALID_LEN);
 					goto fail;
 				}
-				start_buffering(req);
-				if (hid_layer.bytes_buffered >= U2FHID_LEN(req))
+				if (cid->req_len <= U2FHID_INIT_PAYLOAD_SIZE)
 				{
-					u2f_request((struct u2f_request_apdu *)hid_layer.buffer);
+					// fits the frame, no need to borrow a buffer
+					u2f_request((struct u2f_request_apdu *)req->pkt.init.payload);
+					break;
 				}
-
+				if (start_buffering(cid, req) != 0)
+				{
+					goto fail;
+				}
+				return CID_RECEIVING;
 			}
 			else
 			{
-				buffer_request(req);
-				if (hid_layer.bytes_buffered >= hid_layer.req_len)
+				if (buffer_request(cid, req) != 0)
 				{
-					u2f_request((struct u2f_request_apdu *)hid_layer.buffer);
+					goto fail;
 				}
-
+				if (cid->bytes_buffered >= cid->req_len)
+				{
+					u2f_request((struct u2f_request_apdu *)cid_buffer(cid));
+					return hid_waiting == cid ? CID_WAITING : 0;
+				}
+				return CID_RECEIVING;
 			}
 
 
 			break;
 		case U2FHID_PING:
-
-
-			if (hid_layer.bytes_buffered == 0)
+			// Echo frame by frame: the response frames carry the same
+			// header, length and sequence numbers as the request frames,
+			// so nothing has to be buffered whatever the length.
+			usb_write((uint8_t*)req, HID_PACKET_SIZE);
+			if (U2FHID_IS_INIT(req->pkt.init.cmd))
 			{
-				start_buffering(req);
-				u2f_hid_set_len(U2FHID_LEN(req));
-				if (hid_layer.bytes_buffered >= U2FHID_LEN(req))
-				{
-					u2f_hid_writeback(hid_layer.buffer,hid_layer.bytes_buffered);
-					u2f_hid_flush();
-				}
-				else
-				{
-					return 1;
-				}
+				cid->bytes_buffered = U2FHID_INIT_PAYLOAD_SIZE;
 			}
 			else
 			{
-				if (hid_layer.bytes_buffered + U2FHID_CONT_PAYLOAD_SIZE > BUFFER_SIZE)
-				{
-					u2f_hid_writeback(hid_layer.buffer,hid_layer.bytes_buffered);
-					hid_layer.bytes_buffered = 0;
-
-				}
-
-				buffer_request(req);
-				if (hid_layer.bytes_buffered + hid_layer.bytes_written >= hid_layer.req_len)
-				{
-					u2f_hid_writeback(hid_layer.buffer,hid_layer.bytes_buffered);
-					u2f_hid_flush();
-				}
-				else
-				{
-					return 1;
-				}
+				cid->bytes_buffered += U2FHID_CONT_PAYLOAD_SIZE;
 			}
-
-
-			break;
+			return cid->bytes_buffered < cid->req_len;
 #ifdef U2F_SUPPORT_WINK
 		case U2FHID_WINK:
 			if (U2FHID_LEN(req) != 0)
@@ -466,35 +612,99 @@ static uint8_t hid_u2f_parse(struct u2f_hid_msg* req)
 			u2f_printb("invalid cmd: ",1,hid_layer.current_cmd);
 	}
 
-	return u2f_hid_busy();
+	return 0;
 
 	fail:
 		u2f_prints("U2F HID FAIL\r\n");
 	return 0;
 }
 
+// checks one channel per call, the main loop comes by often enough
 void u2f_hid_check_timeouts()
 {
-	uint8_t i;
-	for(i = 0; i < CID_MAX; i++)
+	struct CID* c = CIDS + (timeout_slot++ & CID_MASK);
+
+	if (c != hid_serving && c->busy == CID_RECEIVING && ((get_ms() - c->last_used) >= 750))
 	{
-		if (CIDS[i].busy && ((get_ms() - CIDS[i].last_used) >= 750))
+		u2f_printlx("timeout cid ",2,c->cid,get_ms());
+		if (u2f_hid_busy() && hid_layer.current_cid == c->cid)
 		{
-			u2f_printlx("timeout cid ",2,CIDS[i].cid,get_ms());
-			stamp_error(CIDS[i].cid, ERR_MSG_TIMEOUT);
-			del_cid(CIDS[i].cid);
 			u2f_hid_reset_packet();
 		}
+		stamp_error(c->cid, ERR_MSG_TIMEOUT);
+	}
+
+}
+
+uint32_t u2f_hid_current_cid()
+{
+	return hid_layer.current_cid;
+}
+
+uint8_t u2f_hid_replaying()
+{
+	return hid_replaying;
+}
+
+int8_t u2f_hid_wait_user()
+{
+	struct CID* c = get_cid(hid_layer.current_cid);
+
+	// the request is replayed from the reassembly buffer
+	if (c == NULL || c->buf == HID_NO_BUFFER || (hid_waiting != NULL && hid_waiting != c))
+	{
+		return -1;
+	}
+	hid_waiting = c;
+	c->busy = CID_WAITING;
+	return 0;
+}
+
+void u2f_hid_check_waiting()
+{
+	struct CID* c = hid_waiting;
+
+	if (c == NULL)
+	{
+		return;
+	}
+
+	if (u2f_user_feedback_poll())
+	{
+		if (get_ms() - c->last_used >= U2FHID_KEEPALIVE_MS)
+		{
+			stamp_frame(c->cid, U2FHID_KEEPALIVE, STATUS_UPNEEDED);
+			c->last_used = get_ms();
+		}
+		return;
 	}
 
+	hid_waiting = NULL;
+	hid_layer.current_cid = c->cid;
+	hid_layer.current_cmd = U2FHID_MSG;
+	hid_serving = c;
+	hid_replaying = 1;
+	u2f_request((struct u2f_request_apdu *)cid_buffer(c));
+	hid_replaying = 0;
+	hid_serving = NULL;
+	if (hid_waiting != c)
+	{
+		c->busy = 0;
+		cid_release_buffer(c);
+	}
 }
 
 
 void u2f_hid_request(struct u2f_hid_msg* req)
 {
-	static int8_t last_seq;
 	struct CID* cid = NULL;
 
+	if (!req->cid)
+	{
+		stamp_error(req->cid, ERR_SYNC_FAIL);
+		return;
+	}
+
 	cid = get_cid(req->cid);
 	// Error checking
 	if ((U2FHID_IS_INIT(req->pkt.init.cmd)))
@@ -504,27 +714,26 @@ void u2f_hid_request(struct u2f_hid_msg* req)
 			stamp_error(req->cid, ERR_INVALID_LEN);
 			return;
 		}
-		if (req->pkt.init.cmd != U2FHID_INIT && req->cid != hid_layer.current_cid && u2f_hid_busy())
-		{
-			stamp_error(req->cid, ERR_CHANNEL_BUSY);
-			return;
-		}
 	}
-	else if (cid == NULL || !cid->busy)
+	else if (cid == NULL || cid->busy != CID_RECEIVING)
 	{
 		// ignore random cont packets
 		return;
 	}
 
-
-	if (!req->cid)
+	// CANCEL is never answered, it only ends the wait for the user
+	if (req->pkt.init.cmd == U2FHID_CANCEL)
 	{
-		stamp_error(req->cid, ERR_SYNC_FAIL);
+		if (cid != NULL && cid == hid_waiting)
+		{
+			u2f_user_feedback_cancel();
+		}
 		return;
 	}
 
 
 
+
 	if (req->cid == U2FHID_BROADCAST)
 	{
 		if (!(req->pkt.init.cmd == U2FHID_INIT))
@@ -537,27 +746,34 @@ void u2f_hid_request(struct u2f_hid_msg* req)
 	}
 	else if (U2FHID_IS_INIT(req->pkt.init.cmd) && cid == NULL)
 	{
-		add_new_cid(req->cid);
-		cid = get_cid(req->cid);
+		cid = add_new_cid(req->cid);
 		if (cid == NULL)
 		{
+			stamp_error(req->cid, ERR_CHANNEL_BUSY);
 			return;
 		}
 		cid->busy = 0;
 	}
 
-
+	// only INIT and CANCEL get through while the user is waited for
+	if (cid->busy == CID_WAITING && req->pkt.init.cmd != U2FHID_INIT)
+	{
+		stamp_frame(req->cid, U2FHID_ERROR, ERR_CHANNEL_BUSY);
+		return;
+	}
 
 
 	// Reset init packets
 	if (req->pkt.init.cmd == U2FHID_INIT)
 	{
+		if (u2f_hid_busy() && hid_layer.current_cid == req->cid)
+		{
+			u2f_hid_reset_packet();
+		}
+		cid_release_buffer(cid);
 		cid->busy = 0;
 	}
 
-	hid_layer.current_cid = req->cid;
-	hid_layer.last_buffered = get_ms();
-
 	cid->last_used = get_ms();
 
 
@@ -576,8 +792,8 @@ void u2f_hid_request(struct u2f_hid_msg* req)
 	if ((req->pkt.init.cmd & TYPE_INIT) && !cid->busy)
 	{
 		cid->last_cmd = req->pkt.init.cmd;
-		hid_layer.current_cmd = req->pkt.init.cmd;
-		last_seq = -1;
+		cid->req_len = U2FHID_LEN(req);
+		cid->last_seq = -1;
 
 	}
 	else
@@ -585,20 +801,29 @@ void u2f_hid_request(struct u2f_hid_msg* req)
 
 
 		// verify packets arrive in ascending order
-		hid_layer.last_buffered = get_ms();
-		if (last_seq + 1 != req->pkt.cont.seq)
+		if (cid->last_seq + 1 != req->pkt.cont.seq)
 		{
-			stamp_error(hid_layer.current_cid, ERR_INVALID_SEQ);
-			u2f_hid_reset_packet();
+			stamp_error(req->cid, ERR_INVALID_SEQ);
+			if (u2f_hid_busy() && hid_layer.current_cid == req->cid)
+			{
+				u2f_hid_reset_packet();
+			}
 			return;
 		}
-		last_seq = req->pkt.cont.seq;
-
-		hid_layer.current_cmd = cid->last_cmd;
+		cid->last_seq = req->pkt.cont.seq;
 
 	}
 
-	cid->busy = hid_u2f_parse(req);
+	hid_layer.current_cid = req->cid;
+	hid_layer.current_cmd = cid->last_cmd;
+
+	hid_serving = cid;
+	cid->busy = hid_u2f_parse(cid, req);
+	hid_serving = NULL;
+	if (!cid->busy)
+	{
+		cid_release_buffer(cid);
+	}
 
 }
 
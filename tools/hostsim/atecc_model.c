@@ -0,0 +1,665 @@
+/*
+ * atecc_model.c
+ * 		Software stand-in for the ATECC508A, as configured by
+ * 		client.py (private P-256 keys in the even slots and slot 15,
+ * 		secrets elsewhere).
+ *
+ * 		Implements the I2C word addresses (command, idle, sleep), the
+ * 		wake and watchdog behaviour, the packet CRC and the commands
+ * 		issued by the firmware: SHA/HMAC, NONCE, GENDIG, encrypted
+ * 		PRIVWRITE, GENKEY, SIGN, COUNTER, RNG, READ and INFO.
+ * 		Execution times are typical values, the chip NACKs its address
+ * 		until a command is done.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+
+#include "atecc_model.h"
+#include "sim.h"
+
+#define WA_RESET		0x00
+#define WA_SLEEP		0x01
+#define WA_IDLE			0x02
+#define WA_COMMAND		0x03
+
+#define OP_READ			0x02
+#define OP_GENDIG		0x15
+#define OP_NONCE		0x16
+#define OP_LOCK			0x17
+#define OP_RNG			0x1b
+#define OP_COUNTER		0x24
+#define OP_INFO			0x30
+#define OP_GENKEY		0x40
+#define OP_SIGN			0x41
+#define OP_PRIVWRITE	0x46
+#define OP_SHA			0x47
+
+#define ST_SUCCESS		0x00
+#define ST_MISCOMPARE	0x01
+#define ST_PARSE		0x03
+#define ST_EXECUTION	0x0f
+#define ST_WAKE			0x11
+#define ST_CRC			0xff
+
+// tWHI, tWATCHDOG
+#define WAKE_US			1500
+#define WATCHDOG_US		1300000
+
+enum chip_state
+{
+	CHIP_SLEEP = 0,
+	CHIP_IDLE,
+	CHIP_AWAKE,
+};
+
+enum sha_state
+{
+	SHA_NONE = 0,
+	SHA_PLAIN,
+	SHA_HMAC,
+};
+
+static const uint8_t config_zone[128] =
+	"\x01\x23\x6d\x10\x00\x00\x50\x00\xd7\x2c\xa5\x71\xee\xc0\x85\x00"
+	"\xc0\x00\x55\x00\x83\x71\x81\x01\x83\x71\xC1\x01\x83\x71\x83\x71"
+	"\x83\x71\xC1\x71\x01\x01\x83\x71\x83\x71\xC1\x71\x83\x71\x83\x71"
+	"\x83\x71\x83\x71\xff\xff\xff\xff\x00\x00\x00\x00\xff\xff\xff\xff"
+	"\x00\x00\x00\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
+	"\xff\xff\xff\xff\x00\x00\x00\x00\xff\xff\x00\x00\x00\x00\x00\x00"
+	"\x13\x00\x3C\x00\x13\x00\x3C\x00\x13\x00\x3C\x00\x13\x00\x3C\x00"
+	"\x3c\x00\x3C\x00\x13\x00\x3C\x00\x13\x00\x3C\x00\x13\x00\x33\x00";
+
+#define CONFIG_SN8			(config_zone[12])
+#define CONFIG_SN01(i)		(config_zone[i])
+#define KEY_IS_PRIVATE(s)	(config_zone[96 + 2*(s)] & 1)
+
+// typical execution times in microseconds
+static uint32_t exec_us(uint8_t opcode, uint8_t p1)
+{
+	switch (opcode)
+	{
+		case OP_COUNTER:	return 12000;
+		case OP_GENDIG:		return 5000;
+		case OP_INFO:		return 500;
+		case OP_LOCK:		return 15000;
+		case OP_NONCE:		return 1000;
+		case OP_PRIVWRITE:	return 25000;
+		case OP_READ:		return 500;
+		case OP_RNG:		return 12000;
+		case OP_SHA:		return (p1 & 0x7) == 0x2 || (p1 & 0x7) == 0x5 ? 5000 : 2000;
+		case OP_SIGN:		return 42000;
+		case OP_GENKEY:		return p1 & 0x4 ? 85000 : 12000;
+		default:			return 30000;
+	}
+}
+
+static struct
+{
+	enum chip_state state;
+	uint64_t ready_at;
+	uint64_t watchdog_at;
+	uint64_t busy_until;
+
+	uint8_t tempkey[32];
+	uint8_t tempkey_valid;
+
+	enum sha_state sha;
+	EVP_MD_CTX * sha_ctx;
+	uint8_t hmac_key[64];
+
+	uint8_t slots[ATECC_MODEL_SLOTS][32];
+	EC_KEY * keys[ATECC_MODEL_SLOTS];
+	uint32_t counters[2];
+
+	uint8_t resp[80];
+	uint8_t resp_len;
+} chip;
+
+static struct atecc_model_stats stats;
+
+
+// Reference CRC of the ATECC data sheet: polynomial 0x8005, data bits
+// fed LSB first, result sent LSB first
+static uint16_t atecc_crc(const uint8_t * buf, uint16_t len)
+{
+	uint16_t crc = 0;
+	uint16_t i;
+	uint8_t b;
+
+	for (i = 0; i < len; i++)
+	{
+		for (b = 0; b < 8; b++)
+		{
+			uint8_t data_bit = (buf[i] >> b) & 1;
+			uint8_t crc_bit = crc >> 15;
+			crc <<= 1;
+			if (data_bit != crc_bit)
+				crc ^= 0x8005;
+		}
+	}
+	return crc;
+}
+
+static void respond(const uint8_t * data, uint8_t len)
+{
+	uint16_t crc;
+
+	chip.resp[0] = len + 3;
+	memmove(chip.resp + 1, data, len);
+	crc = atecc_crc(chip.resp, len + 1);
+	chip.resp[len + 1] = (uint8_t)crc;
+	chip.resp[len + 2] = (uint8_t)(crc >> 8);
+	chip.resp_len = len + 3;
+}
+
+static void respond_status(uint8_t status)
+{
+	respond(&status, 1);
+}
+
+static void sha256(const uint8_t * buf, size_t len, uint8_t * out)
+{
+	EVP_Digest(buf, len, out, NULL, EVP_sha256(), NULL);
+}
+
+static EC_KEY * key_from_private(const uint8_t * priv)
+{
+	EC_KEY * key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+	const EC_GROUP * group = EC_KEY_get0_group(key);
+	BIGNUM * bn = BN_bin2bn(priv, 32, NULL);
+	EC_POINT * pub = EC_POINT_new(group);
+
+	if (BN_is_zero(bn) || BN_cmp(bn, EC_GROUP_get0_order(group)) >= 0
+			|| !EC_KEY_set_private_key(key, bn)
+			|| !EC_POINT_mul(group, pub, bn, NULL, NULL, NULL)
+			|| !EC_KEY_set_public_key(key, pub))
+	{
+		EC_KEY_free(key);
+		key = NULL;
+	}
+
+	EC_POINT_free(pub);
+	BN_clear_free(bn);
+	return key;
+}
+
+static int export_public(EC_KEY * key, uint8_t * xy)
+{
+	uint8_t buf[65];
+
+	if (EC_POINT_point2oct(EC_KEY_get0_group(key), EC_KEY_get0_public_key(key),
+			POINT_CONVERSION_UNCOMPRESSED, buf, sizeof(buf), NULL) != sizeof(buf))
+		return -1;
+	memmove(xy, buf + 1, 64);
+	return 0;
+}
+
+static void set_private(uint8_t slot, const uint8_t * priv)
+{
+	EC_KEY_free(chip.keys[slot]);
+	chip.keys[slot] = key_from_private(priv);
+	memmove(chip.slots[slot], priv, 32);
+}
+
+
+static void cmd_sha(uint8_t p1, uint16_t p2, const uint8_t * data, uint8_t len)
+{
+	uint8_t inner[32];
+	uint8_t pad[64];
+	uint8_t i;
+
+	switch (p1 & 0x7)
+	{
+		case 0x0:	// start
+		case 0x4:	// HMAC start
+			EVP_DigestInit_ex(chip.sha_ctx, EVP_sha256(), NULL);
+			chip.sha = SHA_PLAIN;
+			if (p1 & 0x4)
+			{
+				if (p2 >= ATECC_MODEL_SLOTS)
+				{
+					chip.sha = SHA_NONE;
+					respond_status(ST_PARSE);
+					return;
+				}
+				memset(chip.hmac_key, 0, sizeof(chip.hmac_key));
+				memmove(chip.hmac_key, chip.slots[p2], 32);
+				for (i = 0; i < 64; i++)
+					pad[i] = chip.hmac_key[i] ^ 0x36;
+				EVP_DigestUpdate(chip.sha_ctx, pad, 64);
+				chip.sha = SHA_HMAC;
+			}
+			respond_status(ST_SUCCESS);
+			break;
+
+		case 0x1:	// update, exactly one block
+			if (chip.sha == SHA_NONE || len != 64)
+			{
+				respond_status(chip.sha == SHA_NONE ? ST_EXECUTION : ST_PARSE);
+				return;
+			}
+			EVP_DigestUpdate(chip.sha_ctx, data, 64);
+			respond_status(ST_SUCCESS);
+			break;
+
+		case 0x2:	// end
+		case 0x5:	// HMAC end
+			if (chip.sha != ((p1 & 0x7) == 0x2 ? SHA_PLAIN : SHA_HMAC) || len != p2 || len > 63)
+			{
+				respond_status(chip.sha == SHA_NONE ? ST_EXECUTION : ST_PARSE);
+				return;
+			}
+			EVP_DigestUpdate(chip.sha_ctx, data, len);
+			EVP_DigestFinal_ex(chip.sha_ctx, chip.tempkey, NULL);
+			if (chip.sha == SHA_HMAC)
+			{
+				memmove(inner, chip.tempkey, 32);
+				for (i = 0; i < 64; i++)
+					pad[i] = chip.hmac_key[i] ^ 0x5c;
+				EVP_DigestInit_ex(chip.sha_ctx, EVP_sha256(), NULL);
+				EVP_DigestUpdate(chip.sha_ctx, pad, 64);
+				EVP_DigestUpdate(chip.sha_ctx, inner, 32);
+				EVP_DigestFinal_ex(chip.sha_ctx, chip.tempkey, NULL);
+				memset(chip.hmac_key, 0, sizeof(chip.hmac_key));
+			}
+			chip.sha = SHA_NONE;
+			chip.tempkey_valid = 1;
+			respond(chip.tempkey, 32);
+			break;
+
+		default:
+			respond_status(ST_PARSE);
+			break;
+	}
+}
+
+static void cmd_nonce(uint8_t p1, const uint8_t * data, uint8_t len)
+{
+	uint8_t msg[55];
+	uint8_t rand_out[32];
+
+	if ((p1 & 0x3) == 0x3)
+	{
+		// pass-through
+		if (len != 32)
+		{
+			respond_status(ST_PARSE);
+			return;
+		}
+		memmove(chip.tempkey, data, 32);
+		chip.tempkey_valid = 1;
+		respond_status(ST_SUCCESS);
+		return;
+	}
+
+	if (len != 20)
+	{
+		respond_status(ST_PARSE);
+		return;
+	}
+	RAND_bytes(rand_out, sizeof(rand_out));
+	memmove(msg, rand_out, 32);
+	memmove(msg + 32, data, 20);
+	msg[52] = OP_NONCE;
+	msg[53] = p1;
+	msg[54] = 0;
+	sha256(msg, sizeof(msg), chip.tempkey);
+	chip.tempkey_valid = 1;
+	respond(rand_out, 32);
+}
+
+static void cmd_gendig(uint8_t p1, uint16_t p2)
+{
+	uint8_t msg[96];
+
+	if (p1 != 0x2 || p2 >= ATECC_MODEL_SLOTS || !chip.tempkey_valid)
+	{
+		respond_status(chip.tempkey_valid ? ST_PARSE : ST_EXECUTION);
+		return;
+	}
+
+	memset(msg, 0, sizeof(msg));
+	memmove(msg, chip.slots[p2], 32);
+	msg[32] = OP_GENDIG;
+	msg[33] = p1;
+	msg[34] = (uint8_t)p2;
+	msg[35] = (uint8_t)(p2 >> 8);
+	msg[36] = CONFIG_SN8;
+	msg[37] = CONFIG_SN01(0);
+	msg[38] = CONFIG_SN01(1);
+	memmove(msg + 64, chip.tempkey, 32);
+	sha256(msg, sizeof(msg), chip.tempkey);
+	respond_status(ST_SUCCESS);
+}
+
+static void cmd_privwrite(uint8_t p1, uint16_t p2, const uint8_t * data, uint8_t len)
+{
+	uint8_t mask[32];
+	uint8_t plain[36];
+	uint8_t msg[96];
+	uint8_t mac[32];
+	uint8_t slot = p2 & 0xf;
+	uint8_t i;
+
+	if (!(p1 & 0x40) || len != 68 || !KEY_IS_PRIVATE(slot) || !chip.tempkey_valid)
+	{
+		respond_status(chip.tempkey_valid ? ST_PARSE : ST_EXECUTION);
+		return;
+	}
+
+	// input data is encrypted with TempKey and the first bytes of its digest
+	sha256(chip.tempkey, 32, mask);
+	for (i = 0; i < 32; i++)
+		plain[i] = data[i] ^ chip.tempkey[i];
+	for (i = 0; i < 4; i++)
+		plain[32 + i] = data[32 + i] ^ mask[i];
+
+	memset(msg, 0, sizeof(msg));
+	memmove(msg, chip.tempkey, 32);
+	msg[32] = OP_PRIVWRITE;
+	msg[33] = p1;
+	msg[34] = (uint8_t)p2;
+	msg[35] = (uint8_t)(p2 >> 8);
+	msg[36] = CONFIG_SN8;
+	msg[37] = CONFIG_SN01(0);
+	msg[38] = CONFIG_SN01(1);
+	memmove(msg + 60, plain, 36);
+	sha256(msg, sizeof(msg), mac);
+
+	chip.tempkey_valid = 0;
+
+	if (memcmp(mac, data + 36, 32) != 0)
+	{
+		respond_status(ST_MISCOMPARE);
+		return;
+	}
+	if (plain[0] || plain[1] || plain[2] || plain[3])
+	{
+		respond_status(ST_EXECUTION);
+		return;
+	}
+
+	set_private(slot, plain + 4);
+	respond_status(chip.keys[slot] ? ST_SUCCESS : ST_EXECUTION);
+}
+
+static void cmd_genkey(uint8_t p1, uint16_t p2)
+{
+	uint8_t xy[64];
+	uint8_t priv[32];
+	uint8_t slot = p2 & 0xf;
+
+	if (!KEY_IS_PRIVATE(slot))
+	{
+		respond_status(ST_PARSE);
+		return;
+	}
+
+	if (p1 & 0x4)
+	{
+		do
+		{
+			RAND_bytes(priv, sizeof(priv));
+			set_private(slot, priv);
+		}
+		while (chip.keys[slot] == NULL);
+	}
+
+	if (chip.keys[slot] == NULL || export_public(chip.keys[slot], xy) != 0)
+	{
+		respond_status(ST_EXECUTION);
+		return;
+	}
+	respond(xy, 64);
+}
+
+static void cmd_sign(uint8_t p1, uint16_t p2)
+{
+	uint8_t rs[64];
+	uint8_t slot = p2 & 0xf;
+	ECDSA_SIG * sig;
+	const BIGNUM * r, * s;
+
+	if (p1 != 0x80 || !chip.tempkey_valid || chip.keys[slot] == NULL)
+	{
+		respond_status(p1 != 0x80 ? ST_PARSE : ST_EXECUTION);
+		return;
+	}
+
+	sig = ECDSA_do_sign(chip.tempkey, 32, chip.keys[slot]);
+	chip.tempkey_valid = 0;
+	if (sig == NULL)
+	{
+		respond_status(ST_EXECUTION);
+		return;
+	}
+	ECDSA_SIG_get0(sig, &r, &s);
+	BN_bn2binpad(r, rs, 32);
+	BN_bn2binpad(s, rs + 32, 32);
+	ECDSA_SIG_free(sig);
+	respond(rs, 64);
+}
+
+static void cmd_counter(uint8_t p1, uint16_t p2)
+{
+	uint8_t out[4];
+	uint32_t c;
+
+	if (p1 > 1 || p2 > 1)
+	{
+		respond_status(ST_PARSE);
+		return;
+	}
+	if (p1 == 1)
+		chip.counters[p2]++;
+	c = chip.counters[p2];
+	out[0] = (uint8_t)c;
+	out[1] = (uint8_t)(c >> 8);
+	out[2] = (uint8_t)(c >> 16);
+	out[3] = (uint8_t)(c >> 24);
+	respond(out, 4);
+}
+
+static void cmd_read(uint8_t p1, uint16_t p2)
+{
+	uint8_t len = p1 & 0x80 ? 32 : 4;
+	uint16_t off;
+
+	switch (p1 & 0x3)
+	{
+		case 0x0:
+			off = ((p2 >> 3) & 0x3) * 32 + (p2 & 0x7) * 4;
+			if (len == 32)
+				off &= ~31;
+			respond(config_zone + off, len);
+			break;
+		case 0x2:
+			off = (p2 & 0x7) * 4;
+			if (KEY_IS_PRIVATE((p2 >> 3) & 0xf) || (p2 >> 8) || off + len > 32)
+			{
+				respond_status(ST_EXECUTION);
+				return;
+			}
+			respond(chip.slots[(p2 >> 3) & 0xf] + (len == 32 ? 0 : off), len);
+			break;
+		default:
+			respond_status(ST_PARSE);
+			break;
+	}
+}
+
+static void execute(const uint8_t * pkt, uint8_t len)
+{
+	uint8_t count = pkt[0];
+	uint8_t opcode = pkt[1];
+	uint8_t p1 = pkt[2];
+	uint16_t p2 = pkt[3] | ((uint16_t)pkt[4] << 8);
+	const uint8_t * data = pkt + 5;
+	uint8_t datalen;
+	uint16_t crc;
+	static const uint8_t revision[4] = {0x00, 0x00, 0x50, 0x00};
+
+	if (count < 7 || count != len)
+	{
+		respond_status(ST_PARSE);
+		return;
+	}
+	crc = atecc_crc(pkt, count - 2);
+	if (pkt[count - 2] != (uint8_t)crc || pkt[count - 1] != (uint8_t)(crc >> 8))
+	{
+		stats.crc_errors++;
+		respond_status(ST_CRC);
+		return;
+	}
+	datalen = count - 7;
+
+	stats.commands++;
+	stats.opcode[opcode]++;
+	chip.busy_until = sim_now_us() + exec_us(opcode, p1);
+	stats.busy_us += exec_us(opcode, p1);
+
+	switch (opcode)
+	{
+		case OP_SHA:		cmd_sha(p1, p2, data, datalen); break;
+		case OP_NONCE:		cmd_nonce(p1, data, datalen); break;
+		case OP_GENDIG:		cmd_gendig(p1, p2); break;
+		case OP_PRIVWRITE:	cmd_privwrite(p1, p2, data, datalen); break;
+		case OP_GENKEY:		cmd_genkey(p1, p2); break;
+		case OP_SIGN:		cmd_sign(p1, p2); break;
+		case OP_COUNTER:	cmd_counter(p1, p2); break;
+		case OP_RNG:
+		{
+			uint8_t r[32];
+			RAND_bytes(r, sizeof(r));
+			respond(r, 32);
+		} break;
+		case OP_READ:		cmd_read(p1, p2); break;
+		case OP_INFO:		respond(revision, 4); break;
+		default:			respond_status(ST_PARSE); break;
+	}
+}
+
+
+static void go_to_sleep()
+{
+	chip.state = CHIP_SLEEP;
+	chip.tempkey_valid = 0;
+	chip.sha = SHA_NONE;
+	memset(chip.tempkey, 0, sizeof(chip.tempkey));
+}
+
+// common start of every transaction, returns 0 if the address is ACKed
+static int address(uint8_t addr)
+{
+	uint64_t now = sim_now_us();
+
+	if (addr != ATECC_MODEL_ADDR)
+		return -1;
+
+	if (chip.state == CHIP_AWAKE && now >= chip.watchdog_at)
+	{
+		stats.watchdog_sleeps++;
+		go_to_sleep();
+	}
+
+	if (chip.state != CHIP_AWAKE)
+	{
+		// SDA held low by the start of the transfer wakes the chip up
+		stats.wakes++;
+		chip.state = CHIP_AWAKE;
+		chip.ready_at = now + WAKE_US;
+		chip.watchdog_at = now + WATCHDOG_US;
+		chip.busy_until = 0;
+		respond_status(ST_WAKE);
+		return -1;
+	}
+
+	if (now < chip.ready_at || now < chip.busy_until)
+	{
+		stats.busy_nacks++;
+		return -1;
+	}
+	return 0;
+}
+
+int atecc_model_write(uint8_t addr, const uint8_t * buf, uint16_t len)
+{
+	if (address(addr) != 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	switch (buf[0])
+	{
+		case WA_SLEEP:
+			go_to_sleep();
+			break;
+		case WA_IDLE:
+			chip.state = CHIP_IDLE;
+			break;
+		case WA_COMMAND:
+			if (len < 2)
+				respond_status(ST_PARSE);
+			else
+				execute(buf + 1, len - 1);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+int atecc_model_read(uint8_t addr, uint8_t * buf, uint16_t len)
+{
+	if (address(addr) != 0)
+		return -1;
+	if (len > chip.resp_len)
+		len = chip.resp_len;
+	memmove(buf, chip.resp, len);
+	return len;
+}
+
+
+void atecc_model_reset(void)
+{
+	if (chip.sha_ctx == NULL)
+		chip.sha_ctx = EVP_MD_CTX_new();
+	go_to_sleep();
+	chip.resp_len = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+void atecc_model_set_slot(uint8_t slot, const uint8_t * key)
+{
+	if (KEY_IS_PRIVATE(slot))
+		set_private(slot, key);
+	else
+		memmove(chip.slots[slot], key, 32);
+}
+
+int atecc_model_get_pubkey(uint8_t slot, uint8_t * xy)
+{
+	if (slot >= ATECC_MODEL_SLOTS || chip.keys[slot] == NULL)
+		return -1;
+	return export_public(chip.keys[slot], xy);
+}
+
+uint32_t atecc_model_get_counter(uint8_t counter)
+{
+	return chip.counters[counter & 1];
+}
+
+void atecc_model_get_stats(struct atecc_model_stats * st)
+{
+	*st = stats;
+}
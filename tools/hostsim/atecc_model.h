@@ -0,0 +1,42 @@
+/*
+ * atecc_model.h
+ * 		Software stand-in for the ATECC508A behind the SMBus shim.
+ *
+ */
+
+#ifndef HOSTSIM_ATECC_MODEL_H_
+#define HOSTSIM_ATECC_MODEL_H_
+
+#include <stdint.h>
+
+#define ATECC_MODEL_ADDR		0xc0
+#define ATECC_MODEL_SLOTS		16
+
+struct atecc_model_stats
+{
+	uint32_t commands;
+	uint32_t opcode[256];
+	uint32_t wakes;
+	uint32_t busy_nacks;
+	uint32_t crc_errors;
+	uint32_t watchdog_sleeps;
+	uint64_t busy_us;
+};
+
+// power on reset: chip asleep, TempKey and SHA state lost
+void atecc_model_reset(void);
+
+// provisioning, @key is the 32 byte secret or P-256 private key
+void atecc_model_set_slot(uint8_t slot, const uint8_t * key);
+// uncompressed public key X|Y of a private key slot, 0 on success
+int atecc_model_get_pubkey(uint8_t slot, uint8_t * xy);
+uint32_t atecc_model_get_counter(uint8_t counter);
+
+// bus side, called by the SMBus shim for every transaction.
+// Both return -1 if the address is NACKed.
+int atecc_model_write(uint8_t addr, const uint8_t * buf, uint16_t len);
+int atecc_model_read(uint8_t addr, uint8_t * buf, uint16_t len);
+
+void atecc_model_get_stats(struct atecc_model_stats * st);
+
+#endif /* HOSTSIM_ATECC_MODEL_H_ */
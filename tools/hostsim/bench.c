@@ -0,0 +1,1330 @@
+/*
+ * bench.c
+ * 		Replays INIT, REGISTER, AUTHENTICATE and PING transactions
+ * 		against the host build of the firmware, verifies the responses
+ * 		and reports throughput, ATECC commands and I2C traffic per
+ * 		transaction.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+
+#include "sim.h"
+#include "atecc_model.h"
+
+#define U2FHID_PING			0x81
+#define U2FHID_MSG			0x83
+#define U2FHID_INIT			0x86
+#define U2FHID_CANCEL		0x91
+#define U2FHID_KEEPALIVE	0xbb
+#define U2FHID_ERROR		0xbf
+#define U2F_CUSTOM_GET_RNG		0xc0
+#define U2F_CUSTOM_USB_STATS	0xc7
+#define U2F_CUSTOM_TAG_CACHE_STATS	0xc8
+#define U2F_CUSTOM_RNG_STREAM	0xc9
+#define U2F_CUSTOM_ATECC_TIMING	0xca
+#define U2F_CUSTOM_SMB_STATS	0xcb
+#define U2F_CUSTOM_ATECC_HEALTH	0xcc
+#define U2F_CUSTOM_PROFILE		0xcd
+#define U2FHID_MAX_PAYLOAD	7609
+
+#define U2F_REGISTER		0x01
+#define U2F_AUTHENTICATE	0x02
+#define U2F_AUTH_CHECK		0x07
+#define U2F_AUTH_SIGN		0x03
+#define U2F_AUTH_MULTI		0xc1
+#define U2F_AUTH_MULTI_MAX	3
+#define U2F_KEY_HANDLE_SIZE	64
+
+#define SW_NO_ERROR						0x9000
+#define SW_CONDITIONS_NOT_SATISFIED		0x6985
+
+// give up on a transaction after this much device time
+#define TIMEOUT_US			(3*1000*1000)
+
+#define MAX_CHANNELS		16
+
+enum
+{
+	OP_INIT = 0,
+	OP_REGISTER,
+	OP_AUTH_CHECK,
+	OP_AUTH_PROBE,
+	OP_AUTH_SIGN,
+	OP_AUTH_RETURN,
+	OP_MULTI_CHECK,
+	OP_MULTI_SIGN,
+	OP_PING,
+	OP_RNG,
+	OP_RNG_STREAM,
+	OP_CONCURRENT,
+	OP_USER_WAIT,
+	OP_WAIT_PING,
+	OP_CANCEL,
+	OP_WAIT_SIGN,
+	OP_WAIT_MULTI,
+	OP_BUS_FAULT,
+	OP_MAX
+};
+
+static const char * op_names[OP_MAX] =
+{
+	"INIT", "REGISTER", "AUTH-CHECK", "AUTH-PROBE", "AUTH-SIGN", "AUTH-RETURN", "MULTI-CHECK", "MULTI-SIGN",
+	"PING", "GET-RNG", "RNG-STREAM", "CONCURRENT", "USER-WAIT", "WAIT-PING", "CANCEL",
+	"WAIT-SIGN", "WAIT-MULTI", "BUS-FAULT",
+};
+
+struct op_stats
+{
+	uint32_t count;
+	uint64_t device_us;
+	uint64_t atecc_cmds;
+	uint64_t atecc_wakes;
+	uint64_t i2c_bytes;
+	uint64_t i2c_transactions;
+};
+
+static struct op_stats op_stats[OP_MAX];
+static uint8_t cid[4];
+static uint32_t busy_errors = 0;
+static uint32_t keepalives = 0;
+static uint8_t attest_pub[64];
+
+// attestation certificate of the firmware, from cert.c
+extern const uint8_t __attest[];
+extern const uint16_t __attest_size;
+static uint32_t last_counter = 0;
+
+// applications of the first iterations, signed in to again in turn
+#define RETURNING_APPS		3
+
+struct app
+{
+	uint8_t appid[32];
+	uint8_t handle[U2F_KEY_HANDLE_SIZE];
+	uint8_t pubkey[64];
+};
+
+static struct app returning[RETURNING_APPS];
+
+struct snapshot
+{
+	uint64_t us;
+	struct atecc_model_stats atecc;
+	struct sim_i2c_stats i2c;
+};
+
+static void take_snapshot(struct snapshot * s)
+{
+	s->us = sim_now_us();
+	atecc_model_get_stats(&s->atecc);
+	sim_i2c_get_stats(&s->i2c);
+}
+
+static void run_for(uint32_t us);
+
+// idle time the host leaves the token before each transaction
+static uint32_t think_us = 0;
+
+static void begin(struct snapshot * s)
+{
+	run_for(think_us);
+	take_snapshot(s);
+}
+
+static void account(int op, struct snapshot * before)
+{
+	struct snapshot after;
+	struct op_stats * st = &op_stats[op];
+
+	take_snapshot(&after);
+	st->count++;
+	st->device_us += after.us - before->us;
+	st->atecc_cmds += after.atecc.commands - before->atecc.commands;
+	st->atecc_wakes += after.atecc.wakes - before->atecc.wakes;
+	st->i2c_bytes += after.i2c.bytes - before->i2c.bytes;
+	st->i2c_transactions += after.i2c.transactions - before->i2c.transactions;
+}
+
+static void sha256(const uint8_t * buf, size_t len, uint8_t * out)
+{
+	EVP_Digest(buf, len, out, NULL, EVP_sha256(), NULL);
+}
+
+// split a request into frames, returns the number of frames
+static int build_frames(const uint8_t * chan, uint8_t cmd, const uint8_t * payload, uint16_t len,
+		uint8_t frames[][SIM_HID_PACKET_SIZE])
+{
+	uint8_t * frame = frames[0];
+	uint16_t off = 0;
+	uint16_t n;
+	uint8_t seq = 0;
+	int count = 1;
+
+	memset(frame, 0, SIM_HID_PACKET_SIZE);
+	memmove(frame, chan, 4);
+	frame[4] = cmd;
+	frame[5] = len >> 8;
+	frame[6] = len & 0xff;
+	n = len < 57 ? len : 57;
+	memmove(frame + 7, payload, n);
+	off += n;
+
+	while (off < len)
+	{
+		frame = frames[count++];
+		memset(frame, 0, SIM_HID_PACKET_SIZE);
+		memmove(frame, chan, 4);
+		frame[4] = seq++;
+		n = len - off < 59 ? len - off : 59;
+		memmove(frame + 5, payload + off, n);
+		off += n;
+	}
+	return count;
+}
+
+static void send_request(uint8_t cmd, const uint8_t * payload, uint16_t len)
+{
+	static uint8_t frames[130][SIM_HID_PACKET_SIZE];
+	int i, n;
+
+	n = build_frames(cid, cmd, payload, len, frames);
+	for (i = 0; i < n; i++)
+		sim_usb_host_write(frames[i]);
+}
+
+// returns the response length, -1 on timeout or a broken sequence
+static int recv_response(uint8_t * cmd, uint8_t * payload)
+{
+	uint8_t frame[SIM_HID_PACKET_SIZE];
+	uint64_t deadline = sim_now_us() + TIMEOUT_US;
+	uint16_t len = 0, off = 0, n;
+	int seq = -1;
+
+	while (1)
+	{
+		while (!sim_usb_host_read(frame))
+		{
+			if (sim_now_us() > deadline)
+			{
+				fprintf(stderr, "timeout waiting for response\n");
+				return -1;
+			}
+			if (sim_step())
+				return -1;
+		}
+
+		// a request waiting for the user, possibly on another channel
+		if (frame[4] == U2FHID_KEEPALIVE)
+		{
+			keepalives++;
+			continue;
+		}
+
+		if (memcmp(frame, cid, 4) != 0)
+		{
+			fprintf(stderr, "response on a foreign channel\n");
+			return -1;
+		}
+
+		if (seq < 0)
+		{
+			*cmd = frame[4];
+			len = ((uint16_t)frame[5] << 8) | frame[6];
+			if (len > U2FHID_MAX_PAYLOAD)
+				return -1;
+			n = len < 57 ? len : 57;
+			memmove(payload, frame + 7, n);
+		}
+		else
+		{
+			if (frame[4] != seq)
+			{
+				fprintf(stderr, "bad response sequence %d, expected %d\n", frame[4], seq);
+				return -1;
+			}
+			n = len - off < 59 ? len - off : 59;
+			memmove(payload + off, frame + 5, n);
+		}
+		off += n;
+		seq++;
+
+		if (off >= len)
+			return len;
+	}
+}
+
+static int transact(uint8_t cmd, const uint8_t * req, uint16_t req_len, uint8_t * res)
+{
+	uint8_t res_cmd;
+	int len;
+
+	send_request(cmd, req, req_len);
+	len = recv_response(&res_cmd, res);
+	if (len < 0)
+		return -1;
+	if (res_cmd != cmd)
+	{
+		fprintf(stderr, "response command 0x%02x", res_cmd);
+		if (res_cmd == U2FHID_ERROR)
+			fprintf(stderr, ", error 0x%02x", res[0]);
+		fprintf(stderr, "\n");
+		return -1;
+	}
+	return len;
+}
+
+static int apdu(uint8_t ins, uint8_t p1, const uint8_t * data, uint16_t len, uint8_t * res, uint16_t * sw)
+{
+	uint8_t req[7 + 320];
+	int n;
+
+	req[0] = 0;
+	req[1] = ins;
+	req[2] = p1;
+	req[3] = 0;
+	req[4] = 0;
+	req[5] = len >> 8;
+	req[6] = len & 0xff;
+	memmove(req + 7, data, len);
+
+	n = transact(U2FHID_MSG, req, 7 + len, res);
+	if (n < 2)
+		return -1;
+	*sw = ((uint16_t)res[n - 2] << 8) | res[n - 1];
+	return n - 2;
+}
+
+
+// The firmware pads R and S to 32 bytes and does not strip leading
+// zero bytes, which OpenSSL rejects as non-minimal DER. Parse the two
+// integers by hand instead of d2i_ECDSA_SIG().
+static ECDSA_SIG * parse_signature(const uint8_t * der, int der_len)
+{
+	ECDSA_SIG * sig;
+	BIGNUM * rs[2];
+	int off = 2, i, n;
+
+	if (der_len < 8 || der[0] != 0x30 || der[1] != der_len - 2)
+		return NULL;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (off + 2 > der_len || der[off] != 0x02)
+			return NULL;
+		n = der[off + 1];
+		if (off + 2 + n > der_len)
+			return NULL;
+		rs[i] = BN_bin2bn(der + off + 2, n, NULL);
+		off += 2 + n;
+	}
+
+	sig = ECDSA_SIG_new();
+	ECDSA_SIG_set0(sig, rs[0], rs[1]);
+	return sig;
+}
+
+static int verify(const uint8_t * pubxy, const uint8_t * digest, const uint8_t * der, int der_len)
+{
+	EC_KEY * key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+	BIGNUM * x = BN_bin2bn(pubxy, 32, NULL);
+	BIGNUM * y = BN_bin2bn(pubxy + 32, 32, NULL);
+	ECDSA_SIG * sig = parse_signature(der, der_len);
+	int ret = -1;
+
+	if (sig != NULL && EC_KEY_set_public_key_affine_coordinates(key, x, y))
+	{
+		ret = ECDSA_do_verify(digest, 32, sig, key) == 1 ? 0 : -1;
+	}
+
+	ECDSA_SIG_free(sig);
+	BN_free(x);
+	BN_free(y);
+	EC_KEY_free(key);
+	return ret;
+}
+
+// length of a DER element starting at @p
+static int der_len(const uint8_t * p)
+{
+	if (p[1] < 0x80)
+		return 2 + p[1];
+	if (p[1] == 0x81)
+		return 3 + p[2];
+	if (p[1] == 0x82)
+		return 4 + (((int)p[2] << 8) | p[3]);
+	return -1;
+}
+
+static int do_init()
+{
+	uint8_t nonce[8];
+	uint8_t res[64];
+	struct snapshot s;
+
+	RAND_bytes(nonce, sizeof(nonce));
+	memset(cid, 0xff, sizeof(cid));
+
+	begin(&s);
+	if (transact(U2FHID_INIT, nonce, sizeof(nonce), res) != 17 || memcmp(res, nonce, 8) != 0)
+	{
+		fprintf(stderr, "INIT failed\n");
+		return -1;
+	}
+	account(OP_INIT, &s);
+
+	memmove(cid, res + 8, 4);
+	return 0;
+}
+
+static int do_register(uint8_t * appid, uint8_t * handle, uint8_t * pubkey)
+{
+	uint8_t req[64];
+	uint8_t res[1024];
+	uint8_t msg[1 + 32 + 32 + U2F_KEY_HANDLE_SIZE + 65];
+	uint8_t digest[32];
+	uint16_t sw;
+	int n, off, cert_len;
+	struct snapshot s;
+
+	RAND_bytes(req, 32);
+	memmove(req + 32, appid, 32);
+
+	begin(&s);
+	n = apdu(U2F_REGISTER, 0, req, 64, res, &sw);
+	if (n < 0 || sw != SW_NO_ERROR)
+	{
+		fprintf(stderr, "REGISTER failed, sw %04x\n", sw);
+		return -1;
+	}
+	account(OP_REGISTER, &s);
+
+	if (res[0] != 0x05 || res[1] != 0x04 || res[66] != U2F_KEY_HANDLE_SIZE)
+	{
+		fprintf(stderr, "REGISTER response malformed\n");
+		return -1;
+	}
+	memmove(pubkey, res + 2, 64);
+	memmove(handle, res + 67, U2F_KEY_HANDLE_SIZE);
+	off = 67 + U2F_KEY_HANDLE_SIZE;
+	cert_len = der_len(res + off);
+	if (cert_len != __attest_size || off + cert_len >= n || memcmp(res + off, __attest, cert_len) != 0)
+	{
+		fprintf(stderr, "REGISTER certificate malformed\n");
+		return -1;
+	}
+	off += cert_len;
+
+	msg[0] = 0;
+	memmove(msg + 1, appid, 32);
+	memmove(msg + 33, req, 32);
+	memmove(msg + 65, handle, U2F_KEY_HANDLE_SIZE);
+	msg[65 + U2F_KEY_HANDLE_SIZE] = 0x04;
+	memmove(msg + 66 + U2F_KEY_HANDLE_SIZE, pubkey, 64);
+	sha256(msg, sizeof(msg), digest);
+
+	if (verify(attest_pub, digest, res + off, n - off) != 0)
+	{
+		fprintf(stderr, "REGISTER attestation signature does not verify\n");
+		return -1;
+	}
+	return 0;
+}
+
+// @op is the transaction the request is accounted to
+static int do_authenticate(int op, uint8_t control, const uint8_t * appid, const uint8_t * handle, const uint8_t * pubkey)
+{
+	uint8_t req[32 + 32 + 1 + U2F_KEY_HANDLE_SIZE];
+	uint8_t res[256];
+	uint8_t msg[32 + 1 + 4 + 32];
+	uint8_t digest[32];
+	uint32_t counter;
+	uint16_t sw;
+	int n;
+	struct snapshot s;
+
+	RAND_bytes(req, 32);
+	memmove(req + 32, appid, 32);
+	req[64] = U2F_KEY_HANDLE_SIZE;
+	memmove(req + 65, handle, U2F_KEY_HANDLE_SIZE);
+
+	begin(&s);
+	n = apdu(U2F_AUTHENTICATE, control, req, sizeof(req), res, &sw);
+	if (control == U2F_AUTH_CHECK)
+	{
+		if (n != 0 || sw != SW_CONDITIONS_NOT_SATISFIED)
+		{
+			fprintf(stderr, "AUTHENTICATE check failed, sw %04x\n", sw);
+			return -1;
+		}
+		account(op, &s);
+		return 0;
+	}
+
+	if (n < 5 + 8 || sw != SW_NO_ERROR)
+	{
+		fprintf(stderr, "AUTHENTICATE failed, sw %04x\n", sw);
+		return -1;
+	}
+	account(op, &s);
+
+	counter = ((uint32_t)res[1] << 24) | ((uint32_t)res[2] << 16) | ((uint32_t)res[3] << 8) | res[4];
+	if (res[0] != 1 || counter <= last_counter)
+	{
+		fprintf(stderr, "AUTHENTICATE bad flags %02x or counter %u\n", res[0], counter);
+		return -1;
+	}
+	last_counter = counter;
+
+	memmove(msg, appid, 32);
+	memmove(msg + 32, res, 5);
+	memmove(msg + 37, req, 32);
+	sha256(msg, sizeof(msg), digest);
+
+	if (verify(pubkey, digest, res + 5, n - 5) != 0)
+	{
+		fprintf(stderr, "AUTHENTICATE signature does not verify\n");
+		return -1;
+	}
+	return 0;
+}
+
+// the vendor AUTHENTICATE with foreign key handles ahead of ours, which
+// is found at the last index
+static int do_authenticate_multi(uint8_t control, const uint8_t * appid, const uint8_t * handle, const uint8_t * pubkey)
+{
+	uint8_t req[32 + 32 + 1 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE];
+	uint8_t * last = req + 65 + (U2F_AUTH_MULTI_MAX - 1) * U2F_KEY_HANDLE_SIZE;
+	uint8_t res[256];
+	uint8_t msg[32 + 1 + 4 + 32];
+	uint8_t digest[32];
+	uint32_t counter;
+	uint16_t sw;
+	int n;
+	struct snapshot s;
+
+	RAND_bytes(req, 32);
+	memmove(req + 32, appid, 32);
+	req[64] = U2F_AUTH_MULTI_MAX;
+	RAND_bytes(req + 65, (U2F_AUTH_MULTI_MAX - 1) * U2F_KEY_HANDLE_SIZE);
+	memmove(last, handle, U2F_KEY_HANDLE_SIZE);
+
+	begin(&s);
+	n = apdu(U2F_AUTH_MULTI, control, req, sizeof(req), res, &sw);
+	if (n < 1 || sw != SW_NO_ERROR || res[0] != U2F_AUTH_MULTI_MAX - 1)
+	{
+		fprintf(stderr, "multi AUTHENTICATE %02x failed, sw %04x\n", control, sw);
+		return -1;
+	}
+	if (control == U2F_AUTH_CHECK)
+	{
+		account(OP_MULTI_CHECK, &s);
+		return n == 1 ? 0 : -1;
+	}
+	account(OP_MULTI_SIGN, &s);
+
+	n--;
+	counter = ((uint32_t)res[2] << 24) | ((uint32_t)res[3] << 16) | ((uint32_t)res[4] << 8) | res[5];
+	if (n < 5 + 8 || res[1] != 1 || counter <= last_counter)
+	{
+		fprintf(stderr, "multi AUTHENTICATE bad flags %02x or counter %u\n", res[1], counter);
+		return -1;
+	}
+	last_counter = counter;
+
+	memmove(msg, appid, 32);
+	memmove(msg + 32, res + 1, 5);
+	memmove(msg + 37, req, 32);
+	sha256(msg, sizeof(msg), digest);
+
+	if (verify(pubkey, digest, res + 6, n - 5) != 0)
+	{
+		fprintf(stderr, "multi AUTHENTICATE signature does not verify\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int do_ping(uint16_t len)
+{
+	static uint8_t req[U2FHID_MAX_PAYLOAD];
+	static uint8_t res[U2FHID_MAX_PAYLOAD];
+	struct snapshot s;
+
+	RAND_bytes(req, len);
+
+	begin(&s);
+	if (transact(U2FHID_PING, req, len, res) != len || memcmp(req, res, len) != 0)
+	{
+		fprintf(stderr, "PING of %u bytes failed\n", len);
+		return -1;
+	}
+	account(OP_PING, &s);
+	return 0;
+}
+
+static int do_rng()
+{
+	static uint8_t last[32];
+	uint8_t res[64];
+	struct snapshot s;
+
+	begin(&s);
+	if (transact(U2F_CUSTOM_GET_RNG, NULL, 0, res) != 32 || memcmp(res, last, 32) == 0)
+	{
+		fprintf(stderr, "GET-RNG failed\n");
+		return -1;
+	}
+	account(OP_RNG, &s);
+	memmove(last, res, 32);
+	return 0;
+}
+
+#define RNG_STREAM_LEN		1024
+
+static int do_rng_stream()
+{
+	static uint8_t res[U2FHID_MAX_PAYLOAD];
+	uint8_t req[2] = { RNG_STREAM_LEN >> 8, RNG_STREAM_LEN & 0xff };
+	struct snapshot s;
+	int i, zeros = 0;
+
+	begin(&s);
+	if (transact(U2F_CUSTOM_RNG_STREAM, req, sizeof(req), res) != RNG_STREAM_LEN)
+	{
+		fprintf(stderr, "RNG-STREAM failed\n");
+		return -1;
+	}
+	account(OP_RNG_STREAM, &s);
+
+	// a block left out or sent twice would show as a run of zeros
+	for (i = 0; i < RNG_STREAM_LEN; i++)
+		zeros += res[i] == 0;
+	if (zeros > RNG_STREAM_LEN / 32)
+	{
+		fprintf(stderr, "RNG-STREAM returned %d zero bytes\n", zeros);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_channel(uint8_t * chan);
+
+static void run_for(uint32_t us)
+{
+	uint64_t until = sim_now_us() + us;
+
+	while (sim_now_us() < until)
+		sim_step();
+}
+
+// REGISTER while the user takes half a second to press the button,
+// with a PING on a second channel in the meantime, then a REGISTER
+// cancelled by the host before the press registers.
+static int do_user_wait(const uint8_t * appid)
+{
+	uint8_t req[7 + 64];
+	uint8_t res[1024];
+	uint8_t ping[57];
+	uint8_t own[4], other[4];
+	uint8_t cancel[SIM_HID_PACKET_SIZE];
+	uint8_t cmd;
+	struct snapshot s, p;
+	int n, ret = -1;
+
+	if (open_channel(other) != 0)
+	{
+		fprintf(stderr, "INIT of the second channel failed\n");
+		return -1;
+	}
+
+	req[0] = 0;
+	req[1] = U2F_REGISTER;
+	req[2] = 0;
+	req[3] = 0;
+	req[4] = 0;
+	req[5] = 0;
+	req[6] = 64;
+	RAND_bytes(req + 7, 32);
+	memmove(req + 7 + 32, appid, 32);
+	RAND_bytes(ping, sizeof(ping));
+	memmove(own, cid, 4);
+
+	sim_set_touch(SIM_TOUCH_HOLD);
+	begin(&s);
+	send_request(U2FHID_MSG, req, sizeof(req));
+	run_for(20 * 1000);
+
+	memmove(cid, other, 4);
+	take_snapshot(&p);
+	n = transact(U2FHID_PING, ping, sizeof(ping), res);
+	memmove(cid, own, 4);
+	if (n != sizeof(ping) || memcmp(ping, res, n) != 0)
+	{
+		fprintf(stderr, "PING while waiting for the user failed\n");
+		goto end;
+	}
+	account(OP_WAIT_PING, &p);
+
+	n = recv_response(&cmd, res);
+	if (n < 2 || cmd != U2FHID_MSG || res[n - 2] != 0x90 || res[n - 1] != 0x00)
+	{
+		fprintf(stderr, "REGISTER waiting for the user failed\n");
+		goto end;
+	}
+	account(OP_USER_WAIT, &s);
+
+	RAND_bytes(req + 7, 32);
+	send_request(U2FHID_MSG, req, sizeof(req));
+	run_for(150 * 1000);
+
+	memset(cancel, 0, sizeof(cancel));
+	memmove(cancel, cid, 4);
+	cancel[4] = U2FHID_CANCEL;
+	begin(&s);
+	sim_usb_host_write(cancel);
+	n = recv_response(&cmd, res);
+	if (n != 2 || cmd != U2FHID_MSG || res[0] != 0x69 || res[1] != 0x85)
+	{
+		fprintf(stderr, "cancelled REGISTER not refused\n");
+		goto end;
+	}
+	account(OP_CANCEL, &s);
+	ret = 0;
+
+end:
+	sim_set_touch(SIM_TOUCH_INSTANT);
+	return ret;
+}
+
+// reads the next frame that is not a keepalive, -1 on timeout
+static int recv_frame(uint8_t * frame, uint64_t deadline)
+{
+	while (1)
+	{
+		while (!sim_usb_host_read(frame))
+		{
+			if (sim_now_us() > deadline)
+			{
+				fprintf(stderr, "timeout waiting for a frame\n");
+				return -1;
+			}
+			if (sim_step())
+				return -1;
+		}
+		if (frame[4] != U2FHID_KEEPALIVE)
+			return 0;
+		keepalives++;
+	}
+}
+
+// apdu of a signing vendor AUTHENTICATE with @handle at index @at among
+// foreign key handles, returns its length
+static int multi_sign_apdu(uint8_t * apdu, const uint8_t * appid, const uint8_t * handle, int at)
+{
+	uint8_t * handles = apdu + 7 + 65;
+
+	memset(apdu, 0, 7);
+	apdu[1] = U2F_AUTH_MULTI;
+	apdu[2] = U2F_AUTH_SIGN;
+	apdu[5] = (65 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE) >> 8;
+	apdu[6] = (65 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE) & 0xff;
+	RAND_bytes(apdu + 7, 32);
+	memmove(apdu + 7 + 32, appid, 32);
+	apdu[7 + 64] = U2F_AUTH_MULTI_MAX;
+	RAND_bytes(handles, U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE);
+	memmove(handles + at * U2F_KEY_HANDLE_SIZE, handle, U2F_KEY_HANDLE_SIZE);
+	return 7 + 65 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE;
+}
+
+// A request waits for the user while a second channel keeps sending
+// signing requests with a key handle of its own. The press belongs to
+// the waiting request, every request of the other channel is refused.
+// WAIT-SIGN: a REGISTER waits, the other channel sends AUTHENTICATEs.
+// WAIT-MULTI: a vendor AUTHENTICATE waits with our handle at the last
+// index, the other channel has it at the first; the waiting one has to
+// sign with the handle it verified itself.
+static int do_wait_sign(int op, const uint8_t * appid, const uint8_t * handle)
+{
+	uint8_t first[7 + 65 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE];
+	uint8_t auth[7 + 65 + U2F_AUTH_MULTI_MAX * U2F_KEY_HANDLE_SIZE];
+	uint8_t frames[5][SIM_HID_PACKET_SIZE];
+	uint8_t frame[SIM_HID_PACKET_SIZE];
+	uint8_t other[4];
+	uint64_t deadline;
+	uint16_t first_len, auth_len, res_len = 0;
+	struct snapshot s;
+	int auth_pending = 0, rest, n, i, ret = -1;
+
+	if (open_channel(other) != 0)
+	{
+		fprintf(stderr, "INIT of the second channel failed\n");
+		return -1;
+	}
+
+	if (op == OP_WAIT_MULTI)
+	{
+		first_len = multi_sign_apdu(first, appid, handle, U2F_AUTH_MULTI_MAX - 1);
+		auth_len = multi_sign_apdu(auth, appid, handle, 0);
+	}
+	else
+	{
+		memset(first, 0, 7);
+		first[1] = U2F_REGISTER;
+		first[6] = 64;
+		RAND_bytes(first + 7, 32);
+		memmove(first + 7 + 32, appid, 32);
+		first_len = 7 + 64;
+
+		memset(auth, 0, 7);
+		auth[1] = U2F_AUTHENTICATE;
+		auth[2] = U2F_AUTH_SIGN;
+		auth[6] = 65 + U2F_KEY_HANDLE_SIZE;
+		RAND_bytes(auth + 7, 32);
+		memmove(auth + 7 + 32, appid, 32);
+		auth[7 + 64] = U2F_KEY_HANDLE_SIZE;
+		memmove(auth + 7 + 65, handle, U2F_KEY_HANDLE_SIZE);
+		auth_len = 7 + 65 + U2F_KEY_HANDLE_SIZE;
+	}
+
+	// the button is let go of first, the wait starts from a fresh press
+	sim_set_touch(SIM_TOUCH_NEVER);
+	run_for(100);
+	sim_set_touch(SIM_TOUCH_HOLD);
+	begin(&s);
+	send_request(U2FHID_MSG, first, first_len);
+	deadline = sim_now_us() + TIMEOUT_US;
+
+	while (res_len == 0)
+	{
+		if (!auth_pending)
+		{
+			n = build_frames(other, U2FHID_MSG, auth, auth_len, frames);
+			for (i = 0; i < n; i++)
+				sim_usb_host_write(frames[i]);
+			auth_pending = 1;
+		}
+		if (recv_frame(frame, deadline) != 0)
+			goto end;
+		if (memcmp(frame, other, 4) == 0)
+		{
+			if (frame[4] != U2FHID_MSG || frame[6] != 2 || frame[7] != 0x69 || frame[8] != 0x85)
+			{
+				fprintf(stderr, "request of another channel answered during the wait\n");
+				goto end;
+			}
+			auth_pending = 0;
+		}
+		else if (memcmp(frame, cid, 4) == 0 && frame[4] == U2FHID_MSG)
+		{
+			res_len = ((uint16_t)frame[5] << 8) | frame[6];
+		}
+	}
+	if (res_len == 2)
+	{
+		fprintf(stderr, "%s lost the press to another channel\n", op_names[op]);
+		goto end;
+	}
+	if (op == OP_WAIT_MULTI && frame[7] != U2F_AUTH_MULTI_MAX - 1)
+	{
+		fprintf(stderr, "deferred multi AUTHENTICATE signed with handle %u\n", frame[7]);
+		goto end;
+	}
+	account(op, &s);
+
+	// nobody presses for the last request of the other channel, it is
+	// refused too
+	sim_set_touch(SIM_TOUCH_NEVER);
+	rest = res_len > 57 ? (res_len - 57 + 58) / 59 : 0;
+	while (rest > 0 || auth_pending)
+	{
+		if (recv_frame(frame, deadline) != 0)
+			goto end;
+		if (memcmp(frame, cid, 4) == 0)
+		{
+			rest--;
+		}
+		else if (frame[6] != 2 || frame[7] != 0x69 || frame[8] != 0x85)
+		{
+			fprintf(stderr, "request of another channel answered after the wait\n");
+			goto end;
+		}
+		else
+		{
+			auth_pending = 0;
+		}
+	}
+	ret = 0;
+
+end:
+	sim_set_touch(SIM_TOUCH_INSTANT);
+	return ret;
+}
+
+static uint16_t get_u16(const uint8_t * p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static void report_usb_stats()
+{
+	uint8_t res[64];
+
+	if (transact(U2F_CUSTOM_USB_STATS, res, 0, res) != 14)
+	{
+		fprintf(stderr, "USB stats not available\n");
+		return;
+	}
+	printf("usb tx queue: packets %u, high water %u, full %u times for %u ms, "
+			"response queue wait last %u ms, max %u ms\n",
+			get_u16(res + 1), res[0], get_u16(res + 3), get_u16(res + 5),
+			get_u16(res + 7), get_u16(res + 9));
+	printf("usb rx ring: high water %u, full %u times\n", res[11], get_u16(res + 12));
+
+	if (transact(U2F_CUSTOM_TAG_CACHE_STATS, res, 0, res) != 4)
+	{
+		fprintf(stderr, "tag cache stats not available\n");
+		return;
+	}
+	printf("check tag cache: hits %u, misses %u\n", get_u16(res), get_u16(res + 2));
+}
+
+static void report_smb_stats()
+{
+	uint8_t res[64];
+
+	if (transact(U2F_CUSTOM_SMB_STATS, res, 0, res) != 12)
+	{
+		fprintf(stderr, "SMBus stats not available\n");
+		return;
+	}
+	printf("smbus: time-outs %u, bus errors %u, SCL time-outs %u, recoveries %u (SDA stuck %u), "
+			"atecc retries %u\n",
+			get_u16(res), get_u16(res + 2), get_u16(res + 4), get_u16(res + 6),
+			get_u16(res + 8), get_u16(res + 10));
+}
+
+static void report_atecc_timing()
+{
+	uint8_t res[256];
+	int n, i;
+
+	n = transact(U2F_CUSTOM_ATECC_TIMING, NULL, 0, res);
+	if (n <= 0 || n % 10)
+	{
+		fprintf(stderr, "ATECC timing not available\n");
+		return;
+	}
+	printf("\natecc opcode   p1  first poll ms  worst ms  commands  polls/cmd  nacks\n");
+	for (i = 0; i < n; i += 10)
+	{
+		uint16_t cmds = get_u16(res + i + 4);
+		char p1[5] = "any";
+		if (!cmds)
+			continue;
+		if (res[i + 1] != 0xff)
+			snprintf(p1, sizeof(p1), "0x%02x", res[i + 1]);
+		printf("        0x%02x %4s %14u %9u %9u %10.2f %6u\n", res[i], p1, res[i + 2], res[i + 3],
+				cmds, (double)get_u16(res + i + 6) / cmds, get_u16(res + i + 8));
+	}
+}
+
+// one byte error counts per entry, after the commands and polls
+#define HEALTH_ERRORS		7
+
+static void report_atecc_health()
+{
+	static const char * fields[HEALTH_ERRORS] = {"nacks", "crc", "trunc", "wdog", "wake", "bus", "failed"};
+	uint8_t res[512];
+	int n, i, f;
+
+	n = transact(U2F_CUSTOM_ATECC_HEALTH, NULL, 0, res);
+	if (n <= 0 || n % (6 + HEALTH_ERRORS))
+	{
+		fprintf(stderr, "ATECC health not available\n");
+		return;
+	}
+	printf("\natecc opcode   p1  commands  polls");
+	for (f = 0; f < HEALTH_ERRORS; f++)
+		printf(" %6s", fields[f]);
+	printf("\n");
+	for (i = 0; i < n; i += 6 + HEALTH_ERRORS)
+	{
+		char p1[5] = "any";
+		if (!get_u16(res + i + 2))
+			continue;
+		if (res[i + 1] != 0xff)
+			snprintf(p1, sizeof(p1), "0x%02x", res[i + 1]);
+		if (res[i])
+			printf("        0x%02x %4s", res[i], p1);
+		else
+			printf("       other %4s", p1);
+		printf(" %9u %6u", get_u16(res + i + 2), get_u16(res + i + 4));
+		for (f = 0; f < HEALTH_ERRORS; f++)
+			printf(" %6u", res[i + 6 + f]);
+		printf("\n");
+	}
+}
+
+// the phase times of the last requests, as the token measured them
+static void report_profile()
+{
+	static const char * phases[] = {"hid", "appid", "load", "user", "keygen", "count", "sha", "sign", "write", "flush"};
+	uint8_t res[512];
+	int n, i, f, rec;
+
+	n = transact(U2F_CUSTOM_PROFILE, NULL, 0, res);
+	if (n < 3 || res[1] != sizeof(phases) / sizeof(phases[0]))
+	{
+		fprintf(stderr, "profiles not available\n");
+		return;
+	}
+	rec = 8 + res[1] * 2;
+	if (n != 3 + res[2] * rec)
+	{
+		fprintf(stderr, "profiles of bad length %d\n", n);
+		return;
+	}
+	printf("\nlast requests, ms  ins   p1   sw   total");
+	for (f = 0; f < res[1]; f++)
+		printf(" %6s", phases[f]);
+	printf("\n");
+	for (i = 3; i < n; i += rec)
+	{
+		uint32_t total = ((uint32_t)get_u16(res + i + 4) << 16) | get_u16(res + i + 6);
+		printf("                 0x%02x 0x%02x %04x %7.2f", res[i], res[i + 1], get_u16(res + i + 2), total / 1000.0);
+		for (f = 0; f < res[1]; f++)
+			printf(" %6.2f", get_u16(res + i + 8 + f * 2) * res[0] / 1000.0);
+		printf("\n");
+	}
+}
+
+// response reassembly of one channel in the concurrent test
+struct channel
+{
+	uint8_t cid[4];
+	uint8_t cmd;
+	uint16_t len;
+	uint16_t off;
+	int seq;
+	int done;
+	uint8_t payload[256];
+};
+
+static int open_channel(uint8_t * chan)
+{
+	uint8_t nonce[8];
+	uint8_t res[64];
+	uint8_t own[4];
+	int ret = -1;
+
+	RAND_bytes(nonce, sizeof(nonce));
+	memmove(own, cid, 4);
+	memset(cid, 0xff, sizeof(cid));
+	if (transact(U2FHID_INIT, nonce, sizeof(nonce), res) == 17 && memcmp(res, nonce, 8) == 0)
+	{
+		memmove(chan, res + 8, 4);
+		ret = 0;
+	}
+	memmove(cid, own, 4);
+	return ret;
+}
+
+static int channel_frame(struct channel * ch, const uint8_t * frame)
+{
+	uint16_t n;
+
+	if (ch->seq < 0)
+	{
+		ch->cmd = frame[4];
+		ch->len = ((uint16_t)frame[5] << 8) | frame[6];
+		if (ch->len > sizeof(ch->payload))
+			return -1;
+		n = ch->len < 57 ? ch->len : 57;
+		memmove(ch->payload, frame + 7, n);
+	}
+	else
+	{
+		if (frame[4] != ch->seq)
+			return -1;
+		n = ch->len - ch->off < 59 ? ch->len - ch->off : 59;
+		memmove(ch->payload + ch->off, frame + 5, n);
+	}
+	ch->off += n;
+	ch->seq++;
+	ch->done = ch->off >= ch->len;
+	return 0;
+}
+
+// Every channel sends an AUTHENTICATE check of the same key handle at
+// the same time, with the frames of all channels interleaved like
+// several browsers polling the token. Each channel gets either the
+// 6985 answer or a U2FHID error.
+static int do_concurrent(int channels, const uint8_t * appid, const uint8_t * handle)
+{
+	static struct channel ch[MAX_CHANNELS];
+	static uint8_t frames[MAX_CHANNELS][4][SIM_HID_PACKET_SIZE];
+	uint8_t req[7 + 32 + 32 + 1 + U2F_KEY_HANDLE_SIZE];
+	uint8_t frame[SIM_HID_PACKET_SIZE];
+	uint64_t deadline;
+	struct snapshot s;
+	int nframes = 0, pending, i, j;
+
+	for (i = 0; i < channels; i++)
+	{
+		if (open_channel(ch[i].cid) != 0)
+		{
+			fprintf(stderr, "INIT of channel %d failed\n", i);
+			return -1;
+		}
+	}
+
+	req[0] = 0;
+	req[1] = U2F_AUTHENTICATE;
+	req[2] = U2F_AUTH_CHECK;
+	req[3] = 0;
+	req[4] = 0;
+	req[5] = 0;
+	req[6] = sizeof(req) - 7;
+	RAND_bytes(req + 7, 32);
+	memmove(req + 7 + 32, appid, 32);
+	req[7 + 64] = U2F_KEY_HANDLE_SIZE;
+	memmove(req + 7 + 65, handle, U2F_KEY_HANDLE_SIZE);
+
+	for (i = 0; i < channels; i++)
+	{
+		nframes = build_frames(ch[i].cid, U2FHID_MSG, req, sizeof(req), frames[i]);
+		ch[i].seq = -1;
+		ch[i].off = 0;
+		ch[i].done = 0;
+	}
+
+	begin(&s);
+	for (j = 0; j < nframes; j++)
+		for (i = 0; i < channels; i++)
+			sim_usb_host_write(frames[i][j]);
+
+	deadline = sim_now_us() + TIMEOUT_US;
+	pending = channels;
+	while (pending)
+	{
+		while (!sim_usb_host_read(frame))
+		{
+			if (sim_now_us() > deadline)
+			{
+				fprintf(stderr, "timeout waiting for %d concurrent responses\n", pending);
+				return -1;
+			}
+			if (sim_step())
+				return -1;
+		}
+
+		for (i = 0; i < channels; i++)
+		{
+			if (memcmp(frame, ch[i].cid, 4) == 0)
+				break;
+		}
+		if (i == channels || ch[i].done || channel_frame(&ch[i], frame) != 0)
+		{
+			fprintf(stderr, "unexpected frame in concurrent test\n");
+			return -1;
+		}
+		if (ch[i].done)
+			pending--;
+	}
+
+	for (i = 0; i < channels; i++)
+	{
+		if (ch[i].cmd == U2FHID_MSG && ch[i].len == 2 &&
+				(((uint16_t)ch[i].payload[0] << 8) | ch[i].payload[1]) == SW_CONDITIONS_NOT_SATISFIED)
+		{
+			account(OP_CONCURRENT, &s);
+			// only the first one accounts the time of the whole round
+			take_snapshot(&s);
+		}
+		else if (ch[i].cmd == U2FHID_ERROR)
+			busy_errors++;
+		else
+		{
+			fprintf(stderr, "concurrent AUTHENTICATE failed\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void report(double host_s)
+{
+	struct atecc_model_stats atecc;
+	struct sim_usb_stats usb;
+	uint32_t total = 0;
+	int i;
+
+	printf("%-12s %6s %10s %10s %9s %9s %10s %9s\n",
+			"transaction", "count", "ms/tx", "tx/s", "atecc/tx", "wakes/tx", "i2c B/tx", "i2c tr/tx");
+	for (i = 0; i < OP_MAX; i++)
+	{
+		struct op_stats * st = &op_stats[i];
+		double n = st->count;
+		if (!st->count)
+			continue;
+		total += st->count;
+		printf("%-12s %6u %10.2f %10.2f %9.1f %9.1f %10.1f %9.1f\n",
+				op_names[i], st->count,
+				st->device_us / n / 1000.0,
+				st->device_us ? n * 1e6 / st->device_us : 0.0,
+				st->atecc_cmds / n, st->atecc_wakes / n,
+				st->i2c_bytes / n, st->i2c_transactions / n);
+	}
+
+	atecc_model_get_stats(&atecc);
+	sim_usb_get_stats(&usb);
+	printf("\natecc commands:");
+	for (i = 0; i < 256; i++)
+	{
+		if (atecc.opcode[i])
+			printf(" %02x:%u", i, atecc.opcode[i]);
+	}
+	printf("\natecc busy NACKs %u, watchdog sleeps %u, CRC errors %u\n",
+			atecc.busy_nacks, atecc.watchdog_sleeps, atecc.crc_errors);
+	printf("usb frames out %u, in %u, host NAKed polls %u\n",
+			usb.out_frames, usb.in_frames, usb.out_naks);
+	if (op_stats[OP_CONCURRENT].count || busy_errors)
+		printf("concurrent requests answered with a U2FHID error %u\n", busy_errors);
+	if (keepalives)
+		printf("keepalives while waiting for the user %u\n", keepalives);
+	if (op_stats[OP_BUS_FAULT].count)
+	{
+		struct sim_i2c_stats i2c;
+		sim_i2c_get_stats(&i2c);
+		printf("i2c bus stalls injected %u\n", i2c.stalls);
+	}
+	if (op_stats[OP_RNG_STREAM].count)
+		printf("rng stream of %u bytes: %.0f bytes/s\n", RNG_STREAM_LEN,
+				op_stats[OP_RNG_STREAM].count * RNG_STREAM_LEN * 1e6 / op_stats[OP_RNG_STREAM].device_us);
+	printf("device time %.3f s, host time %.3f s (%.0f tx/s simulated)\n",
+			sim_now_us() / 1e6, host_s, host_s > 0 ? total / host_s : 0.0);
+}
+
+static int do_return(int i, const uint8_t * appid, const uint8_t * handle, const uint8_t * pubkey)
+{
+	struct app * a = &returning[i % RETURNING_APPS];
+
+	if (i < RETURNING_APPS)
+	{
+		memmove(a->appid, appid, 32);
+		memmove(a->handle, handle, U2F_KEY_HANDLE_SIZE);
+		memmove(a->pubkey, pubkey, 64);
+	}
+	return do_authenticate(OP_AUTH_RETURN, U2F_AUTH_SIGN, a->appid, a->handle, a->pubkey);
+}
+
+// signs with the bus hung from a transfer of an ATECC command on, the
+// token has to recover it and redo the command; the first transfers wake
+// the chip
+#define BUS_FAULT_AFTER		4
+
+static int do_bus_fault(const uint8_t * appid, const uint8_t * handle, const uint8_t * pubkey)
+{
+	sim_i2c_stall(BUS_FAULT_AFTER);
+	return do_authenticate(OP_BUS_FAULT, U2F_AUTH_SIGN, appid, handle, pubkey);
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-i poll interval ms] [-p ping length] [-c concurrent channels]\n"
+			"       [-w host think time ms]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+	uint8_t appid[32];
+	uint8_t handle[U2F_KEY_HANDLE_SIZE];
+	uint8_t pubkey[64];
+	struct timespec t0, t1;
+	int iterations = 20;
+	int ping_len = 64;
+	int poll_ms = 4;
+	int channels = 3;
+	int think_ms = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:i:p:c:w:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': iterations = atoi(optarg); break;
+			case 'i': poll_ms = atoi(optarg); break;
+			case 'p': ping_len = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'w': think_ms = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (iterations < 1 || poll_ms < 1 || ping_len < 0 || ping_len > U2FHID_MAX_PAYLOAD
+			|| channels < 0 || channels > MAX_CHANNELS || think_ms < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	think_us = think_ms * 1000;
+
+	sim_provision(NULL, attest_pub);
+	sim_usb_set_poll_interval(poll_ms * 1000);
+	sim_set_touch(SIM_TOUCH_INSTANT);
+	sim_boot();
+	sim_wait_ready();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (do_init() != 0)
+		return 1;
+
+	for (i = 0; i < iterations; i++)
+	{
+		sha256((uint8_t *)&i, sizeof(i), appid);
+
+		if (do_register(appid, handle, pubkey) != 0
+				|| do_authenticate(OP_AUTH_CHECK, U2F_AUTH_CHECK, appid, handle, pubkey) != 0
+				|| do_authenticate(OP_AUTH_PROBE, U2F_AUTH_CHECK, appid, handle, pubkey) != 0
+				|| do_authenticate(OP_AUTH_SIGN, U2F_AUTH_SIGN, appid, handle, pubkey) != 0
+				|| do_return(i, appid, handle, pubkey) != 0
+				|| do_authenticate_multi(U2F_AUTH_CHECK, appid, handle, pubkey) != 0
+				|| do_authenticate_multi(U2F_AUTH_SIGN, appid, handle, pubkey) != 0
+				|| do_ping(ping_len) != 0
+				|| do_rng() != 0
+				|| do_rng_stream() != 0
+				|| do_user_wait(appid) != 0
+				|| do_wait_sign(OP_WAIT_SIGN, appid, handle) != 0
+				|| do_wait_sign(OP_WAIT_MULTI, appid, handle) != 0
+				|| do_bus_fault(appid, handle, pubkey) != 0
+				|| (channels && do_concurrent(channels, appid, handle) != 0))
+		{
+			fprintf(stderr, "iteration %d failed\n", i);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	report((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	report_usb_stats();
+	report_smb_stats();
+	report_atecc_timing();
+	report_atecc_health();
+	report_profile();
+	return 0;
+}
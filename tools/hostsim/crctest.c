@@ -0,0 +1,126 @@
+/*
+ * crctest.c
+ * 		Checks the three crc16_feed() implementations of the firmware
+ * 		against feed_crc()/reverse_bits() of tools/crc16, on every CRC
+ * 		value and byte, on the ATECC config blob of tools/crc16 and on
+ * 		the wake response of the datasheet. Then times each one per
+ * 		byte over 68 byte packets (a PRIVWRITE), as SMBUS0_ISR feeds
+ * 		them.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// the reference implementation and the config blob d[]
+#define main crc16_reference_main
+#include "../crc16/main.c"
+#undef main
+
+// firmware crc16.c, built once per CRC16_IMPL
+uint16_t crc16_feed_bitwise(uint16_t crc, uint8_t b);
+uint16_t crc16_feed_nibble(uint16_t crc, uint8_t b);
+uint16_t crc16_feed_byte(uint16_t crc, uint8_t b);
+
+#define PACKET_LEN		68
+#define TIMED_BYTES		(PACKET_LEN * 100000)
+
+// config blob of tools/crc16
+#define CONFIG_CRC		0xf1b0
+
+static const struct
+{
+	const char * name;
+	uint16_t (*feed)(uint16_t, uint8_t);
+} impls[] = {
+	{"bitwise", crc16_feed_bitwise},
+	{"nibble", crc16_feed_nibble},
+	{"byte", crc16_feed_byte},
+};
+
+#define IMPLS		(sizeof(impls) / sizeof(impls[0]))
+
+static uint16_t crc16_buf(uint16_t (*feed)(uint16_t, uint8_t), const uint8_t * buf, size_t len)
+{
+	uint16_t crc = 0;
+	while (len--)
+		crc = feed(crc, *buf++);
+	return crc;
+}
+
+static int check(unsigned i)
+{
+	static const uint8_t wake[] = {0x04, 0x11, 0x33, 0x43};
+	uint32_t crc;
+	unsigned b;
+	uint16_t got;
+
+	// the reference keeps the CRC reflected
+	for (crc = 0; crc < 0x10000; crc++)
+	{
+		for (b = 0; b < 0x100; b++)
+		{
+			got = impls[i].feed(crc, b);
+			if (got != reverse_bits(feed_crc(reverse_bits(crc), b)))
+			{
+				fprintf(stderr, "%s: crc %04x byte %02x gives %04x\n", impls[i].name, crc, b, got);
+				return -1;
+			}
+		}
+	}
+
+	got = crc16_buf(impls[i].feed, d, sizeof(d) - 1);
+	if (got != CONFIG_CRC)
+	{
+		fprintf(stderr, "%s: config crc %04x, expected %04x\n", impls[i].name, got, CONFIG_CRC);
+		return -1;
+	}
+
+	got = crc16_buf(impls[i].feed, wake, 2);
+	if ((uint8_t)got != wake[2] || (uint8_t)(got >> 8) != wake[3])
+	{
+		fprintf(stderr, "%s: wake response crc %04x\n", impls[i].name, got);
+		return -1;
+	}
+	return 0;
+}
+
+static double ns_per_byte(unsigned i)
+{
+	uint8_t pkt[PACKET_LEN];
+	struct timespec t0, t1;
+	volatile uint16_t sink;
+	uint32_t n;
+
+	for (n = 0; n < PACKET_LEN; n++)
+		pkt[n] = n * 37;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < TIMED_BYTES / PACKET_LEN; n++)
+		sink = crc16_buf(impls[i].feed, pkt, PACKET_LEN);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	(void)sink;
+
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / TIMED_BYTES;
+}
+
+int main()
+{
+	unsigned i;
+	int failed = 0;
+
+	printf("crc16      check  host ns/byte\n");
+	for (i = 0; i < IMPLS; i++)
+	{
+		if (check(i) != 0)
+		{
+			printf("%-10s failed\n", impls[i].name);
+			failed = 1;
+			continue;
+		}
+		printf("%-10s ok     %12.2f\n", impls[i].name, ns_per_byte(i));
+	}
+	return failed;
+}
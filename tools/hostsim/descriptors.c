@@ -0,0 +1,19 @@
+/*
+ * descriptors.c
+ * 		The firmware USB descriptors for the host build. Keil packs the
+ * 		string literals of the string descriptors into byte arrays,
+ * 		which gcc refuses, so those are reduced to their headers. The
+ * 		device, configuration and report descriptors are the firmware
+ * 		ones.
+ *
+ */
+
+#include <si_toolchain.h>
+#include <efm8_usb.h>
+
+#undef UTF16LE_PACKED_STATIC_CONST_STRING_DESC
+#define UTF16LE_PACKED_STATIC_CONST_STRING_DESC(__name, __val, __size) \
+	static const USB_StringDescriptor_TypeDef __name = \
+	{ USB_STRING_DESCRIPTOR_UTF16LE_PACKED, __size * 2, USB_STRING_DESCRIPTOR }
+
+#include "../../firmware/src/descriptors.c"
@@ -0,0 +1,284 @@
+/*
+ * hw.c
+ * 		Board support of the simulated token: SFRs, the virtual clock,
+ * 		the flash pages behind eeprom.c, the touch button and the
+ * 		start up sequence of main().
+ *
+ * 		The clock only moves when the firmware looks at it (every
+ * 		get_ms() costs SIM_GET_MS_COST_US of CPU time) or when a
+ * 		peripheral model spends bus time. The busy waits of the
+ * 		firmware therefore run at the same virtual speed as on the
+ * 		token, while the CPU time of plain code is not modelled
+ * 		except where the firmware accounts for it with mcu_cycles().
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <SI_EFM8UB3_Register_Enums.h>
+#include <efm8_usb.h>
+
+#include "app.h"
+#include "bsp.h"
+#include "gpio.h"
+#include "eeprom.h"
+#include "atecc508a.h"
+#include "configuration.h"
+#include "sanity-check.h"
+
+#include "sim.h"
+
+#define SIM_GET_MS_COST_US		1
+#define SIM_SYSCLK_MHZ			48
+#define SIM_FLASH_SIZE			0x10000
+#define SIM_FLASH_PAGE_SIZE		0x200
+
+volatile uint8_t WDTCN;
+volatile uint8_t RSTSRC;
+volatile uint8_t IE_EA;
+volatile uint8_t EIE2_EUSB0 = 1;
+volatile uint8_t SMB0CN0_STA;
+volatile uint8_t SMB0CN0_STO;
+volatile uint8_t SMB0CN0_ACK;
+volatile uint8_t SMB0CF = SMB0CF_ENSMB__BMASK;
+volatile uint8_t XBR0 = XBR0_SMB0E__BMASK;
+volatile uint8_t U2F_SDA = 1;
+volatile uint8_t U2F_SCL = 1;
+volatile uint8_t U2F_BUTTON = 1;
+volatile uint8_t U2F_LED = 1;
+volatile uint8_t U2F_BUTTON_RESET = 1;
+
+uint32_t data _MS_ = 0;
+
+uint8_t GIT_DESCRIPTION[] = "hostsim";
+uint8_t GIT_DESCRIPTION_SIZE = sizeof(GIT_DESCRIPTION) - 1;
+
+extern BUTTON_STATE_T button_state;
+extern uint32_t button_press_t;
+
+static uint64_t sim_us = 0;
+static uint8_t in_irq = 0;
+static uint8_t touch_mode = SIM_TOUCH_NEVER;
+
+static uint8_t flash[SIM_FLASH_SIZE];
+static uint8_t flash_erased = 0;
+
+
+static void sim_touch()
+{
+	if (touch_mode == SIM_TOUCH_HOLD)
+	{
+		// press while the LED asks for it, let go once it was taken
+		U2F_BUTTON = !(led_is_blinking() && button_state != BST_PRESSED_CONSUMED);
+		return;
+	}
+	if (touch_mode != SIM_TOUCH_INSTANT)
+		return;
+
+	switch (button_state)
+	{
+		case BST_UNPRESSED:
+		case BST_PRESSED_RECENTLY:
+		case BST_PRESSED_REGISTERED_TRANSITIONAL:
+		case BST_PRESSED_REGISTERED_EXT:
+			// the user has been holding the button long enough already
+			U2F_BUTTON = 0;
+			button_state = BST_PRESSED_REGISTERED;
+			button_press_t = _MS_;
+			break;
+		case BST_PRESSED_CONSUMED:
+			U2F_BUTTON = 1;
+			break;
+		default:
+			break;
+	}
+}
+
+uint64_t sim_now_us(void)
+{
+	return sim_us;
+}
+
+void sim_advance_us(uint32_t us)
+{
+	uint64_t target = sim_us + us;
+	uint64_t ev;
+
+	// bus events are interrupts, they wait while interrupts are masked
+	// and never nest
+	if (!in_irq && IE_EA && EIE2_EUSB0)
+	{
+		while ((ev = sim_usb_next_event(sim_us)) <= target)
+		{
+			if (ev > sim_us)
+			{
+				sim_us = ev;
+				_MS_ = (uint32_t)(sim_us / 1000);
+			}
+			in_irq = 1;
+			sim_usb_process(sim_us);
+			in_irq = 0;
+		}
+	}
+
+	sim_us = target;
+	_MS_ = (uint32_t)(sim_us / 1000);
+}
+
+void host_mcu_cycles(uint32_t n)
+{
+	sim_advance_us(n / SIM_SYSCLK_MHZ);
+}
+
+uint32_t host_get_ms()
+{
+	sim_advance_us(SIM_GET_MS_COST_US);
+	sim_touch();
+	return _MS_;
+}
+
+uint32_t host_get_us()
+{
+	sim_advance_us(SIM_GET_MS_COST_US);
+	return (uint32_t)sim_us;
+}
+
+bool USB_GetIntsEnabled(void)
+{
+	return EIE2_EUSB0;
+}
+
+void sim_set_touch(uint8_t mode)
+{
+	touch_mode = mode;
+	if (mode != SIM_TOUCH_INSTANT)
+		U2F_BUTTON = 1;
+}
+
+
+void eeprom_init()
+{
+	uint8_t secbyte = 0xff ^ 80;	// lock the first 40 kB, as eeprom.c
+	if (flash[0xFBFF] == 0xff)
+	{
+		_eeprom_write(0xFBC0, &secbyte, 1, 0x3);
+		_eeprom_write(0xFBFF, &secbyte, 1, 0x1);
+	}
+}
+
+void eeprom_read(uint16_t addr, uint8_t * buf, uint8_t len)
+{
+	watchdog();
+	memmove(buf, flash + addr, len);
+	watchdog();
+}
+
+void eeprom_xor(uint16_t addr, uint8_t * out_buf, uint8_t len)
+{
+	watchdog();
+	while(len--)
+	{
+		*out_buf++ ^= flash[addr++];
+	}
+	watchdog();
+}
+
+void _eeprom_write(uint16_t addr, uint8_t * buf, uint8_t len, uint8_t flags)
+{
+	while(len--)
+	{
+		if ((flags & 0x3) == 0x3)
+		{
+			// erase the whole 512 byte page
+			memset(flash + (addr & ~(SIM_FLASH_PAGE_SIZE - 1)), 0xff, SIM_FLASH_PAGE_SIZE);
+		}
+		else
+		{
+			// programming can only clear bits
+			flash[addr] &= *buf;
+		}
+		addr++;
+		buf++;
+	}
+}
+
+// a new part comes with erased flash
+static void flash_init()
+{
+	if (!flash_erased)
+	{
+		memset(flash, 0xff, sizeof(flash));
+		flash_erased = 1;
+	}
+}
+
+void sim_flash_write(uint16_t addr, const uint8_t * buf, size_t len)
+{
+	flash_init();
+	memmove(flash + addr, buf, len);
+}
+
+void sim_flash_read(uint16_t addr, uint8_t * buf, size_t len)
+{
+	flash_init();
+	memmove(buf, flash + addr, len);
+}
+
+
+void sim_boot(void)
+{
+	flash_init();
+
+	sim_us = 0;
+	_MS_ = 0;
+	IE_EA = 0;
+	sim_usb_reset();
+
+	// start up part of main(), without the debug only tests
+	configuration_read();
+	WDTCN = 5;
+	watchdog();
+	app_init();
+	atecc_sleep();
+	IE_EA = 1;
+	watchdog();
+
+	BUTTON_RESET_OFF();
+	led_off();
+
+	sanity_check(NULL);
+	if (sanity_check_passed)
+		led_blink(1, 0);
+	else
+	{
+		fprintf(stderr, "hostsim: sanity check failed, flash is not provisioned\n");
+		led_blink(LED_BLINK_NUM_INF, 200);
+		led_change_ON_time(100);
+	}
+}
+
+uint8_t sim_step(void)
+{
+	uint8_t ec;
+
+	app_loop();
+
+	ec = get_app_error();
+	if (ec)
+	{
+		// the token would wipe its RAM and wait for the watchdog
+		fprintf(stderr, "hostsim: application error 0x%02x at %u ms\n", ec, (unsigned)_MS_);
+		set_app_error(ERROR_NOTHING);
+	}
+	return ec;
+}
+
+void sim_wait_ready(void)
+{
+	while (button_get_press_state() <= BST_META_READY_TO_USE)
+	{
+		sim_step();
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * SI_EFM8UB3_Register_Enums.h
+ * 		Host replacement for the EFM8UB3 register definitions.  Only the
+ * 		SFRs touched by the portable firmware sources are provided, as
+ * 		plain variables defined in hw.c.
+ *
+ */
+
+#ifndef HOSTSIM_SI_EFM8UB3_REGISTER_ENUMS_H_
+#define HOSTSIM_SI_EFM8UB3_REGISTER_ENUMS_H_
+
+#include <string.h>
+#include "si_toolchain.h"
+
+extern volatile uint8_t WDTCN;
+extern volatile uint8_t RSTSRC;
+extern volatile uint8_t IE_EA;
+extern volatile uint8_t SMB0CN0_STA;
+extern volatile uint8_t SMB0CN0_STO;
+extern volatile uint8_t SMB0CN0_ACK;
+extern volatile uint8_t SMB0CF;
+extern volatile uint8_t XBR0;
+
+#define SMB0CF_ENSMB__BMASK		0x80
+#define XBR0_SMB0E__BMASK		0x04
+
+#define RSTSRC_PORSF__SET		0x02
+#define RSTSRC_SWRSF__SET		0x10
+#define RSTSRC_WDTRSF__SET		0x08
+
+#endif /* HOSTSIM_SI_EFM8UB3_REGISTER_ENUMS_H_ */
@@ -0,0 +1,37 @@
+/*
+ * endian.h
+ * 		Host replacement for the endian.h of the Silicon Labs SDK.
+ * 		The firmware uses these in static initializers (descriptors.c),
+ * 		so they must stay constant expressions, which the glibc inline
+ * 		versions are not. Assumes a little endian host.
+ *
+ */
+
+#ifndef HOSTSIM_ENDIAN_H_
+#define HOSTSIM_ENDIAN_H_
+
+#include_next <endian.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the host build assumes a little endian host"
+#endif
+
+#undef htole16
+#undef htole32
+#undef le16toh
+#undef le32toh
+#undef htobe16
+#undef htobe32
+#undef be16toh
+#undef be32toh
+
+#define htole16(x)		((uint16_t)(x))
+#define htole32(x)		((uint32_t)(x))
+#define le16toh(x)		((uint16_t)(x))
+#define le32toh(x)		((uint32_t)(x))
+#define htobe16(x)		__builtin_bswap16((uint16_t)(x))
+#define htobe32(x)		__builtin_bswap32((uint32_t)(x))
+#define be16toh(x)		__builtin_bswap16((uint16_t)(x))
+#define be32toh(x)		__builtin_bswap32((uint32_t)(x))
+
+#endif /* HOSTSIM_ENDIAN_H_ */
@@ -0,0 +1,48 @@
+/*
+ * si_toolchain.h
+ * 		Host replacement for the Silicon Labs toolchain header.
+ * 		Maps the 8051 memory segment keywords onto plain C so the
+ * 		firmware sources build with gcc.
+ *
+ */
+
+#ifndef HOSTSIM_SI_TOOLCHAIN_H_
+#define HOSTSIM_SI_TOOLCHAIN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define data
+#define idata
+#define xdata
+#define pdata
+#define code
+#define bit		uint8_t
+
+#define SI_SEG_DATA
+#define SI_SEG_IDATA
+#define SI_SEG_XDATA
+#define SI_SEG_PDATA
+#define SI_SEG_CODE
+#define SI_SEG_GENERIC
+
+#define MEM_MODEL_SEG
+
+#define SI_SEGMENT_VARIABLE(name, vartype, locsegment)	vartype name
+#define SI_VARIABLE_SEGMENT_POINTER(name, vartype, targsegment)	vartype * name
+#define SI_SEGMENT_VARIABLE_SEGMENT_POINTER(name, vartype, targsegment, locsegment)	vartype * name
+#define SI_SEGMENT_POINTER(name, vartype, locsegment)	vartype * name
+#define SI_FUNCTION_PTR(name, ret, args)	ret (*name) args
+
+#define SI_INTERRUPT(name, vector)	void name(void)
+#define SI_INTERRUPT_PROTO(name, vector)	void name(void)
+#define SI_REENTRANT_FUNCTION(name, ret, args)	ret name args
+
+// sbit declarations become plain variables, defined in hw.c
+#define SI_SBIT(name, reg, bit)	extern volatile uint8_t name
+#define SI_SFR(name, addr)	extern volatile uint8_t name
+
+#define NOP()
+
+#endif /* HOSTSIM_SI_TOOLCHAIN_H_ */
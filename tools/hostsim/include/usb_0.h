@@ -0,0 +1,22 @@
+/*
+ * usb_0.h
+ * 		Host replacement for the USB0 peripheral driver header.
+ * 		The USB interrupt enable is a plain flag, the emulated bus
+ * 		holds its events back while it is cleared.
+ *
+ */
+
+#ifndef HOSTSIM_USB_0_H_
+#define HOSTSIM_USB_0_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+extern volatile uint8_t EIE2_EUSB0;
+
+#define USB_EnableInts()		do { EIE2_EUSB0 = 1; } while (0)
+#define USB_DisableInts()		do { EIE2_EUSB0 = 0; } while (0)
+
+bool USB_GetIntsEnabled(void);
+
+#endif /* HOSTSIM_USB_0_H_ */
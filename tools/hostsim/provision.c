@@ -0,0 +1,76 @@
+/*
+ * provision.c
+ * 		Loads the ATECC508A model and the flash pages with fresh keys,
+ * 		the way setup_device.sh provisions a token.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "sim.h"
+#include "atecc_model.h"
+
+// flash layout of eeprom.h
+#define EEPROM_PAGE_START(p)		(0x200*(p))
+#define EEPROM_DATA_RMASK 			EEPROM_PAGE_START(40)
+#define EEPROM_DATA_WMASK 			EEPROM_PAGE_START(41)
+#define EEPROM_DATA_U2F_CONST  		EEPROM_PAGE_START(42)
+
+#define WKEY_SLOT			1
+#define DEVICE_KEY_SLOT		5
+#define ATTEST_KEY_SLOT		15
+
+static void sha256(const uint8_t * buf, size_t len, uint8_t * out)
+{
+	EVP_Digest(buf, len, out, NULL, EVP_sha256(), NULL);
+}
+
+static void random_private_key(uint8_t * key)
+{
+	// any 32 byte string below the group order
+	RAND_bytes(key, 32);
+	key[0] &= 0x7f;
+}
+
+void sim_provision(const uint8_t * attest_key, uint8_t * attest_pub)
+{
+	uint8_t key[32];
+	uint8_t msg[96];
+	uint8_t tempkey[32];
+	uint8_t mask[36];
+
+	atecc_model_reset();
+
+	if (attest_key != NULL)
+		memmove(key, attest_key, 32);
+	else
+		random_private_key(key);
+	atecc_model_set_slot(ATTEST_KEY_SLOT, key);
+	atecc_model_get_pubkey(ATTEST_KEY_SLOT, attest_pub);
+
+	RAND_bytes(key, 32);
+	atecc_model_set_slot(DEVICE_KEY_SLOT, key);
+
+	// WMASK is the TempKey after the NONCE pass-through of zeros and
+	// GENDIG of the write key, followed by 4 bytes of its digest
+	RAND_bytes(key, 32);
+	atecc_model_set_slot(WKEY_SLOT, key);
+	memset(msg, 0, sizeof(msg));
+	memmove(msg, key, 32);
+	memmove(msg + 32, "\x15\x02\x01\x00\xee\x01\x23", 7);
+	sha256(msg, sizeof(msg), tempkey);
+	memmove(mask, tempkey, 32);
+	sha256(tempkey, 32, msg);
+	memmove(mask + 32, msg, 4);
+	sim_flash_write(EEPROM_DATA_WMASK, mask, 36);
+
+	RAND_bytes(mask, 36);
+	sim_flash_write(EEPROM_DATA_RMASK, mask, 36);
+
+	RAND_bytes(mask, 32);
+	sim_flash_write(EEPROM_DATA_U2F_CONST, mask, 32);
+}
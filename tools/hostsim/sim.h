@@ -0,0 +1,89 @@
+/*
+ * sim.h
+ * 		Host side interface of the simulated token: virtual clock,
+ * 		emulated USB endpoints, flash pages and the touch button.
+ * 		Deliberately free of the 8051 keyword macros, so it can be
+ * 		included next to OpenSSL and system headers.
+ *
+ */
+
+#ifndef HOSTSIM_SIM_H_
+#define HOSTSIM_SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIM_HID_PACKET_SIZE		64
+
+// Touch handling of the simulated button. Not an enum, the firmware
+// side is built with 8 bit enums like Keil does.
+#define SIM_TOUCH_NEVER			0	// nobody touches the button
+#define SIM_TOUCH_INSTANT		1	// presence is registered as soon as the firmware asks
+#define SIM_TOUCH_HOLD			2	// the button is pressed once the LED blinks and held until taken
+
+// virtual clock, microseconds since power on
+uint64_t sim_now_us(void);
+void sim_advance_us(uint32_t us);
+
+// power on the token and run the start up part of main()
+void sim_boot(void);
+
+// one pass of the firmware main loop; returns the application error
+// code if the firmware stopped on an error (the token is soft reset)
+uint8_t sim_step(void);
+
+// run the main loop until the button is initialized, as the firmware
+// rejects presence checks during the first seconds after power on
+void sim_wait_ready(void);
+
+void sim_set_touch(uint8_t mode);
+
+// flash (EEPROM emulation) contents
+void sim_flash_write(uint16_t addr, const uint8_t * buf, size_t len);
+void sim_flash_read(uint16_t addr, uint8_t * buf, size_t len);
+
+// provision the ATECC508A model and the flash pages like setup_device.sh,
+// with a random attestation key if @attest_key is NULL. Returns the
+// attestation public key X|Y in @attest_pub.
+void sim_provision(const uint8_t * attest_key, uint8_t * attest_pub);
+
+// USB, seen from the host
+void sim_usb_set_poll_interval(uint32_t us);
+// queue an OUT report (64 bytes)
+void sim_usb_host_write(const uint8_t * frame);
+// fetch the next IN report, returns 0 if none available
+int sim_usb_host_read(uint8_t * frame);
+size_t sim_usb_out_pending(void);
+
+struct sim_usb_stats
+{
+	uint32_t out_frames;
+	uint32_t in_frames;
+	// poll intervals in which the host had a report queued but EP1OUT
+	// was not armed, i.e. the host got NAKed
+	uint32_t out_naks;
+};
+void sim_usb_get_stats(struct sim_usb_stats * st);
+
+// SMBus, as seen on the wire
+struct sim_i2c_stats
+{
+	uint32_t transactions;
+	uint32_t nacks;
+	// including the address byte of each transaction
+	uint64_t bytes;
+	// bus stalls injected with sim_i2c_stall
+	uint32_t stalls;
+};
+void sim_i2c_get_stats(struct sim_i2c_stats * st);
+
+// the bus hangs once that many more transfers are done, until the
+// firmware recovers it
+void sim_i2c_stall(uint16_t after);
+
+// from usbd.c, used by the clock to deliver bus events
+uint64_t sim_usb_next_event(uint64_t now);
+void sim_usb_process(uint64_t now);
+void sim_usb_reset(void);
+
+#endif /* HOSTSIM_SIM_H_ */
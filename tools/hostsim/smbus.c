@@ -0,0 +1,209 @@
+/*
+ * smbus.c
+ * 		Replacement for smb_queue() of i2c.c and the SMBus interrupt
+ * 		of Interrupts.c. Every transfer is handed to the ATECC508A
+ * 		model in one piece as it is queued, with the same framing and
+ * 		CRC handling as SMBUS0_ISR, and the virtual clock is advanced
+ * 		by the time the bytes spend on the wire. A stuck bus can be
+ * 		injected, its transfers then stay queued as on a token.
+ *
+ * 		smb_read(), smb_write() and crc16_feed() are the firmware
+ * 		ones, i2c.c is built without its smb_queue().
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <SI_EFM8UB3_Register_Enums.h>
+
+#include "i2c.h"
+#include "crc16.h"
+
+#include "atecc_model.h"
+#include "sim.h"
+
+// 9 bit times at the ~125 kHz clocked by Timer 2
+#define SIM_SMB_BYTE_US		72
+
+data uint8_t SMB_addr 				= 0;
+uint8_t * SMB_write_buf 			= NULL;
+data uint8_t SMB_write_len 			= 0;
+data uint8_t SMB_write_offset 		= 0;
+data uint8_t SMB_read_len 			= 0;
+data uint8_t SMB_read_offset 		= 0;
+uint8_t * SMB_read_buf 				= NULL;
+uint8_t * SMB_write_ext_buf 		= NULL;
+data uint8_t  SMB_write_ext_len 	= 0;
+data uint8_t  SMB_write_ext_offset 	= 0;
+uint16_t  SMB_crc 					= 0;
+data uint8_t  SMB_crc_offset 		= 0;
+data volatile uint8_t SMB_FLAGS 	= 0;
+
+// transfers complete as they are queued, the queue stays empty
+struct smb_xfer * SMB_queue[SMB_QUEUE_LEN];
+data volatile uint8_t SMB_queue_head = 0;
+data volatile uint8_t SMB_queue_tail = 0;
+data volatile uint8_t SMB_fault = 0;
+
+// a slave holding SDA low: transfers hang in the queue until the firmware
+// has run smb_recover(), nothing reaches the ATECC meanwhile
+static uint16_t stall_in = 0;
+static uint8_t stalled = 0;
+static uint16_t stall_recoveries;
+
+static struct sim_i2c_stats stats;
+
+static void bus_time(uint16_t bytes)
+{
+	stats.bytes += bytes;
+	sim_advance_us((uint32_t)bytes * SIM_SMB_BYTE_US);
+}
+
+static void smb_read_stage (uint8_t addr, uint8_t* dest, uint8_t count)
+{
+	uint8_t resp[256];
+	int n;
+	uint8_t c;
+
+	SMB_crc = 0;
+	SMB_crc_offset = 0;
+	SMB_FLAGS = SMB_READ | SMB_BUSY;
+
+	SMB_read_offset = 0;
+	SMB_addr = addr;
+	SMB_read_len = count;
+	SMB_read_buf = dest;
+
+	stats.transactions++;
+	n = atecc_model_read(addr, resp, sizeof(resp));
+	if (n < 0)
+	{
+		stats.nacks++;
+		bus_time(1);
+		SMB_FLAGS |= SMB_RECV_NACK;
+		SMB_BUSY_CLEAR();
+		return;
+	}
+
+	while (SMB_read_offset < SMB_read_len)
+	{
+		c = SMB_read_offset < n ? resp[SMB_read_offset] : 0xff;
+		SMB_read_buf[SMB_read_offset] = c;
+
+		if (SMB_read_offset == 0)
+		{
+			// length from the packet, as the ISR
+			if (SMB_read_buf[0] <= SMB_read_len)
+				SMB_read_len = SMB_read_buf[0];
+			else
+				SMB_FLAGS |= SMB_READ_TRUNC;
+		}
+
+		if (SMB_read_offset < (SMB_read_len - 2))
+		{
+			CRC16_FEED(SMB_crc, c);
+		}
+		SMB_read_offset++;
+	}
+
+	bus_time(1 + SMB_read_len);
+	SMB_BUSY_CLEAR();
+}
+
+static void smb_write_stage (struct smb_xfer * x)
+{
+	uint8_t pkt[2 * 256 + 2];
+	uint16_t n = 0;
+	uint8_t c;
+
+	SMB_crc = 0;
+	SMB_crc_offset = 0;
+	SMB_FLAGS = SMB_WRITE | SMB_BUSY | (x->write_ext_len ? SMB_WRITE_EXT : 0);
+
+	SMB_write_len = x->write_len;
+	SMB_write_buf = x->write_buf;
+	SMB_write_offset = 0;
+	SMB_write_ext_len = x->write_ext_len;
+	SMB_write_ext_buf = x->write_ext_buf;
+	SMB_write_ext_offset = 0;
+	SMB_addr = x->addr;
+
+	while (SMB_write_offset < SMB_write_len)
+	{
+		// dont crc first byte for atecc508a
+		c = SMB_write_buf[SMB_write_offset++];
+		if (SMB_write_offset > 1) CRC16_FEED(SMB_crc, c);
+		pkt[n++] = c;
+	}
+	while (SMB_WRITING_EXT() && SMB_write_ext_offset < SMB_write_ext_len)
+	{
+		c = SMB_write_ext_buf[SMB_write_ext_offset++];
+		CRC16_FEED(SMB_crc, c);
+		pkt[n++] = c;
+	}
+	pkt[n++] = (uint8_t)SMB_crc;
+	pkt[n++] = (uint8_t)(SMB_crc >> 8);
+	SMB_crc_offset = 2;
+
+	stats.transactions++;
+	if (atecc_model_write(x->addr, pkt, n) < 0)
+	{
+		stats.nacks++;
+		bus_time(1);
+		SMB_FLAGS |= SMB_RECV_NACK;
+	}
+	else
+	{
+		bus_time(1 + n);
+	}
+	SMB_BUSY_CLEAR();
+}
+
+int8_t smb_queue(struct smb_xfer * x)
+{
+	if (stall_in && !--stall_in)
+	{
+		stalled = 1;
+		stall_recoveries = smb_stats.recoveries;
+		stats.stalls++;
+	}
+	if (stalled && smb_stats.recoveries == stall_recoveries)
+	{
+		if (SMB_QUEUED() == SMB_QUEUE_LEN)
+			return -1;
+		x->status = SMB_XFER_QUEUED;
+		x->flags = 0;
+		SMB_queue[SMB_queue_head & (SMB_QUEUE_LEN - 1)] = x;
+		SMB_queue_head++;
+		return 0;
+	}
+	stalled = 0;
+
+	x->status = SMB_XFER_QUEUED;
+	SMB_FLAGS = 0;
+	if (x->write_len)
+	{
+		smb_write_stage(x);
+		x->status = SMB_XFER_WRITTEN;
+	}
+	if (!SMB_WAS_NACKED() && (!x->write_len || x->read_len))
+	{
+		smb_read_stage(x->addr, x->read_buf, x->read_len);
+		x->read_len = SMB_read_len;
+	}
+	x->crc = SMB_crc;
+	x->flags = SMB_FLAGS & (SMB_RECV_NACK | SMB_READ_TRUNC | SMB_BUS_ERROR);
+	x->status = SMB_XFER_DONE;
+	return 0;
+}
+
+void sim_i2c_stall(uint16_t after)
+{
+	stall_in = after + 1;
+}
+
+void sim_i2c_get_stats(struct sim_i2c_stats * st)
+{
+	*st = stats;
+}
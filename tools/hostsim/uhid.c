@@ -0,0 +1,396 @@
+/*
+ * uhid.c
+ * 		Virtual U2F token: the host build of the firmware behind a
+ * 		/dev/uhid device with the report descriptor of the token, so
+ * 		client.py, u2f_test.py and browsers can use it unchanged.
+ *
+ * 		The firmware runs on the virtual clock of the simulator, so
+ * 		bus, ATECC and HID framing times are those of the token. When
+ * 		the firmware has nothing to do the daemon sleeps on /dev/uhid
+ * 		and the virtual clock catches up with the wall clock, so
+ * 		button and LED timeouts take their real time.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/uhid.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+
+#include "sim.h"
+#include "atecc_model.h"
+
+#define UHID_PATH			"/dev/uhid"
+#define USB_VENDOR_ID		0x20a0
+#define USB_PRODUCT_ID		0x4287
+
+// main loop passes without bus activity before the daemon sleeps
+#define IDLE_PASSES			16
+#define IDLE_POLL_MS		10
+
+#define U2FHID_INIT_FRAME	0x80
+
+// from descriptors.c, built with the firmware
+extern const uint8_t ReportDescriptor0[34];
+
+struct cmd_stats
+{
+	uint32_t count;
+	uint64_t device_us;
+	uint64_t host_us;
+};
+
+// the request being answered, from its first OUT frame to the last
+// IN frame of the response
+struct transaction
+{
+	uint8_t active;
+	uint8_t cmd;
+	uint16_t req_len;
+	uint16_t res_len;
+	int32_t res_left;
+	uint64_t device_start;
+	uint64_t host_start;
+};
+
+static volatile sig_atomic_t quit = 0;
+static int verbose = 0;
+static struct transaction tx;
+static struct cmd_stats cmd_stats[256];
+
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t host_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int uhid_write(int fd, const struct uhid_event * ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+	if (ret != sizeof(*ev))
+	{
+		perror("uhid write");
+		return -1;
+	}
+	return 0;
+}
+
+static int uhid_create(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, "Nitrokey FIDO U2F (hostsim)");
+	strcpy((char *)ev.u.create2.phys, "hostsim");
+	ev.u.create2.rd_size = sizeof(ReportDescriptor0);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = USB_VENDOR_ID;
+	ev.u.create2.product = USB_PRODUCT_ID;
+	memmove(ev.u.create2.rd_data, ReportDescriptor0, sizeof(ReportDescriptor0));
+
+	return uhid_write(fd, &ev);
+}
+
+static void uhid_destroy(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+}
+
+
+static void track_request(const uint8_t * frame)
+{
+	if (!(frame[4] & U2FHID_INIT_FRAME))
+		return;
+
+	tx.active = 1;
+	tx.cmd = frame[4];
+	tx.req_len = ((uint16_t)frame[5] << 8) | frame[6];
+	tx.res_left = -1;
+	tx.device_start = sim_now_us();
+	tx.host_start = host_us();
+}
+
+static void track_response(const uint8_t * frame)
+{
+	struct cmd_stats * st;
+	uint64_t device_us, elapsed_us;
+
+	if (!tx.active)
+		return;
+
+	if (frame[4] & U2FHID_INIT_FRAME)
+	{
+		tx.res_len = ((uint16_t)frame[5] << 8) | frame[6];
+		tx.res_left = (int32_t)tx.res_len - (SIM_HID_PACKET_SIZE - 7);
+	}
+	else if (tx.res_left > 0)
+	{
+		tx.res_left -= SIM_HID_PACKET_SIZE - 5;
+	}
+
+	if (tx.res_left > 0)
+		return;
+
+	device_us = sim_now_us() - tx.device_start;
+	elapsed_us = host_us() - tx.host_start;
+	st = &cmd_stats[tx.cmd];
+	st->count++;
+	st->device_us += device_us;
+	st->host_us += elapsed_us;
+	tx.active = 0;
+
+	if (verbose)
+	{
+		fprintf(stderr, "cmd %02x req %u B res %u B: device %.2f ms, host %.2f ms\n",
+				tx.cmd, tx.req_len, tx.res_len, device_us / 1000.0, elapsed_us / 1000.0);
+	}
+}
+
+static int handle_event(int fd)
+{
+	struct uhid_event ev, reply;
+	const uint8_t * frame;
+	ssize_t ret;
+
+	ret = read(fd, &ev, sizeof(ev));
+	if (ret < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("uhid read");
+		return -1;
+	}
+
+	switch (ev.type)
+	{
+		case UHID_OUTPUT:
+			// hidraw passes the report number of unnumbered reports along
+			frame = ev.u.output.data;
+			if (ev.u.output.size == SIM_HID_PACKET_SIZE + 1)
+				frame++;
+			else if (ev.u.output.size != SIM_HID_PACKET_SIZE)
+				break;
+			track_request(frame);
+			sim_usb_host_write(frame);
+			break;
+		case UHID_GET_REPORT:
+			memset(&reply, 0, sizeof(reply));
+			reply.type = UHID_GET_REPORT_REPLY;
+			reply.u.get_report_reply.id = ev.u.get_report.id;
+			reply.u.get_report_reply.err = EIO;
+			return uhid_write(fd, &reply);
+		case UHID_SET_REPORT:
+			memset(&reply, 0, sizeof(reply));
+			reply.type = UHID_SET_REPORT_REPLY;
+			reply.u.set_report_reply.id = ev.u.set_report.id;
+			reply.u.set_report_reply.err = EIO;
+			return uhid_write(fd, &reply);
+		default:
+			break;
+	}
+	return 0;
+}
+
+static int forward_responses(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = SIM_HID_PACKET_SIZE;
+
+	while (sim_usb_host_read(ev.u.input2.data))
+	{
+		track_response(ev.u.input2.data);
+		if (uhid_write(fd, &ev) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+static uint64_t activity()
+{
+	struct sim_usb_stats usb;
+	struct sim_i2c_stats i2c;
+
+	sim_usb_get_stats(&usb);
+	sim_i2c_get_stats(&i2c);
+	return (uint64_t)usb.out_frames + usb.in_frames + i2c.transactions;
+}
+
+static int load_attest_key(const char * path, uint8_t * key)
+{
+	FILE * f = fopen(path, "r");
+	EC_KEY * ec;
+	int ret = -1;
+
+	if (f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	ec = PEM_read_ECPrivateKey(f, NULL, NULL, NULL);
+	if (ec != NULL && BN_bn2binpad(EC_KEY_get0_private_key(ec), key, 32) == 32)
+		ret = 0;
+	else
+		fprintf(stderr, "%s: not a P-256 private key\n", path);
+
+	EC_KEY_free(ec);
+	fclose(f);
+	return ret;
+}
+
+static void report()
+{
+	int i;
+
+	fprintf(stderr, "%-8s %6s %12s %12s\n", "command", "count", "device ms", "host ms");
+	for (i = 0; i < 256; i++)
+	{
+		struct cmd_stats * st = &cmd_stats[i];
+		if (!st->count)
+			continue;
+		fprintf(stderr, "%02x       %6u %12.2f %12.2f\n", i, st->count,
+				st->device_us / (double)st->count / 1000.0,
+				st->host_us / (double)st->count / 1000.0);
+	}
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-v] [-t instant|never|hold] [-a attestation-key.pem] [-i poll interval ms]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+	struct pollfd pfd;
+	struct sigaction sa;
+	uint8_t attest_key[32];
+	uint8_t attest_pub[64];
+	uint8_t touch = SIM_TOUCH_INSTANT;
+	uint8_t * key = NULL;
+	uint64_t before, slept;
+	int poll_ms = 4;
+	int idle = 0;
+	int fd, opt, ret;
+
+	while ((opt = getopt(argc, argv, "vt:a:i:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'v': verbose = 1; break;
+			case 't':
+				if (strcmp(optarg, "instant") == 0)
+					touch = SIM_TOUCH_INSTANT;
+				else if (strcmp(optarg, "never") == 0)
+					touch = SIM_TOUCH_NEVER;
+				else if (strcmp(optarg, "hold") == 0)
+					touch = SIM_TOUCH_HOLD;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'a':
+				if (load_attest_key(optarg, attest_key) != 0)
+					return 1;
+				key = attest_key;
+				break;
+			case 'i': poll_ms = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (poll_ms < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(UHID_PATH, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		perror(UHID_PATH);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sim_provision(key, attest_pub);
+	sim_usb_set_poll_interval(poll_ms * 1000);
+	sim_set_touch(touch);
+	sim_boot();
+	sim_wait_ready();
+
+	if (uhid_create(fd) != 0)
+		return 1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!quit)
+	{
+		before = host_us();
+		ret = poll(&pfd, 1, idle >= IDLE_PASSES ? IDLE_POLL_MS : 0);
+		if (ret < 0 && errno != EINTR)
+		{
+			perror("poll");
+			break;
+		}
+		if (idle >= IDLE_PASSES)
+		{
+			// nothing happened on the token while we slept
+			slept = host_us() - before;
+			sim_advance_us((uint32_t)slept);
+		}
+		if (ret > 0 && handle_event(fd) != 0)
+			break;
+
+		before = activity();
+		sim_step();
+		if (forward_responses(fd) != 0)
+			break;
+
+		// frames on the bus are transferred in device time
+		if (activity() == before && sim_usb_next_event(sim_now_us()) == UINT64_MAX)
+			idle++;
+		else
+			idle = 0;
+	}
+
+	uhid_destroy(fd);
+	close(fd);
+	report();
+	return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * usbd.c
+ * 		Emulated EFM8 USB device library, only the interrupt endpoint
+ * 		pair used by the U2F HID interface.
+ *
+ * 		The host polls EP1OUT and EP1IN once per poll interval. An OUT
+ * 		report is accepted only when the firmware has armed EP1OUT with
+ * 		USBD_Read(), otherwise the host is NAKed and retries on the next
+ * 		interval. A report written with USBD_Write() keeps EP1IN busy
+ * 		until the next IN poll. Transfer complete callbacks are called
+ * 		from the poll, like from the USB interrupt on the token.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <SI_EFM8UB3_Register_Enums.h>
+#include <efm8_usb.h>
+
+#include "sim.h"
+
+#define SIM_USB_QUEUE_LEN		256
+// Linux rounds bInterval 5 of the descriptors down to 4 ms
+#define SIM_USB_POLL_US			4000
+
+SI_SEGMENT_VARIABLE(myUsbDevice, USBD_Device_TypeDef, MEM_MODEL_SEG);
+
+struct sim_frame_queue
+{
+	uint8_t frames[SIM_USB_QUEUE_LEN][SIM_HID_PACKET_SIZE];
+	uint16_t head;
+	uint16_t count;
+};
+
+struct sim_endpoint
+{
+	uint8_t busy;
+	uint8_t callback;
+	uint8_t * buf;
+	uint16_t len;
+	uint8_t fifo[SIM_HID_PACKET_SIZE];
+	// bytes loaded with USB_WriteFIFO() ahead of USBD_Write()
+	uint8_t fifo_len;
+};
+
+static struct sim_frame_queue host_out;
+static struct sim_frame_queue host_in;
+static struct sim_endpoint ep_out;
+static struct sim_endpoint ep_in;
+static struct sim_usb_stats stats;
+static uint32_t poll_us = SIM_USB_POLL_US;
+static uint64_t last_poll = 0;
+
+static int queue_push(struct sim_frame_queue * q, const uint8_t * frame)
+{
+	if (q->count == SIM_USB_QUEUE_LEN)
+		return -1;
+	memmove(q->frames[(q->head + q->count) % SIM_USB_QUEUE_LEN], frame, SIM_HID_PACKET_SIZE);
+	q->count++;
+	return 0;
+}
+
+static int queue_pop(struct sim_frame_queue * q, uint8_t * frame)
+{
+	if (q->count == 0)
+		return 0;
+	memmove(frame, q->frames[q->head], SIM_HID_PACKET_SIZE);
+	q->head = (q->head + 1) % SIM_USB_QUEUE_LEN;
+	q->count--;
+	return 1;
+}
+
+
+int8_t USBD_Read(uint8_t epAddr, uint8_t * dat, uint16_t byteCount, bool callback)
+{
+	if (epAddr != EP1OUT)
+		return USB_STATUS_ILLEGAL;
+	if (ep_out.busy)
+		return USB_STATUS_EP_BUSY;
+
+	ep_out.buf = dat;
+	ep_out.len = byteCount;
+	ep_out.callback = callback;
+	ep_out.busy = 1;
+	return USB_STATUS_OK;
+}
+
+int8_t USBD_Write(uint8_t epAddr, uint8_t * dat, uint16_t byteCount, bool callback)
+{
+	if (epAddr == EP0)
+		return USB_STATUS_OK;
+	if (epAddr != EP1IN || byteCount > SIM_HID_PACKET_SIZE)
+		return USB_STATUS_ILLEGAL;
+	if (ep_in.busy)
+		return USB_STATUS_EP_BUSY;
+
+	if (ep_in.fifo_len + byteCount > SIM_HID_PACKET_SIZE)
+		return USB_STATUS_ILLEGAL;
+
+	// the library loads the FIFO right away, after what is in it
+	memset(ep_in.fifo + ep_in.fifo_len, 0, sizeof(ep_in.fifo) - ep_in.fifo_len);
+	memmove(ep_in.fifo + ep_in.fifo_len, dat, byteCount);
+	ep_in.fifo_len = 0;
+	ep_in.buf = dat;
+	ep_in.len = byteCount;
+	ep_in.callback = callback;
+	ep_in.busy = 1;
+	return USB_STATUS_OK;
+}
+
+// only used to put a header in front of the data of USBD_Write()
+void USB_WriteFIFO(uint8_t fifoNum, uint8_t numBytes, uint8_t * dat, bool txPacket)
+{
+	if (fifoNum != 1 || txPacket || ep_in.busy || ep_in.fifo_len + numBytes > SIM_HID_PACKET_SIZE)
+	{
+		fprintf(stderr, "usbd: unsupported USB_WriteFIFO\n");
+		abort();
+	}
+	memmove(ep_in.fifo + ep_in.fifo_len, dat, numBytes);
+	ep_in.fifo_len += numBytes;
+}
+
+USBD_State_TypeDef USBD_GetUsbState(void)
+{
+	return USBD_STATE_CONFIGURED;
+}
+
+bool USBD_EpIsBusy(uint8_t epAddr)
+{
+	switch (epAddr)
+	{
+		case EP1OUT:
+			return ep_out.busy;
+		case EP1IN:
+			return ep_in.busy;
+		default:
+			return false;
+	}
+}
+
+
+uint64_t sim_usb_next_event(uint64_t now)
+{
+	uint64_t t;
+
+	if (!host_out.count && !ep_in.busy)
+		return UINT64_MAX;
+
+	t = (now + poll_us - 1) / poll_us * poll_us;
+	if (t <= last_poll)
+		t = last_poll + poll_us;
+	return t;
+}
+
+void sim_usb_process(uint64_t now)
+{
+	uint16_t len;
+
+	last_poll = now;
+
+	if (host_out.count)
+	{
+		if (ep_out.busy)
+		{
+			len = ep_out.len < SIM_HID_PACKET_SIZE ? ep_out.len : SIM_HID_PACKET_SIZE;
+			memmove(ep_out.buf, host_out.frames[host_out.head], len);
+			host_out.head = (host_out.head + 1) % SIM_USB_QUEUE_LEN;
+			host_out.count--;
+			stats.out_frames++;
+
+			ep_out.busy = 0;
+			if (ep_out.callback)
+				USBD_XferCompleteCb(EP1OUT, USB_STATUS_OK, len, 0);
+		}
+		else
+		{
+			stats.out_naks++;
+		}
+	}
+
+	if (ep_in.busy)
+	{
+		queue_push(&host_in, ep_in.fifo);
+		stats.in_frames++;
+
+		ep_in.busy = 0;
+		if (ep_in.callback)
+			USBD_XferCompleteCb(EP1IN, USB_STATUS_OK, ep_in.len, 0);
+	}
+}
+
+void sim_usb_reset(void)
+{
+	memset(&host_out, 0, sizeof(host_out));
+	memset(&host_in, 0, sizeof(host_in));
+	memset(&ep_out, 0, sizeof(ep_out));
+	memset(&ep_in, 0, sizeof(ep_in));
+	last_poll = 0;
+}
+
+
+void sim_usb_set_poll_interval(uint32_t us)
+{
+	poll_us = us ? us : 1;
+}
+
+void sim_usb_host_write(const uint8_t * frame)
+{
+	queue_push(&host_out, frame);
+}
+
+int sim_usb_host_read(uint8_t * frame)
+{
+	return queue_pop(&host_in, frame);
+}
+
+size_t sim_usb_out_pending(void)
+{
+	return host_out.count;
+}
+
+void sim_usb_get_stats(struct sim_usb_stats * st)
+{
+	*st = stats;
+}
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# superseded by provision.py, which drives all adapters from one process
+
 
 export PATH=$PATH:`pwd`/flashing:../../../u2f_zero_client:../../../gencert
 
@@ -33,7 +33,7 @@
 #
 #
 from __future__ import print_function
-import time, os, sys, array, binascii, signal, random, hashlib
+import time, os, sys, array, binascii, signal, random, hashlib, json, math
 
 try:
     import hid
@@ -184,9 +184,22 @@ class commands:
     U2F_CUSTOM_UPDATE_CONFIG = U2F_VENDOR_FIRST + 4
     U2F_CUSTOM_STATUS = U2F_VENDOR_FIRST + 5
     U2F_CUSTOM_SANITY_CHECK = U2F_VENDOR_FIRST + 6
+    U2F_CUSTOM_RNG_STREAM = U2F_VENDOR_FIRST + 9
+    U2F_CUSTOM_SMB_STATS = U2F_VENDOR_FIRST + 11
+    U2F_CUSTOM_ATECC_HEALTH = U2F_VENDOR_FIRST + 12
+    U2F_CUSTOM_PROFILE = U2F_VENDOR_FIRST + 13
 
     U2F_HID_INIT = 0x86
     U2F_HID_PING = 0x81
+    U2F_HID_MSG = 0x83
+    U2F_HID_KEEPALIVE = 0xbb
+    U2F_HID_ERROR = 0xbf
+
+    U2F_REGISTER = 0x01
+    U2F_AUTHENTICATE = 0x02
+    U2F_VERSION = 0x03
+    U2F_AUTH_SIGN = 0x03
+    U2F_AUTH_CHECK = 0x07
 
 def safe_ord(d):
     try:
@@ -210,9 +223,15 @@ if len(sys.argv) not in [2,3,4,5,6]:
     Specify ECC P-256 private key for token attestation.  Specify temporary output file for generated
     keys.""")
     print('     rng: Continuously dump random numbers from the devices hardware RNG.')
+    print('     rng-bench [<bytes per request>] [<seconds>]: measure sustained RNG throughput of multi frame requests')
     print('     list: list all connected U2F Zero tokens.')
     print('     wink: blink the LED')
     print('     ping <bytes count>: test ping capabilities of the device')
+    print('     ping-bench <bytes count> [<iterations>]: measure ping throughput and per frame round trip time')
+    print('     atecc-health [clear]: print ATECC and I2C error counters per opcode, clear them after reading')
+    print('     profile [clear]: print the time per phase of the last U2F requests, clear them after reading')
+    print('     bench [<iterations>] [<output name>]: latency percentiles of INIT, PING, VERSION, REGISTER,')
+    print('         AUTHENTICATE and GET_RNG, written to <output name>.csv and .json (sign needs FAKE_TOUCH)')
     print('     bootloader-destroy: permanently disable the bootloader')
     print('     fingerprints: print data slots fingerprints (debug firmware only)')
     print('     factory-reset: generate new device key')
@@ -480,6 +499,44 @@ def do_rng(h):
                 sys.stdout.write(data)
                 sys.stdout.flush()
 
+def do_rng_bench(h, num=7609, seconds=10):
+    # One request returns up to 7609 random bytes in continuation frames,
+    # the token generates the next block while the previous frames go out
+    cid = u2fhid_init(h)
+    dlen = int(num)
+    seconds = float(seconds)
+    if dlen < 1 or dlen > 7609:
+        die('rng requests are limited to 1..7609 bytes')
+
+    total_bytes = 0
+    requests = 0
+    t_start = time.time()
+    while time.time() - t_start < seconds:
+        h.write([0] + cid + [commands.U2F_CUSTOM_RNG_STREAM, 0, 2, (dlen >> 8) & 0xFF, dlen & 0xFF])
+        data = []
+        expect = commands.U2F_CUSTOM_RNG_STREAM
+        while len(data) < dlen:
+            ans = h.read(64, 1000)
+            if len(ans) == 0:
+                die('timeout after %d of %d bytes' % (len(data), dlen))
+            if ans[0:4] != cid or ans[4] != expect:
+                die('unexpected response frame %s' % data_to_hex_string(ans[0:7]))
+            if expect == commands.U2F_CUSTOM_RNG_STREAM:
+                if ((ans[5] << 8) | ans[6]) != dlen:
+                    die('device error')
+                data += ans[7:]
+                expect = 0
+            else:
+                data += ans[5:]
+                expect += 1
+        total_bytes += dlen
+        requests += 1
+    elapsed = time.time() - t_start
+
+    print('%d requests of %d bytes in %.3f s' % (requests, dlen, elapsed))
+    print('throughput: %.0f bytes/s' % (total_bytes / elapsed))
+
+
 def get_bit(a, b):
     v = a & (1 << b)
     return 1 if v > 0 else 0
@@ -648,6 +705,82 @@ def u2fhid_init(h):
     h.write([0] + cmd)
     ans = h.read(19, 1000)
     return ans[15:19]
+
+def u2fhid_transact(h, cid, cmd, data=[], timeout=1000):
+    # the request split into frames, the response reassembled from its
+    # continuation frames; keepalives while the token waits are skipped
+    h.write([0] + cid + [cmd, (len(data) >> 8) & 0xFF, len(data) & 0xFF] + data[:57])
+    for seq, i in enumerate(range(57, len(data), 59)):
+        h.write([0] + cid + [seq] + data[i:i + 59])
+    ans = h.read(64, timeout)
+    while len(ans) > 0 and ans[0:4] == cid and ans[4] == commands.U2F_HID_KEEPALIVE:
+        ans = h.read(64, timeout)
+    if len(ans) == 0 or ans[0:4] != cid or ans[4] != cmd:
+        die('no response to command 0x%02x' % cmd)
+    dlen = (ans[5] << 8) | ans[6]
+    res = ans[7:]
+    seq = 0
+    while len(res) < dlen:
+        ans = h.read(64, 1000)
+        if len(ans) == 0 or ans[0:4] != cid or ans[4] != seq:
+            die('lost continuation frame %d of command 0x%02x' % (seq, cmd))
+        res += ans[5:]
+        seq += 1
+    return res[:dlen]
+
+def get_u16(d, i):
+    return (d[i] << 8) | d[i + 1]
+
+def do_atecc_health(h, clear=False):
+    # Per ATECC opcode what it took to get the responses, and how often the
+    # I2C bus had to be recovered; high CRC, truncation or bus error counts
+    # point to a token with marginal I2C timing
+    cid = u2fhid_init(h)
+    smb = u2fhid_transact(h, cid, commands.U2F_CUSTOM_SMB_STATS)
+    res = u2fhid_transact(h, cid, commands.U2F_CUSTOM_ATECC_HEALTH, [1] if clear else [])
+    # two byte counts of commands and polls, then one byte error counts,
+    # they stop at 255
+    errors = ['nacks', 'crc', 'trunc', 'wdog', 'wake', 'bus', 'failed']
+    fields = ['commands', 'polls'] + errors
+    size = 6 + len(errors)
+    print('opcode   p1 ' + ' '.join('%8s' % f for f in fields))
+    for i in range(0, len(res) - size + 1, size):
+        counts = [get_u16(res, i + 2), get_u16(res, i + 4)] + list(res[i + 6:i + size])
+        if not counts[0]:
+            continue
+        opcode = '0x%02x' % res[i] if res[i] else 'other'
+        p1 = 'any' if res[i + 1] == 0xff else '0x%02x' % res[i + 1]
+        print('%6s %4s ' % (opcode, p1) + ' '.join('%8d' % c for c in counts))
+
+    if len(smb) == 12:
+        print('i2c time-outs %d, bus errors %d, SCL time-outs %d, recoveries %d (SDA stuck %d), '
+              'atecc retries %d' % tuple(get_u16(smb, i) for i in range(0, 12, 2)))
+    if clear:
+        print('counters cleared')
+
+def do_profile(h, clear=False):
+    # Where the time of the last U2F requests went, per phase as measured
+    # by the token; 'other' is the time between the phases
+    phases = ['hid', 'appid', 'load-key', 'presence', 'keygen', 'count', 'sha', 'sign', 'write', 'flush']
+    ins_names = {0x01: 'REGISTER', 0x02: 'AUTHENTICATE', 0x03: 'VERSION', 0xc1: 'AUTH-MULTI'}
+    cid = u2fhid_init(h)
+    res = u2fhid_transact(h, cid, commands.U2F_CUSTOM_PROFILE, [1] if clear else [])
+    if len(res) < 3:
+        die('no profiles')
+    unit_us, nphases, count = res[0:3]
+    rec = 8 + nphases * 2
+    if len(res) != 3 + count * rec:
+        die('profiles of bad length %d' % len(res))
+    names = phases[:nphases] + ['phase%d' % i for i in range(len(phases), nphases)]
+    print('%-16s %4s %6s %9s ' % ('request', 'p1', 'sw', 'total ms') + ' '.join('%8s' % n for n in names + ['other']))
+    for i in range(3, len(res), rec):
+        total = ((get_u16(res, i + 4) << 16) | get_u16(res, i + 6)) / 1000.0
+        times = [get_u16(res, i + 8 + 2 * f) * unit_us / 1000.0 for f in range(nphases)]
+        print('%-16s 0x%02x %6s %9.2f ' % (ins_names.get(res[i], '0x%02x' % res[i]), res[i + 1],
+                                          '%04x' % get_u16(res, i + 2), total) +
+              ' '.join('%8.2f' % t for t in times + [max(0, total - sum(times))]))
+    if clear:
+        print('profiles cleared')
 	
 def get_response_packet_payload(cmd_seq):                # Reads an U2FHID packet, checks it's command/sequence field by the given parameter, returns the payload 
     ans = h.read(64, 200)                                
@@ -735,6 +868,143 @@ def do_ping(h, num):
         print('{} {}'.format(len(data_req), len(data_resp)))
 
 
+def do_ping_bench(h, num, iterations=10):
+    # The device echoes every frame as soon as it arrives, so each request
+    # frame is timed until its echo is back
+    cid = u2fhid_init(h)
+    dlen = int(num)
+    iterations = int(iterations)
+    if dlen > 7609:
+        die('ping is limited to 7609 bytes')
+
+    rtts = []
+    total_bytes = 0
+    t_start = time.time()
+    for it in xrange(0, iterations):
+        data = [random.randint(1, 0xFF) for i in xrange(0, dlen)]
+        frames = [cid + [commands.U2F_HID_PING, (dlen >> 8) & 0xFF, dlen & 0xFF] + data[0:57]]
+        rest = data[57:]
+        seq = 0
+        while len(rest) > 0:
+            frames.append(cid + [seq] + rest[:59])
+            rest = rest[59:]
+            seq += 1
+
+        data_resp = []
+        for i, frame in enumerate(frames):
+            t0 = time.time()
+            h.write([0] + frame)
+            ans = h.read(64, 1000)
+            rtts.append(time.time() - t0)
+            if len(ans) == 0:
+                die('timeout waiting for the echo of frame %d' % i)
+            expect = commands.U2F_HID_PING if i == 0 else i - 1
+            if ans[0:4] != cid or ans[4] != expect:
+                die('unexpected response frame %s' % data_to_hex_string(ans[0:7]))
+            data_resp += ans[7:] if i == 0 else ans[5:]
+
+        if data_resp[:dlen] != data:
+            die('Ping ERR in iteration %d' % it)
+        total_bytes += dlen
+    elapsed = time.time() - t_start
+
+    rtts.sort()
+    print('%d pings of %d bytes, %d frames in %.3f s' % (iterations, dlen, len(rtts), elapsed))
+    print('throughput: %.0f bytes/s' % (total_bytes / elapsed))
+    print('frame round trip: min %.2f ms, avg %.2f ms, median %.2f ms, max %.2f ms' % (
+        rtts[0] * 1000, sum(rtts) / len(rtts) * 1000, rtts[len(rtts) // 2] * 1000, rtts[-1] * 1000))
+
+
+def percentile(sorted_samples, p):
+    # nearest rank
+    k = int(math.ceil(p / 100.0 * len(sorted_samples))) - 1
+    return sorted_samples[max(0, k)]
+
+def u2f_apdu(h, cid, ins, p1, data):
+    req = [0, ins, p1, 0, 0, (len(data) >> 8) & 0xFF, len(data) & 0xFF] + data
+    res = u2fhid_transact(h, cid, commands.U2F_HID_MSG, req, 5000)
+    if len(res) < 2:
+        die('APDU 0x%02x: short response' % ins)
+    return res[:-2], (res[-2] << 8) | res[-1]
+
+def do_bench(h, iterations=20, output=None):
+    # Latency of each request type as the host sees it, for comparing
+    # firmware versions. AUTHENTICATE with signing and REGISTER need a
+    # firmware built with FAKE_TOUCH, or a touch for every one of them.
+    iterations = int(iterations)
+    ping_sizes = [8, 57, 512, 2048]
+    cid = u2fhid_init(h)
+
+    res = u2fhid_transact(h, cid, commands.U2F_CUSTOM_STATUS)
+    firmware = binary_to_string(res[9:9 + res[8]])
+    print('firmware %s, %d iterations' % (firmware, iterations))
+
+    samples = {}
+    def timed(name, f):
+        t0 = time.time()
+        r = f()
+        samples.setdefault(name, []).append(time.time() - t0)
+        return r
+
+    appid = [random.randint(0, 0xFF) for i in xrange(0, 32)]
+    for it in xrange(0, iterations):
+        cid = timed('INIT', lambda: u2fhid_init(h))
+
+        for size in ping_sizes:
+            data = [random.randint(0, 0xFF) for i in xrange(0, size)]
+            if timed('PING-%d' % size, lambda: u2fhid_transact(h, cid, commands.U2F_HID_PING, data)) != data:
+                die('PING of %d bytes echoed wrongly' % size)
+
+        res, sw = timed('VERSION', lambda: u2f_apdu(h, cid, commands.U2F_VERSION, 0, []))
+        if sw != 0x9000 or binary_to_string(res) != 'U2F_V2':
+            die('VERSION failed, sw %04x' % sw)
+
+        challenge = [random.randint(0, 0xFF) for i in xrange(0, 32)]
+        res, sw = timed('REGISTER', lambda: u2f_apdu(h, cid, commands.U2F_REGISTER, 0, challenge + appid))
+        if sw != 0x9000 or len(res) < 67 or len(res) < 67 + res[66]:
+            die('REGISTER failed, sw %04x' % sw)
+        handle = res[67:67 + res[66]]
+
+        auth = challenge + appid + [len(handle)] + handle
+        res, sw = timed('AUTH-CHECK', lambda: u2f_apdu(h, cid, commands.U2F_AUTHENTICATE, commands.U2F_AUTH_CHECK, auth))
+        if sw != 0x6985:
+            die('AUTHENTICATE check failed, sw %04x' % sw)
+        res, sw = timed('AUTH-SIGN', lambda: u2f_apdu(h, cid, commands.U2F_AUTHENTICATE, commands.U2F_AUTH_SIGN, auth))
+        if sw != 0x9000 or len(res) < 5 or res[0] != 1:
+            die('AUTHENTICATE failed, sw %04x' % sw)
+
+        res = timed('GET-RNG', lambda: u2fhid_transact(h, cid, commands.U2F_CUSTOM_RNG))
+        if len(res) != 32:
+            die('GET_RNG failed')
+
+    names = ['INIT'] + ['PING-%d' % size for size in ping_sizes] + \
+            ['VERSION', 'REGISTER', 'AUTH-CHECK', 'AUTH-SIGN', 'GET-RNG']
+    fields = ['count', 'min_ms', 'p50_ms', 'p95_ms', 'p99_ms', 'max_ms', 'ops_per_s']
+    results = []
+    print('%-12s %6s %8s %8s %8s %8s %8s %9s' % ('operation', 'count', 'min ms', 'p50 ms', 'p95 ms',
+                                                 'p99 ms', 'max ms', 'ops/s'))
+    for name in names:
+        t = sorted(samples[name])
+        row = dict(operation=name, count=len(t), min_ms=t[0] * 1000,
+                   p50_ms=percentile(t, 50) * 1000, p95_ms=percentile(t, 95) * 1000,
+                   p99_ms=percentile(t, 99) * 1000, max_ms=t[-1] * 1000, ops_per_s=len(t) / sum(t))
+        results.append(row)
+        print('%-12s %6d %8.2f %8.2f %8.2f %8.2f %8.2f %9.2f' % tuple([name] + [row[f] for f in fields]))
+
+    if output is not None:
+        with open(output + '.csv', 'w') as f:
+            f.write(','.join(['firmware', 'operation'] + fields) + '\n')
+            for row in results:
+                f.write(','.join([firmware, row['operation']] +
+                                 [str(row['count'])] + ['%.3f' % row[k] for k in fields[1:]]) + '\n')
+        with open(output + '.json', 'w') as f:
+            json.dump(dict(firmware=firmware, iterations=iterations, date=time.strftime('%Y-%m-%dT%H:%M:%S'),
+                           results=results,
+                           samples_ms=dict((k, [x * 1000 for x in v]) for k, v in samples.items())),
+                      f, indent=1, sort_keys=True)
+        print('written %s.csv and %s.json' % (output, output))
+
+
 def do_config_test(h):
     h.write([0, commands.U2F_CONFIG_TEST_CONFIG])
     data = read_n_tries(h, 5, 64, 3000)
@@ -806,27 +1076,43 @@ if __name__ == '__main__':
     action = sys.argv[1].lower()
     h = None
     SN = None
-    if '-s' in sys.argv:
-        if sys.argv.index('-s') + 1 > len(sys.argv):
+    # arguments of the action, without -s serial-number
+    args = sys.argv[2:]
+    if '-s' in args:
+        i = args.index('-s')
+        if i + 1 >= len(args):
             print('need serial number')
             sys.exit(1)
-        SN = sys.argv[sys.argv.index('-s') + 1]
+        SN = args[i + 1]
+        args = args[:i] + args[i + 2:]
 
     if action == 'configure':
-        if len(sys.argv) < 3:
+        if len(args) < 1:
             print('error: need ecc private key')
             sys.exit(1)
         h = open_u2f(SN)
-        do_configure(h, sys.argv[2])
+        do_configure(h, args[0])
     elif action == 'generate_device_key':
         h = open_u2f(SN)
         do_generate_device_key(h)
     elif action == 'rng':
         h = open_u2f(SN)
         do_rng(h)
+    elif action == 'rng-bench':
+        h = open_u2f(SN)
+        do_rng_bench(h, *args[:2])
+    elif action == 'atecc-health':
+        h = open_u2f(SN)
+        do_atecc_health(h, len(args) > 0 and args[0] == 'clear')
+    elif action == 'profile':
+        h = open_u2f(SN)
+        do_profile(h, len(args) > 0 and args[0] == 'clear')
+    elif action == 'bench':
+        h = open_u2f(SN)
+        do_bench(h, *args[:2])
     elif action == 'update-config':
         h = open_u2f(SN)
-        do_update_config(h, int(sys.argv[2]) if len(sys.argv) >= 3 else False)
+        do_update_config(h, int(args[0]) if len(args) > 0 else False)
     elif action in ['factory-reset', 'wipe']:
         h = open_u2f(SN)
         do_wipe(h)
@@ -840,7 +1126,7 @@ if __name__ == '__main__':
         do_list()
     elif action == 'status':
         h = open_u2f(SN)
-        do_status(h, bool(int(sys.argv[2])) if len(sys.argv) > 2 else True)
+        do_status(h, bool(int(args[0])) if len(args) > 0 else True)
     elif action == 'version':
         h = open_u2f(SN)
         do_version(h)
@@ -857,11 +1143,17 @@ if __name__ == '__main__':
         h = open_u2f(SN)
         bootloader_destroy(h)
     elif action == 'ping':
-        if len(sys.argv) < 3:
+        if len(args) < 1:
+            print('error: need bytes count to send')
+            sys.exit(1)
+        h = open_u2f(SN)
+        do_ping(h, args[0])
+    elif action == 'ping-bench':
+        if len(args) < 1:
             print('error: need bytes count to send')
             sys.exit(1)
         h = open_u2f(SN)
-        do_ping(h, sys.argv[2])
+        do_ping_bench(h, *args[:2])
     else:
         print( 'error: invalid action: ', action)
         sys.exit(1)